@@ -0,0 +1,75 @@
+#pragma once
+
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_sampling.h>
+#include <yocto/yocto_sceneio.h>
+
+#include "render.h"
+#include "scene/scene_hash.h"
+
+namespace yash {
+using namespace yocto;
+
+using json = nlohmann::ordered_json;
+
+// Params shared by the benchmarks.
+struct bench_options {
+  vector<string> scenes     = {};
+  string         output     = "";
+  string         camname    = "";
+  int            resolution = 512;
+  bool           noparallel = false;
+};
+
+// Cli of the shared params.
+inline void add_bench_options(const cli_command& cli, bench_options& params) {
+  add_argument(cli, "scenes", params.scenes,
+      "Scene filenames, or presets as <name>.ypreset.");
+  add_option(cli, "output", params.output, "Output json filename.");
+  add_option(cli, "camera", params.camname, "Camera name.");
+  add_option(
+      cli, "resolution", params.resolution, "Image resolution.", {1, 4096});
+  add_option(cli, "noparallel", params.noparallel, "Disable threading.");
+}
+
+// Load a scene in a hash tree stored in `data`, tesselating subdivs and
+// classifying materials. Returns the index of the camera named `camname`.
+inline Scene_Hash load_bench_scene(const string& filename, Data_Table& data,
+    const string& camname, int& camera_id) {
+  auto error     = string{};
+  auto old_scene = scene_data{};
+  if (!load_scene(filename, old_scene, error)) print_fatal(error);
+  if (!old_scene.subdivs.empty()) tesselate_subdivs(old_scene);
+  camera_id  = find_camera(old_scene, camname);
+  auto scene = create_scene_hash(old_scene, data);
+  make_material_plans(scene);
+  return scene;
+}
+
+// Call `func` with a primary ray through each pixel of a camera, and the
+// random number generator used to make them, so that benchmarks draw the same
+// rays for all the variants they compare.
+template <typename Scene, typename Func>
+inline void for_each_camera_ray(
+    const Scene& scene, int camera_id, int resolution, Func&& func) {
+  auto& camera = scene.cameras(camera_id);
+  auto  size   = camera.aspect >= 1
+                     ? vec2i{resolution, (int)(resolution / camera.aspect)}
+                     : vec2i{(int)(resolution * camera.aspect), resolution};
+  auto  rng    = make_rng(961748941);
+  for (auto j = 0; j < size.y; j++) {
+    for (auto i = 0; i < size.x; i++) {
+      auto ray = sample_camera(
+          camera, {i, j}, size, rand2f(rng), rand2f(rng), false);
+      func(ray, rng);
+    }
+  }
+}
+
+// Save benchmark results as json.
+inline void save_bench_results(const string& filename, const json& results) {
+  auto error = string{};
+  if (!save_text(filename, results.dump(2) + "\n", error)) print_fatal(error);
+}
+
+}  // namespace yash
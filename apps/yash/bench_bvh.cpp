@@ -0,0 +1,286 @@
+#include <yocto/yocto_parallel.h>
+
+#include "bench.h"
+
+using namespace yocto;
+using namespace yash;
+
+// bench params
+struct bench_params : bench_options {};
+
+// Cli
+void add_options(const cli_command& cli, bench_params& params) {
+  add_bench_options(cli, params);
+}
+
+// BVH variants compared by the benchmark.
+struct bench_variant {
+  string name        = "";
+  bool   highquality = false;
+  bool   packed      = false;
+  bool   spatial     = false;
+  bool   linear      = false;
+  bool   embree      = false;
+};
+
+inline vector<bench_variant> bench_variants() {
+  auto variants = vector<bench_variant>{
+      {"default", false, false, false, false, false},
+      {"highquality", true, false, false, false, false},
+      {"packed", true, true, false, false, false},
+      {"spatial", true, false, true, false, false},
+      {"linear", false, false, false, true, false},
+  };
+#ifdef YOCTO_EMBREE
+  variants.push_back({"embree", true, false, false, false, true});
+#endif
+  return variants;
+}
+
+// Build a scene bvh for a variant. Linear BVHs are only available as shape
+// rebuilds, so the shapes are built here and the instances with the default
+// builder.
+template <typename Scene>
+bvh_scene make_bench_bvh(const Scene& scene, const bench_variant& variant,
+    const trace_params& params) {
+  if (!variant.linear) {
+    auto params_           = params;
+    params_.highqualitybvh = variant.highquality;
+    params_.embreebvh      = variant.embree;
+    params_.packedbvh      = variant.packed;
+    params_.spatialbvh     = variant.spatial;
+    return make_bvh(scene, params_);
+  }
+
+  // bvh
+  auto bvh = bvh_scene{};
+
+  // build shape bvhs
+  bvh.shapes.resize(scene.shapes().size());
+  for (auto idx = 0; idx < (int)scene.shapes().size(); idx++) {
+    auto& sbvh   = bvh.shapes[idx];
+    auto  bboxes = shape_bboxes(scene.shapes(idx), params.noparallel);
+    if (bboxes.empty()) continue;
+    build_linear_bvh(sbvh, bboxes);
+    sbvh.elements = (int)bboxes.size();
+    sbvh.cost     = bvh_cost(sbvh);
+  }
+
+  // build instance bvh
+  auto bboxes = vector<bbox3f>(scene.instances().size());
+  bvh.instances.resize(scene.instances().size());
+  for (auto idx = 0; idx < (int)bboxes.size(); idx++) {
+    auto& instance     = scene.instances(idx);
+    bboxes[idx]        = instance_bbox(bvh, instance);
+    bvh.instances[idx] = make_bvh_instance(scene, instance);
+  }
+  update_scene_hashes(bvh, scene);
+  build_bvh(bvh, bboxes, false);
+  return bvh;
+}
+
+// Rays traced by the benchmark, generated once per scene so that all
+// variants trace the same rays.
+struct bench_rays {
+  vector<ray3f> primary = {};
+  vector<ray3f> diffuse = {};
+  vector<ray3f> shadow  = {};
+};
+
+// Make a shadow ray from a surface point toward a point sampled on a light,
+// or an environment direction. The ray starts off the surface and stops
+// before the light, so that it measures occlusion. Rays below the surface
+// are trivially occluded and are not traced.
+template <typename Scene>
+inline bool make_shadow_ray(const Scene& scene, const trace_lights& lights,
+    const vec3f& position, const vec3f& normal, rng_state& rng, ray3f& ray) {
+  auto& light = lights.lights[sample_uniform(
+      (int)lights.lights.size(), rand1f(rng))];
+  auto  origin = position + normal * ray_eps;
+  if (light.instance != invalidid) {
+    auto& instance  = scene.instances(light.instance);
+    auto  shape     = scene.shapes(instance.shape);
+    auto  element   = sample_alias(
+        light.alias_probs, light.alias_ids, rand1f(rng));
+    auto  ruv       = rand2f(rng);
+    auto  uv        = (shape.num_triangles() == 0) ? sample_triangle(ruv) : ruv;
+    auto  lposition = eval_position(scene, instance, element, uv);
+    auto  distance  = length(lposition - origin);
+    if (distance <= 2 * ray_eps) return false;
+    ray = {origin, (lposition - origin) / distance, ray_eps,
+        distance - ray_eps};
+  } else {
+    ray = {origin, sample_light(scene, light, position, rand1f(rng),
+                       rand2f(rng))};
+  }
+  return ray.d != vec3f{0, 0, 0} && dot(ray.d, normal) > 0;
+}
+
+// Make primary rays through each pixel, then a diffuse bounce and a shadow
+// ray toward a sampled light from each primary hit. Shadow rays are ambient
+// occlusion rays if the scene has no lights.
+template <typename Scene>
+bench_rays make_bench_rays(const Scene& scene, const bvh_scene& bvh,
+    const trace_lights& lights, int camera_id, int resolution) {
+  auto rays = bench_rays{};
+  for_each_camera_ray(scene, camera_id, resolution,
+      [&](const ray3f& ray, rng_state& rng) {
+        rays.primary.push_back(ray);
+        auto intersection = intersect_scene(bvh, scene, ray);
+        if (!intersection.hit) return;
+        auto position = eval_position(scene, intersection);
+        auto normal   = eval_normal(scene, intersection);
+        if (dot(normal, ray.d) > 0) normal = -normal;
+        rays.diffuse.push_back(
+            {position, sample_hemisphere_cos(normal, rand2f(rng))});
+        auto shadow = ray3f{};
+        if (lights.lights.empty()) {
+          shadow = {position + normal * ray_eps,
+              sample_hemisphere_cos(normal, rand2f(rng))};
+        } else if (!make_shadow_ray(
+                       scene, lights, position, normal, rng, shadow)) {
+          return;
+        }
+        rays.shadow.push_back(shadow);
+      });
+  return rays;
+}
+
+// Trace rays with the renderer kernels and report timing and traversal
+// counters as json.
+template <bool find_any, typename Scene>
+json bench_trace(const bvh_scene& bvh, const Scene& scene,
+    const vector<ray3f>& rays, bool noparallel) {
+  // timing
+  auto hits  = vector<int>(rays.size(), 0);
+  auto timer = simple_timer{};
+  if (noparallel) {
+    for (auto idx = 0; idx < (int)rays.size(); idx++) {
+      hits[idx] = intersect_scene<find_any>(bvh, scene, rays[idx]).hit;
+    }
+  } else {
+    parallel_for_batch((int)rays.size(), 4096, [&](int idx) {
+      hits[idx] = intersect_scene<find_any>(bvh, scene, rays[idx]).hit;
+    });
+  }
+  auto seconds = elapsed_seconds(timer);
+
+  // counters, from the same kernels, not available for Embree
+  auto counters = bvh_counters{};
+  if (!bvh.embree_bvh) {
+    for (auto& ray : rays) {
+      auto instance = 0, element = 0;
+      auto uv       = vec2f{0, 0};
+      auto distance = 0.0f;
+      intersect_scene<find_any>(
+          bvh, scene, ray, instance, element, uv, distance, counters);
+    }
+  }
+
+  auto num_rays = max((double)rays.size(), 1.0);
+  auto result   = json::object();
+  result["rays"]       = rays.size();
+  result["hits"]       = std::count(hits.begin(), hits.end(), 1);
+  result["seconds"]    = seconds;
+  result["mrays"]      = seconds > 0 ? rays.size() / seconds / 1e6 : 0;
+  result["nodes"]      = counters.nodes / num_rays;
+  result["primitives"] = counters.primitives / num_rays;
+  return result;
+}
+
+// Report structure, cost and memory of a bvh as json.
+inline json bench_stats(const bvh_scene& bvh) {
+  auto nodes = (size_t)0, leaves = (size_t)0, primitives = (size_t)0;
+  auto bytes = (size_t)0, elements = (size_t)0;
+  auto cost  = 0.0;
+  auto count = [&](const bvh_data& bvh) {
+    nodes += bvh.nodes.size();
+    primitives += bvh.primitives.size();
+    for (auto& node : bvh.nodes) leaves += node.internal ? 0 : 1;
+    bytes += bvh.nodes.size() * sizeof(bvh_node) +
+             bvh.primitives.size() * sizeof(int);
+  };
+  count(bvh);
+  bytes += bvh.instances.size() * sizeof(bvh_instance);
+  for (auto& sbvh : bvh.shapes) {
+    count(sbvh);
+    bytes += sbvh.triangles.size() * sizeof(bvh_triangle4) +
+             sbvh.batches.size() * sizeof(int);
+    cost += (double)sbvh.cost * sbvh.elements;
+    elements += sbvh.elements;
+  }
+  auto result = json::object();
+  result["instance_cost"] = bvh.nodes.empty() ? 0 : bvh_cost(bvh);
+  result["shape_cost"]    = elements != 0 ? cost / elements : 0;
+  result["nodes"]         = nodes;
+  result["leaves"]        = leaves;
+  result["primitives"]    = primitives;
+  result["bytes"]         = bytes;
+  return result;
+}
+
+// run benchmark
+void run_bench(const bench_params& params) {
+  auto results = json::array();
+  for (auto& filename : params.scenes) {
+    // scene loading
+    print_progress_begin("load " + path_filename(filename));
+    auto data      = Data_Table{};
+    auto camera_id = 0;
+    auto scene     = load_bench_scene(
+        filename, data, params.camname, camera_id);
+    print_progress_end();
+
+    // trace params
+    auto tparams       = trace_params{};
+    tparams.noparallel = params.noparallel;
+
+    // rays, traced with the default bvh
+    print_progress_begin("make rays");
+    auto rays = make_bench_rays(scene, make_bvh(scene, tparams),
+        make_lights(scene, tparams), camera_id, params.resolution);
+    print_progress_end();
+
+    // variants
+    auto variants = bench_variants();
+    auto result   = json::object();
+    result["scene"]    = filename;
+    result["variants"] = json::array();
+    print_progress_begin("bench bvh", (int)variants.size());
+    for (auto& variant : variants) {
+      auto timer   = simple_timer{};
+      auto bvh     = make_bench_bvh(scene, variant, tparams);
+      auto seconds = elapsed_seconds(timer);
+      auto vresult = json::object();
+      vresult["name"]    = variant.name;
+      vresult["build"]   = seconds;
+      vresult["stats"]   = bench_stats(bvh);
+      vresult["primary"] = bench_trace<false>(
+          bvh, scene, rays.primary, params.noparallel);
+      vresult["diffuse"] = bench_trace<false>(
+          bvh, scene, rays.diffuse, params.noparallel);
+      vresult["shadow"]  = bench_trace<true>(
+          bvh, scene, rays.shadow, params.noparallel);
+      result["variants"].push_back(vresult);
+      print_progress_next();
+    }
+    results.push_back(result);
+  }
+
+  // save results
+  save_bench_results(params.output, results);
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto error    = string{};
+  auto params   = bench_params{};
+  params.output = "bench_bvh.json";
+  auto cli = make_cli("bench_bvh", params, "Benchmark scene BVHs.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  run_bench(params);
+}
+
+// Main
+int main(int argc, const char* argv[]) { run(make_cli_args(argc, argv)); }
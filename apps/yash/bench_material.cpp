@@ -0,0 +1,135 @@
+#include <yocto/yocto_parallel.h>
+
+#include "bench.h"
+
+using namespace yocto;
+using namespace yash;
+
+// bench params
+struct bench_params : bench_options {
+  int repeats = 8;
+};
+
+// Cli
+void add_options(const cli_command& cli, bench_params& params) {
+  add_bench_options(cli, params);
+  add_option(cli, "repeats", params.repeats, "Evaluations of each hit.",
+      {1, 1024});
+}
+
+// Make the intersections of primary rays through each pixel, and of a diffuse
+// bounce from each primary hit.
+template <typename Scene>
+vector<bvh_intersection> make_bench_hits(const Scene& scene,
+    const bvh_scene& bvh, int camera_id, int resolution) {
+  auto hits = vector<bvh_intersection>{};
+  for_each_camera_ray(scene, camera_id, resolution,
+      [&](const ray3f& ray, rng_state& rng) {
+        auto intersection = intersect_scene(bvh, scene, ray);
+        if (!intersection.hit) return;
+        hits.push_back(intersection);
+        auto position = eval_position(scene, intersection);
+        auto normal   = eval_normal(scene, intersection);
+        if (dot(normal, ray.d) > 0) normal = -normal;
+        auto bounce = intersect_scene(bvh, scene,
+            ray3f{position, sample_hemisphere_cos(normal, rand2f(rng))});
+        if (bounce.hit) hits.push_back(bounce);
+      });
+  return hits;
+}
+
+// Evaluate the materials at all hits, with the plans resolved in the bvh or
+// with the full plan, and report timing as json.
+template <bool planned, typename Scene>
+json bench_eval(const Scene& scene, const bvh_scene& bvh,
+    const vector<bvh_intersection>& hits, int repeats, bool noparallel) {
+  auto eval = [&](int idx) {
+    auto& hit      = hits[idx % hits.size()];
+    auto& instance = scene.instances(hit.instance);
+    if constexpr (planned) {
+      return eval_material(scene, bvh, hit);
+    } else {
+      return eval_material<material_plan::full>(scene, instance,
+          scene.materials(instance.material), hit.element, hit.uv, 0, false);
+    }
+  };
+
+  // timing
+  auto num_evals = (int)hits.size() * repeats;
+  auto colors    = vector<vec3f>(num_evals);
+  auto timer     = simple_timer{};
+  if (noparallel) {
+    for (auto idx = 0; idx < num_evals; idx++) colors[idx] = eval(idx).color;
+  } else {
+    parallel_for_batch(num_evals, 4096,
+        [&](int idx) { colors[idx] = eval(idx).color; });
+  }
+  auto seconds = elapsed_seconds(timer);
+
+  auto result       = json::object();
+  result["evals"]   = num_evals;
+  result["seconds"] = seconds;
+  result["mevals"]  = seconds > 0 ? num_evals / seconds / 1e6 : 0;
+  return result;
+}
+
+// Count hits by material plan.
+inline json bench_plans(
+    const bvh_scene& bvh, const vector<bvh_intersection>& hits) {
+  auto counts = array<size_t, 4>{0, 0, 0, 0};
+  for (auto& hit : hits) counts[(int)bvh.instances[hit.instance].plan] += 1;
+  auto result             = json::object();
+  result["full"]          = counts[(int)material_plan::full];
+  result["constant"]      = counts[(int)material_plan::constant];
+  result["colors"]        = counts[(int)material_plan::colors];
+  result["color_texture"] = counts[(int)material_plan::color_texture];
+  return result;
+}
+
+// run benchmark
+void run_bench(const bench_params& params) {
+  auto results = json::array();
+  print_progress_begin("bench material", (int)params.scenes.size());
+  for (auto& filename : params.scenes) {
+    // scene loading
+    auto data      = Data_Table{};
+    auto camera_id = 0;
+    auto scene     = load_bench_scene(
+        filename, data, params.camname, camera_id);
+
+    // hits
+    auto tparams       = trace_params{};
+    tparams.noparallel = params.noparallel;
+    auto bvh           = make_bvh(scene, tparams);
+    auto hits = make_bench_hits(scene, bvh, camera_id, params.resolution);
+
+    auto result       = json::object();
+    result["scene"]   = filename;
+    result["hits"]    = hits.size();
+    result["plans"]   = bench_plans(bvh, hits);
+    result["full"]    = bench_eval<false>(
+        scene, bvh, hits, params.repeats, params.noparallel);
+    result["planned"] = bench_eval<true>(
+        scene, bvh, hits, params.repeats, params.noparallel);
+    results.push_back(result);
+    print_progress_next();
+  }
+
+  // save results
+  save_bench_results(params.output, results);
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto error    = string{};
+  auto params   = bench_params{};
+  params.output = "bench_material.json";
+  auto cli      = make_cli(
+      "bench_material", params, "Benchmark material evaluation plans.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  run_bench(params);
+}
+
+// Main
+int main(int argc, const char* argv[]) { run(make_cli_args(argc, argv)); }
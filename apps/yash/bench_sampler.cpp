@@ -0,0 +1,125 @@
+#include "bench.h"
+
+using namespace yocto;
+using namespace yash;
+
+// bench params
+struct bench_params : bench_options {
+  trace_sampler_type sampler   = trace_sampler_type::path;
+  int                samples   = 256;
+  int                reference = 4096;
+};
+
+// Cli
+void add_options(const cli_command& cli, bench_params& params) {
+  add_bench_options(cli, params);
+  add_option(
+      cli, "sampler", params.sampler, "Sampler type.", trace_sampler_names);
+  add_option(cli, "samples", params.samples,
+      "Largest number of samples measured.", {1, 65536});
+  add_option(cli, "reference", params.reference,
+      "Number of samples of the reference image.", {1, 1 << 20});
+}
+
+// Root mean squared error of a render against a reference image.
+inline double render_error(const trace_state& state, const image_data& ref) {
+  auto image = get_render(state);
+  auto error = 0.0;
+  for (auto idx = (size_t)0; idx < image.pixels.size(); idx++) {
+    auto diff = xyz(image.pixels[idx]) - xyz(ref.pixels[idx]);
+    error += dot(diff, diff);
+  }
+  return std::sqrt(error / (3.0 * max(image.pixels.size(), (size_t)1)));
+}
+
+// Render with a sequence and report the error at each power of two samples
+// as json.
+template <typename Scene>
+json bench_sequence(const Scene& scene, const bvh_scene& bvh,
+    const trace_lights& lights, const image_data& reference,
+    const trace_params& params) {
+  auto state   = make_state(scene, params);
+  auto samples = json::array();
+  auto errors  = json::array();
+  auto timer   = simple_timer{};
+  while (state.samples < params.samples) {
+    trace_samples(state, scene, bvh, lights, params);
+    if ((state.samples & (state.samples - 1)) != 0) continue;
+    samples.push_back(state.samples);
+    errors.push_back(render_error(state, reference));
+  }
+  auto result       = json::object();
+  result["seconds"] = elapsed_seconds(timer);
+  result["samples"] = samples;
+  result["errors"]  = errors;
+  return result;
+}
+
+// run benchmark
+void run_bench(const bench_params& params) {
+  auto results = json::array();
+  for (auto& filename : params.scenes) {
+    // scene loading
+    print_progress_begin("load " + path_filename(filename));
+    auto data      = Data_Table{};
+    auto camera_id = 0;
+    auto scene     = load_bench_scene(
+        filename, data, params.camname, camera_id);
+    print_progress_end();
+
+    // trace params
+    auto tparams       = trace_params{};
+    tparams.camera     = camera_id;
+    tparams.sampler    = params.sampler;
+    tparams.resolution = params.resolution;
+    tparams.noparallel = params.noparallel;
+    auto bvh           = make_bvh(scene, tparams);
+    auto lights        = make_lights(scene, tparams);
+
+    // reference, with independent samples and a seed of its own
+    print_progress_begin("render reference", params.reference);
+    auto rparams    = tparams;
+    rparams.samples = params.reference;
+    rparams.seed    = hash_sample(tparams.seed);
+    auto reference  = make_state(scene, rparams);
+    while (reference.samples < rparams.samples) {
+      trace_samples(reference, scene, bvh, lights, rparams);
+      print_progress_next();
+    }
+    auto reference_image = get_render(reference);
+
+    // sequences
+    auto result         = json::object();
+    result["scene"]     = filename;
+    result["sequences"] = json::object();
+    print_progress_begin("bench sequences", (int)trace_sequence_names.size());
+    for (auto idx = 0; idx < (int)trace_sequence_names.size(); idx++) {
+      auto sparams     = tparams;
+      sparams.samples  = params.samples;
+      sparams.sequence = (trace_sequence_type)idx;
+      result["sequences"][trace_sequence_names[idx]] = bench_sequence(
+          scene, bvh, lights, reference_image, sparams);
+      print_progress_next();
+    }
+    results.push_back(result);
+  }
+
+  // save results
+  save_bench_results(params.output, results);
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto error        = string{};
+  auto params       = bench_params{};
+  params.output     = "bench_sampler.json";
+  params.resolution = 128;
+  auto cli          = make_cli(
+      "bench_sampler", params, "Benchmark the convergence of sequences.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  run_bench(params);
+}
+
+// Main
+int main(int argc, const char* argv[]) { run(make_cli_args(argc, argv)); }
@@ -0,0 +1,130 @@
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_sampling.h>
+#include <yocto/yocto_shape.h>
+
+#include "render.h"
+#include "scene/scene_hash.h"
+
+using namespace yocto;
+using namespace yash;
+
+// check params
+struct check_params {
+  int triangles = 20000;
+  int rays      = 20000;
+};
+
+// Cli
+void add_options(const cli_command& cli, check_params& params) {
+  add_option(cli, "triangles", params.triangles, "Random triangles.",
+      {16, 1000000});
+  add_option(cli, "rays", params.rays, "Random rays.", {16, 1000000});
+}
+
+// Make a soup of random triangles, with a stack of copies of one triangle, so
+// that leaves have ties and partial batches.
+inline shape_data make_check_shape(int triangles) {
+  auto shape = shape_data{};
+  auto rng   = make_rng(7);
+  for (auto idx = 0; idx < triangles; idx++) {
+    auto center = idx < 8 ? vec3f{0, 0, 0} : rand3f(rng) * 2 - 1;
+    auto base   = (int)shape.positions.size();
+    for (auto k = 0; k < 3; k++) {
+      auto offset = idx < 8 ? vec3f{k == 1 ? 0.1f : 0, k == 2 ? 0.1f : 0, 0}
+                            : (rand3f(rng) - 0.5f) * 0.2f;
+      shape.positions.push_back(center + offset);
+    }
+    shape.triangles.push_back({base, base + 1, base + 2});
+  }
+  return shape;
+}
+
+// Check that packed BVHs give the same hits as unpacked ones, bit for bit,
+// for closest-hit, any-hit and packet queries. Exits with an error otherwise.
+void run_check(const check_params& params) {
+  // scene
+  auto old_scene = make_shape_scene(make_check_shape(params.triangles));
+  auto data      = Data_Table{};
+  auto scene     = create_scene_hash(old_scene, data);
+  make_material_plans(scene);
+
+  // rays from outside the soup toward it, some through the stacked triangles
+  auto rng  = make_rng(11);
+  auto rays = vector<ray3f>{};
+  for (auto idx = 0; idx < params.rays; idx++) {
+    auto origin = sample_sphere(rand2f(rng)) * 3;
+    auto target = idx % 8 == 0 ? vec3f{0.02f, 0.02f, 0}
+                               : rand3f(rng) * 2 - 1;
+    rays.push_back({origin, normalize(target - origin)});
+  }
+
+  auto failures = 0;
+  auto same     = [](const bvh_intersection& a, const bvh_intersection& b) {
+    return a.hit == b.hit &&
+           (!a.hit || (a.instance == b.instance && a.element == b.element &&
+                          a.uv == b.uv && a.distance == b.distance));
+  };
+  for (auto spatial : {false, true}) {
+    auto name              = string{spatial ? "spatial" : "highquality"};
+    auto tparams           = trace_params{};
+    tparams.noparallel     = true;
+    tparams.highqualitybvh = true;
+    tparams.spatialbvh     = spatial;
+    auto bvh               = make_bvh(scene, tparams);
+    tparams.packedbvh      = true;
+    auto packed            = make_bvh(scene, tparams);
+
+    // single rays
+    auto closest = 0, any = 0;
+    for (auto& ray : rays) {
+      if (!same(intersect_scene(bvh, scene, ray),
+              intersect_scene(packed, scene, ray)))
+        closest++;
+      if (intersect_scene<true>(bvh, scene, ray).hit !=
+          intersect_scene<true>(packed, scene, ray).hit)
+        any++;
+    }
+
+    // packets of rays with a shared origin
+    auto packets = 0;
+    for (auto idx = 0; idx + 16 <= (int)rays.size(); idx += 16) {
+      auto packet = array<ray3f, 16>{};
+      for (auto i = 0; i < 16; i++)
+        packet[i] = {rays[idx].o, rays[idx + i].d};
+      auto intersections        = array<bvh_intersection, 16>{};
+      auto packed_intersections = array<bvh_intersection, 16>{};
+      intersect_scene_packet(bvh, scene, packet, 0xffff, intersections);
+      intersect_scene_packet(
+          packed, scene, packet, 0xffff, packed_intersections);
+      for (auto i = 0; i < 16; i++) {
+        if (!same(intersections[i], packed_intersections[i])) packets++;
+      }
+    }
+
+    if (closest != 0 || any != 0 || packets != 0) {
+      print_info(name + ": packed hits differ, " + std::to_string(closest) +
+                 " closest, " + std::to_string(any) + " any, " +
+                 std::to_string(packets) + " packet");
+      failures++;
+    }
+  }
+
+  print_info("triangles:       " + std::to_string(params.triangles));
+  print_info("rays:            " + std::to_string(params.rays));
+  if (failures != 0)
+    print_fatal(std::to_string(failures) + " bvh checks failed");
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto error  = string{};
+  auto params = check_params{};
+  auto cli    = make_cli(
+      "check_bvh", params, "Check packed BVHs against unpacked ones.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  run_check(params);
+}
+
+// Main
+int main(int argc, const char* argv[]) { run(make_cli_args(argc, argv)); }
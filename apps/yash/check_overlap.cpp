@@ -0,0 +1,121 @@
+#include <yocto/yocto_bvh.h>
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_sampling.h>
+#include <yocto/yocto_shape.h>
+
+using namespace yocto;
+
+// check params
+struct check_params {
+  int   queries  = 20000;
+  float distance = 0.1f;
+};
+
+// Cli
+void add_options(const cli_command& cli, check_params& params) {
+  add_option(cli, "queries", params.queries, "Random query points.",
+      {16, 1000000});
+  add_option(
+      cli, "distance", params.distance, "Max overlap distance.", {0, 10});
+}
+
+// Make a scene with a triangle and a quad mesh without radius, a point set and
+// a line set, each instanced with its own rotation and translation.
+inline scene_data make_check_scene() {
+  auto scene = scene_data{};
+  scene.shapes.push_back(quads_to_triangles(make_sphere(32)));
+  scene.shapes.push_back(make_sphere(24));
+  scene.shapes.push_back(
+      make_random_points(4096, {1, 1, 1}, 1, 0.01f, 3));
+  scene.shapes.push_back(
+      make_lines({4, 64}, {1, 1}, {1, 1}, {0.01f, 0.01f}));
+  for (auto idx = 0; idx < (int)scene.shapes.size(); idx++) {
+    auto& instance = scene.instances.emplace_back();
+    instance.shape = idx;
+    instance.frame = translation_frame(vec3f{idx * 0.8f - 1.2f, 0, 0}) *
+                     rotation_frame(vec3f{0, 1, 1}, idx * 0.7f);
+  }
+  return scene;
+}
+
+// Compare a batch of overlaps against single queries. Returns the number of
+// queries that differ.
+template <typename Single>
+inline int check_overlaps(const string& name, const bvh_overlaps& overlaps,
+    const vector<vec3f>& positions, Single&& single) {
+  auto failures = 0, hits = 0;
+  for (auto idx = 0; idx < (int)positions.size(); idx++) {
+    auto intersection = single(positions[idx]);
+    auto element      = intersection.hit ? intersection.element : -1;
+    auto instance     = intersection.hit ? intersection.instance : -1;
+    if (intersection.hit) hits++;
+    if (overlaps.elements[idx] != element ||
+        overlaps.instances[idx] != instance ||
+        (intersection.hit &&
+            (overlaps.uvs[idx] != intersection.uv ||
+                overlaps.distances[idx] != intersection.distance))) {
+      if (failures++ < 8)
+        print_info(name + ": query " + std::to_string(idx) + " differs");
+    }
+  }
+  print_info(name + ": " + std::to_string(hits) + " hits");
+  if (hits == 0) {
+    print_info(name + ": no query hits");
+    failures++;
+  }
+  return failures;
+}
+
+// Check that batched overlap queries return the same results as single
+// queries, for each shape and for the scene, with closest and any overlaps.
+// Exits with an error otherwise.
+void run_check(const check_params& params) {
+  auto scene = make_check_scene();
+  auto bvh   = make_bvh(scene, true);
+
+  // queries around the scene
+  auto rng       = make_rng(5);
+  auto positions = vector<vec3f>(params.queries);
+  for (auto& position : positions)
+    position = (rand3f(rng) * 2 - 1) * vec3f{2.5f, 1.5f, 1.5f};
+
+  auto failures = 0;
+  for (auto find_any : {false, true}) {
+    auto suffix = string{find_any ? " (any)" : ""};
+    for (auto idx = 0; idx < (int)scene.shapes.size(); idx++) {
+      auto& shape    = scene.shapes[idx];
+      auto& sbvh     = bvh.shapes[idx];
+      auto  overlaps = overlap_bvh(
+          sbvh, shape, positions, params.distance, find_any);
+      failures += check_overlaps("shape " + std::to_string(idx) + suffix,
+          overlaps, positions, [&](const vec3f& position) {
+            return overlap_bvh(
+                sbvh, shape, position, params.distance, find_any);
+          });
+    }
+    auto overlaps = overlap_bvh(bvh, scene, positions, params.distance,
+        find_any);
+    failures += check_overlaps("scene" + suffix, overlaps, positions,
+        [&](const vec3f& position) {
+          return overlap_bvh(bvh, scene, position, params.distance, find_any);
+        });
+  }
+
+  print_info("queries:         " + std::to_string(params.queries));
+  if (failures != 0)
+    print_fatal(std::to_string(failures) + " mismatched overlap queries");
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto error  = string{};
+  auto params = check_params{};
+  auto cli    = make_cli(
+      "check_overlap", params, "Check batched against single overlap queries.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  run_check(params);
+}
+
+// Main
+int main(int argc, const char* argv[]) { run(make_cli_args(argc, argv)); }
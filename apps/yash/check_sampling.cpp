@@ -0,0 +1,199 @@
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_shape.h>
+
+#include <cstdio>
+
+#include "checkpoint.h"
+#include "render.h"
+#include "scene/scene_hash.h"
+
+using namespace yocto;
+using namespace yash;
+
+// check params
+struct check_params {
+  int   resolution = 32;
+  int   batch      = 4;
+  float tolerance  = 1e-4f;
+};
+
+// Cli
+void add_options(const cli_command& cli, check_params& params) {
+  add_option(
+      cli, "resolution", params.resolution, "Image resolution.", {4, 1024});
+  add_option(cli, "batch", params.batch, "Samples in a batch.", {2, 64});
+  add_option(cli, "tolerance", params.tolerance,
+      "Largest relative error accepted for merged partitions.");
+}
+
+// Integrators checked, as the ways the renderer and the viewer trace samples.
+enum struct check_mode { sample, tile, tiles, wavefront };
+const auto check_mode_names = vector<string>{
+    "sample", "tile", "tiles", "wavefront"};
+
+// Trace the samples `[first, first + samples)` for each pixel, as in the
+// viewer, without advancing the sample count of the state.
+template <typename Scene>
+inline void trace_check_samples(trace_state& state, const Scene& scene,
+    const bvh_scene& bvh, const trace_lights& lights, check_mode mode,
+    int first, int samples, const trace_params& params) {
+  if (mode == check_mode::tiles) {
+    auto tiles = make_tiles(
+        state.width, state.height, params.tilesize, params.tileorder);
+    for (auto& tile : tiles) {
+      trace_tile_samples(
+          state, scene, bvh, lights, tile, first, samples, params);
+    }
+    return;
+  }
+  for (auto sample = first; sample < first + samples; sample++) {
+    if (mode == check_mode::wavefront) {
+      trace_wavefront(state, scene, bvh, lights, sample, params);
+    } else if (mode == check_mode::tile) {
+      auto tiles_x = (state.width + trace_tile_size - 1) / trace_tile_size;
+      auto tiles_y = (state.height + trace_tile_size - 1) / trace_tile_size;
+      for (auto j = 0; j < tiles_y; j++) {
+        for (auto i = 0; i < tiles_x; i++) {
+          trace_tile(state, scene, bvh, lights, i, j, sample, params);
+        }
+      }
+    } else {
+      for (auto j = 0; j < state.height; j++) {
+        for (auto i = 0; i < state.width; i++) {
+          trace_sample(state, scene, bvh, lights, i, j, sample, params);
+        }
+      }
+    }
+  }
+}
+
+// Format an error in scientific notation.
+inline string format_error(float error) {
+  auto buffer = array<char, 32>{};
+  snprintf(buffer.data(), buffer.size(), "%.2e", error);
+  return buffer.data();
+}
+
+// Largest relative error between two buffers, with an absolute floor for
+// values near zero. Buffers of different sizes have an infinite error.
+template <typename T>
+inline float max_error(const vector<T>& a, const vector<T>& b) {
+  if (a.size() != b.size()) return flt_max;
+  auto error = 0.0f;
+  for (auto idx = (size_t)0; idx < a.size(); idx++) {
+    for (auto c = 0; c < (int)(sizeof(T) / sizeof(float)); c++) {
+      auto va = a[idx][c], vb = b[idx][c];
+      error   = max(error,
+          std::abs(va - vb) / max(1.0f, max(std::abs(va), std::abs(vb))));
+    }
+  }
+  return error;
+}
+
+// Check that the samples of a batch draw different random numbers, that a
+// batch matches the same samples traced one at a time, and that merged
+// partitions match a single render up to float rounding. Exits with an error
+// otherwise.
+void run_check(const check_params& params) {
+  // scene
+  auto old_scene = make_shape_scene(make_sphere(), true);
+  auto data      = Data_Table{};
+  auto scene     = create_scene_hash(old_scene, data);
+  make_material_plans(scene);
+
+  // renderer
+  auto tparams       = trace_params{};
+  tparams.resolution = params.resolution;
+  tparams.noparallel = true;
+  auto bvh           = make_bvh(scene, tparams);
+  auto lights        = make_lights(scene, tparams);
+
+  auto failures = 0;
+  for (auto idx = 0; idx < (int)check_mode_names.size(); idx++) {
+    auto mode = (check_mode)idx;
+    auto name = check_mode_names[idx];
+
+    // camera rays are traced as packets by tiles
+    tparams.raypackets = mode == check_mode::tile;
+
+    // the first two samples of a batch
+    auto first = make_state(scene, tparams), second = first;
+    trace_check_samples(first, scene, bvh, lights, mode, 0, 1, tparams);
+    trace_check_samples(second, scene, bvh, lights, mode, 1, 1, tparams);
+    if (first.image == second.image) {
+      print_info(name + ": samples in a batch are identical");
+      failures++;
+    }
+
+    // a batch against samples one at a time
+    auto batch = make_state(scene, tparams), single = batch;
+    trace_check_samples(
+        batch, scene, bvh, lights, mode, 0, params.batch, tparams);
+    for (auto sample = 0; sample < params.batch; sample++) {
+      trace_check_samples(single, scene, bvh, lights, mode, sample, 1, tparams);
+    }
+    if (batch.image != single.image) {
+      print_info(name + ": batch differs from single samples");
+      failures++;
+    }
+  }
+
+  // partitions against a single render, for each sequence; merging adds the
+  // partial sums, while a single render adds one sample at a time, so the
+  // images match up to float rounding
+  tparams.raypackets = false;
+  tparams.samples    = 16;
+  auto merge_error   = 0.0f;
+  for (auto idx = 0; idx < (int)trace_sequence_names.size(); idx++) {
+    tparams.sequence = (trace_sequence_type)idx;
+    auto single      = make_state(scene, tparams);
+    while (!is_done(single, tparams))
+      trace_samples(single, scene, bvh, lights, tparams);
+    auto merged = trace_state{};
+    for (auto partition = 0; partition < 2; partition++) {
+      auto pparams        = tparams;
+      auto range          = partition_samples(tparams, partition, 2);
+      pparams.firstsample = range.x;
+      pparams.samples     = range.y;
+      auto partial        = make_state(scene, pparams);
+      while (!is_done(partial, pparams))
+        trace_samples(partial, scene, bvh, lights, pparams);
+      auto error = string{};
+      if (partition == 0) {
+        merged = std::move(partial);
+      } else if (!merge_state(merged, partial, error)) {
+        print_fatal(error);
+      }
+    }
+    auto error = max(max_error(merged.image, single.image),
+        max(max_error(merged.albedo, single.albedo),
+            max_error(merged.normal, single.normal)));
+    merge_error = max(merge_error, error);
+    if (merged.samples != single.samples || error > params.tolerance) {
+      print_info(trace_sequence_names[idx] +
+                 ": partitions differ from a single render by " +
+                 format_error(error));
+      failures++;
+    }
+  }
+
+  print_info("modes:           " + std::to_string(check_mode_names.size()));
+  print_info("batch:           " + std::to_string(params.batch));
+  print_info("merge error:     " + format_error(merge_error));
+  if (failures != 0)
+    print_fatal(std::to_string(failures) + " sampling checks failed");
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto error  = string{};
+  auto params = check_params{};
+  auto cli    = make_cli(
+      "check_sampling", params, "Check the samples traced in batches and partitions.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  run_check(params);
+}
+
+// Main
+int main(int argc, const char* argv[]) { run(make_cli_args(argc, argv)); }
@@ -0,0 +1,157 @@
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_sampling.h>
+
+#include <algorithm>
+#include <cstdio>
+
+#include "render.h"
+#include "shading.h"
+
+using namespace yocto;
+using namespace yash;
+
+// check params
+struct check_params {
+  int   points    = 1 << 20;
+  int   seed      = 7;
+  float tolerance = 1e-4f;
+};
+
+// Cli
+void add_options(const cli_command& cli, check_params& params) {
+  add_option(cli, "points", params.points, "Number of shading points.",
+      {shading_lanes, 1 << 26});
+  add_option(cli, "seed", params.seed, "Random seed.");
+  add_option(cli, "tolerance", params.tolerance,
+      "Largest relative error accepted.");
+}
+
+// Shading point compared by the check.
+struct check_point {
+  material_point material = {};
+  vec3f          normal   = {0, 0, 0};
+  vec3f          outgoing = {0, 0, 0};
+  vec3f          incoming = {0, 0, 0};
+};
+
+// Make random shading points with the batched materials, sorted by material
+// as wavefront paths with `sortpaths`. Directions are drawn on the whole
+// sphere, so that both sides of the surface are checked, and some points are
+// perfectly smooth, so that zeroed lanes are checked.
+inline vector<check_point> make_check_points(int count, int seed) {
+  auto types = array<material_type, 4>{material_type::matte,
+      material_type::glossy, material_type::reflective,
+      material_type::gltfpbr};
+  auto rng    = make_rng(seed);
+  auto points = vector<check_point>(count);
+  for (auto& point : points) {
+    auto& material     = point.material;
+    material.type      = types[rand1i(rng, (int)types.size())];
+    material.color     = rand3f(rng);
+    material.ior       = 1 + rand1f(rng);
+    material.metallic  = rand1f(rng);
+    material.roughness = rand1f(rng) < 0.1f
+                             ? 0
+                             : max(min_roughness, rand1f(rng) * rand1f(rng));
+    point.normal       = sample_sphere(rand2f(rng));
+    point.outgoing     = sample_sphere(rand2f(rng));
+    point.incoming     = sample_sphere(rand2f(rng));
+  }
+  std::stable_sort(points.begin(), points.end(), [](auto& a, auto& b) {
+    return a.material.type < b.material.type;
+  });
+  return points;
+}
+
+// Format an error in scientific notation.
+inline string format_error(float error) {
+  auto buffer = array<char, 32>{};
+  snprintf(buffer.data(), buffer.size(), "%.2e", error);
+  return buffer.data();
+}
+
+// Relative error, with an absolute floor for values near zero.
+inline float check_error(float a, float b) {
+  return std::abs(a - b) / max(1.0f, max(std::abs(a), std::abs(b)));
+}
+
+// Compare batched and scalar BRDFs and pdfs, and report the timing of both.
+// Exits with an error if a lane differs by more than the tolerance.
+void run_check(const check_params& params) {
+  auto points  = make_check_points(params.points, params.seed);
+  auto count   = (int)points.size() / shading_lanes * shading_lanes;
+  auto scalar  = vector<vec4f>(count);
+  auto batched = vector<vec4f>(count);
+
+  // scalar
+  auto scalar_timer = simple_timer{};
+  for (auto idx = 0; idx < count; idx++) {
+    auto& [material, normal, outgoing, incoming] = points[idx];
+    auto bsdfcos = eval_bsdfcos(material, normal, outgoing, incoming);
+    auto pdf     = sample_bsdfcos_pdf(material, normal, outgoing, incoming);
+    scalar[idx]  = {bsdfcos.x, bsdfcos.y, bsdfcos.z, pdf};
+  }
+  auto scalar_time = elapsed_nanoseconds(scalar_timer);
+
+  // batched
+  auto batched_timer = simple_timer{};
+  for (auto start = 0; start < count; start += shading_lanes) {
+    auto batch = shading_batch{};
+    for (auto lane = 0; lane < shading_lanes; lane++) {
+      auto& [material, normal, outgoing, incoming] = points[start + lane];
+      set_lane(batch, lane, material, normal, outgoing, incoming);
+    }
+    auto bsdfcos = vec3f_lanes{};
+    auto pdf     = float_lanes{};
+    eval_bsdfcos_lanes(batch, bsdfcos, pdf);
+    for (auto lane = 0; lane < shading_lanes; lane++) {
+      auto value = get_lane(bsdfcos, lane);
+      batched[start + lane] = {value.x, value.y, value.z, pdf[lane]};
+    }
+  }
+  auto batched_time = elapsed_nanoseconds(batched_timer);
+
+  // compare
+  auto max_error = 0.0f, max_pdf_error = 0.0f;
+  auto failures = 0;
+  for (auto idx = 0; idx < count; idx++) {
+    auto error = max(check_error(scalar[idx].x, batched[idx].x),
+        max(check_error(scalar[idx].y, batched[idx].y),
+            check_error(scalar[idx].z, batched[idx].z)));
+    auto pdf_error = check_error(scalar[idx].w, batched[idx].w);
+    max_error      = max(max_error, error);
+    max_pdf_error  = max(max_pdf_error, pdf_error);
+    if (error > params.tolerance || pdf_error > params.tolerance) {
+      if (failures++ < 8) {
+        auto& point = points[idx];
+        print_info("mismatch at " + std::to_string(idx) + ": type " +
+                   std::to_string((int)point.material.type) + ", bsdfcos " +
+                   format_error(error) + ", pdf " + format_error(pdf_error));
+      }
+    }
+  }
+
+  print_info("points:          " + std::to_string(count));
+  print_info("max bsdf error:  " + format_error(max_error));
+  print_info("max pdf error:   " + format_error(max_pdf_error));
+  print_info("scalar:          " + format_duration(scalar_time));
+  print_info("batched:         " + format_duration(batched_time));
+  print_info("speedup:         " +
+             std::to_string((double)scalar_time / (double)batched_time));
+  if (failures != 0)
+    print_fatal(std::to_string(failures) + " mismatched shading points");
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto error  = string{};
+  auto params = check_params{};
+  auto cli    = make_cli(
+      "check_shading", params, "Check batched against scalar shading.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  run_check(params);
+}
+
+// Main
+int main(int argc, const char* argv[]) { run(make_cli_args(argc, argv)); }
@@ -0,0 +1,142 @@
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_color.h>
+
+#include "scene/texture_encoding.h"
+
+using namespace yocto;
+using namespace yash;
+
+// check params
+struct check_params {
+  int size = 16;
+};
+
+// Cli
+void add_options(const cli_command& cli, check_params& params) {
+  add_option(cli, "size", params.size, "Texture size.", {4, 1024});
+}
+
+// Largest difference between the decoded texels of a texture and its pixels.
+inline float decode_error(const texture_data& texture,
+    texture_encoding encoding, const vector<byte>& texels) {
+  auto error = 0.0f;
+  for (auto j = 0; j < texture.height; j++) {
+    for (auto i = 0; i < texture.width; i++) {
+      auto idx     = (size_t)j * texture.width + i;
+      auto pixel   = texture.pixelsf.empty()
+                         ? byte_to_float(texture.pixelsb[idx])
+                         : texture.pixelsf[idx];
+      auto decoded = decode_texel(encoding, texels, texture.width, i, j);
+      error        = max(error, max(abs(decoded - pixel)));
+    }
+  }
+  return error;
+}
+
+// Check that each encoding is chosen for the textures it applies to, and that
+// decoding its texels gives back the pixels, exactly for the lossless
+// encodings and within the block tolerance for bc1. Exits with an error
+// otherwise.
+void run_check(const check_params& params) {
+  auto size     = params.size;
+  auto failures = 0;
+  auto check    = [&](const string& name, const texture_data& texture,
+                   bool lossy, texture_encoding expected, float tolerance) {
+    auto texels   = vector<byte>{};
+    auto encoding = encode_texture(texels, texture, lossy);
+    if (encoding != expected) {
+      print_info(name + ": wrong encoding");
+      failures++;
+      return;
+    }
+    auto error = decode_error(texture, encoding, texels);
+    if (error > tolerance) {
+      print_info(name + ": error " + std::to_string(error));
+      failures++;
+    }
+  };
+  auto make_texture = [size](bool hdr) {
+    auto texture   = texture_data{};
+    texture.width  = size;
+    texture.height = size;
+    if (hdr) texture.pixelsf.resize((size_t)size * size);
+    if (!hdr) texture.pixelsb.resize((size_t)size * size);
+    return texture;
+  };
+
+  // gray
+  auto r8 = make_texture(false);
+  for (auto idx = 0; idx < size * size; idx++) {
+    auto value      = (byte)((idx * 37) % 256);
+    r8.pixelsb[idx] = {value, value, value, 255};
+  }
+  check("r8", r8, false, texture_encoding::r8, 0);
+
+  // gray and alpha
+  auto ra8 = make_texture(false);
+  for (auto idx = 0; idx < size * size; idx++) {
+    auto value       = (byte)((idx * 37) % 256);
+    ra8.pixelsb[idx] = {value, value, value, (byte)((idx * 11) % 256)};
+  }
+  check("ra8", ra8, false, texture_encoding::ra8, 0);
+
+  // half floats, with alpha, negatives and values below the normal range
+  auto rgba16f = make_texture(true);
+  for (auto idx = 0; idx < size * size; idx++) {
+    rgba16f.pixelsf[idx] = {half_to_float((uint16_t)(idx * 97)),
+        -(float)idx / 8, std::ldexp((float)(idx % 16), -20), 0.5f};
+  }
+  check("rgba16f", rgba16f, false, texture_encoding::rgba16f, 0);
+
+  // shared exponent, as read from radiance files
+  auto rgbe = make_texture(true);
+  for (auto idx = 0; idx < size * size; idx++) {
+    rgbe.pixelsf[idx] = rgbe_to_float({(byte)(128 + idx % 128),
+        (byte)((idx * 7) % 256), (byte)((idx * 13) % 256),
+        (byte)(120 + idx % 16)});
+  }
+  check("rgbe", rgbe, false, texture_encoding::rgbe, 0);
+
+  // block compression of a gradient between two colors
+  auto gradient = make_texture(false);
+  for (auto j = 0; j < size; j++) {
+    for (auto i = 0; i < size; i++) {
+      auto t                         = (float)(i + j) / (2 * size - 2);
+      gradient.pixelsb[j * size + i] = float_to_byte(
+          lerp(vec4f{0.9f, 0.2f, 0.1f, 1}, vec4f{0.1f, 0.5f, 0.8f, 1}, t));
+    }
+  }
+  check("bc1 gradient", gradient, true, texture_encoding::bc1, 0.06f);
+
+  // block compression of colors with the same channel sum, that have an axis
+  // orthogonal to the diagonal
+  for (auto& [name, color] : vector<pair<string, vec4b>>{
+           {"red/blue", {40, 40, 255, 255}}, {"red/green", {40, 255, 40, 255}}}) {
+    auto checker = make_texture(false);
+    for (auto j = 0; j < size; j++) {
+      for (auto i = 0; i < size; i++) {
+        checker.pixelsb[j * size + i] = (i + j) % 2 ? color
+                                                     : vec4b{255, 40, 40, 255};
+      }
+    }
+    check("bc1 " + name, checker, true, texture_encoding::bc1, 0.02f);
+  }
+
+  print_info("size:            " + std::to_string(size));
+  if (failures != 0)
+    print_fatal(std::to_string(failures) + " texture checks failed");
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto error  = string{};
+  auto params = check_params{};
+  auto cli    = make_cli(
+      "check_textures", params, "Check the round trip of texture encodings.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  run_check(params);
+}
+
+// Main
+int main(int argc, const char* argv[]) { run(make_cli_args(argc, argv)); }
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <yocto/yocto_sceneio.h>
+#include <yocto/yocto_trace.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include "scene/hash_tree/hash.h"
+
+// Deflate coders of the stb libraries built in yocto.
+extern "C" {
+unsigned char* stbi_zlib_compress(
+    unsigned char* data, int data_len, int* out_len, int quality);
+char* stbi_zlib_decode_malloc(const char* buffer, int len, int* outlen);
+}
+
+namespace yash {
+using namespace yocto;
+
+// Version of the checkpoint format.
+const auto checkpoint_version = 6;
+
+// Checkpoint header, with the hash of the scene and the params that change the
+// estimate or the sequence of samples. Checkpoints are resumed only with a
+// matching scene and params.
+struct checkpoint_header {
+  char     magic[4]    = {'Y', 'C', 'K', 'P'};
+  int      version     = checkpoint_version;
+  Hash     scene       = {};
+  uint64_t seed        = 0;
+  int      width       = 0;
+  int      height      = 0;
+  int      samples     = 0;
+  int      first       = 0;
+  int      camera      = 0;
+  int      sampler     = 0;
+  int      falsecolor  = 0;
+  int      bounces     = 0;
+  float    clamp       = 0;
+  int      nocaustics  = 0;
+  int      envhidden   = 0;
+  int      tentfilter  = 0;
+  int      sequence    = 0;
+  int      adaptive    = 0;
+  float    targeterror = 0;
+  int      wavefront   = 0;
+  int      lightbvh    = 0;
+  int      mipmaps     = 0;
+  int      trilinear   = 0;
+};
+
+inline checkpoint_header make_checkpoint_header(const trace_state& state,
+    const trace_params& params, const Hash& scene) {
+  auto header        = checkpoint_header{};
+  header.scene       = scene;
+  header.seed        = params.seed;
+  header.width       = state.width;
+  header.height      = state.height;
+  header.samples     = state.samples;
+  header.first       = params.firstsample;
+  header.camera      = params.camera;
+  header.sampler     = (int)params.sampler;
+  header.falsecolor  = (int)params.falsecolor;
+  header.bounces     = params.bounces;
+  header.clamp       = params.clamp;
+  header.nocaustics  = params.nocaustics ? 1 : 0;
+  header.envhidden   = params.envhidden ? 1 : 0;
+  header.tentfilter  = params.tentfilter ? 1 : 0;
+  header.sequence    = (int)params.sequence;
+  header.adaptive    = state.pixel_samples.empty() ? 0 : 1;
+  header.targeterror = params.targeterror;
+  header.wavefront   = params.wavefront ? 1 : 0;
+  header.lightbvh    = params.lightbvh ? 1 : 0;
+  header.mipmaps     = params.mipmaps ? 1 : 0;
+  header.trilinear   = params.trilinear ? 1 : 0;
+  return header;
+}
+
+// Check whether two checkpoints were rendered from the same scene with the
+// same params, except for their range of samples.
+inline bool match_checkpoint_header(
+    const checkpoint_header& a, const checkpoint_header& b) {
+  return a.scene == b.scene && a.seed == b.seed &&
+         a.width == b.width && a.height == b.height && a.camera == b.camera &&
+         a.sampler == b.sampler && a.falsecolor == b.falsecolor &&
+         a.bounces == b.bounces && a.clamp == b.clamp &&
+         a.nocaustics == b.nocaustics && a.envhidden == b.envhidden &&
+         a.tentfilter == b.tentfilter && a.sequence == b.sequence &&
+         a.adaptive == b.adaptive && a.targeterror == b.targeterror &&
+         a.wavefront == b.wavefront && a.lightbvh == b.lightbvh &&
+         a.mipmaps == b.mipmaps && a.trilinear == b.trilinear;
+}
+
+// Appends a buffer to a checkpoint, compressed with deflate after splitting
+// its words of `word` bytes in byte planes, so that the slowly varying high
+// bytes of floats and counters compress well.
+template <typename T>
+inline void write_checkpoint_buffer(
+    vector<byte>& data, const vector<T>& buffer, int word) {
+  auto size = buffer.size() * sizeof(T);
+  if (size == 0) {
+    auto sizes = array<uint64_t, 2>{0, 0};
+    data.insert(data.end(), (byte*)&sizes, (byte*)&sizes + sizeof(sizes));
+    return;
+  }
+  auto words    = size / word;
+  auto bytes    = (const byte*)buffer.data();
+  auto shuffled = vector<byte>(size);
+  for (auto plane = 0; plane < word; plane++) {
+    for (auto idx = (size_t)0; idx < words; idx++) {
+      shuffled[plane * words + idx] = bytes[idx * word + plane];
+    }
+  }
+  auto length     = 0;
+  auto compressed = stbi_zlib_compress(
+      (unsigned char*)shuffled.data(), (int)size, &length, 8);
+  auto sizes = array<uint64_t, 2>{size, (uint64_t)length};
+  data.insert(data.end(), (byte*)&sizes, (byte*)&sizes + sizeof(sizes));
+  data.insert(data.end(), (byte*)compressed, (byte*)compressed + length);
+  free(compressed);
+}
+
+// Reads a buffer written by `write_checkpoint_buffer`.
+template <typename T>
+inline bool read_checkpoint_buffer(const vector<byte>& data, size_t& offset,
+    vector<T>& buffer, int word) {
+  auto sizes = array<uint64_t, 2>{};
+  if (offset + sizeof(sizes) > data.size()) return false;
+  memcpy(&sizes, data.data() + offset, sizeof(sizes));
+  offset += sizeof(sizes);
+  if (offset + sizes[1] > data.size()) return false;
+  if (sizes[0] != buffer.size() * sizeof(T)) return false;
+  if (sizes[0] == 0) return true;
+  auto length   = 0;
+  auto shuffled = stbi_zlib_decode_malloc(
+      (const char*)data.data() + offset, (int)sizes[1], &length);
+  offset += sizes[1];
+  if (!shuffled) return false;
+  if ((size_t)length != sizes[0]) {
+    free(shuffled);
+    return false;
+  }
+  auto words = sizes[0] / word;
+  auto bytes = (byte*)buffer.data();
+  for (auto plane = 0; plane < word; plane++) {
+    for (auto idx = (size_t)0; idx < words; idx++) {
+      bytes[idx * word + plane] = (byte)shuffled[plane * words + idx];
+    }
+  }
+  free(shuffled);
+  return true;
+}
+
+// Saves the accumulation buffers of a render. Random numbers are derived from
+// the seed, pixel and sample, so they need no state. The file is written next
+// to the checkpoint and renamed over it, so that an interrupted save keeps the
+// previous checkpoint.
+inline bool save_checkpoint(const string& filename, const trace_state& state,
+    const trace_params& params, const Hash& scene, string& error) {
+  auto header = make_checkpoint_header(state, params, scene);
+  auto data   = vector<byte>{};
+  data.insert(data.end(), (byte*)&header, (byte*)&header + sizeof(header));
+  write_checkpoint_buffer(data, state.image, sizeof(float));
+  write_checkpoint_buffer(data, state.albedo, sizeof(float));
+  write_checkpoint_buffer(data, state.normal, sizeof(float));
+  write_checkpoint_buffer(data, state.hits, sizeof(int));
+  write_checkpoint_buffer(data, state.pixel_samples, sizeof(int));
+  write_checkpoint_buffer(data, state.halfimage, sizeof(float));
+  write_checkpoint_buffer(data, state.converged, sizeof(uint8_t));
+  auto tmpname = filename + ".tmp";
+  if (!save_binary(tmpname, data, error)) return false;
+  if (std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+    error = filename + ": cannot rename checkpoint";
+    return false;
+  }
+  return true;
+}
+
+// Loads a checkpoint and its header, sizing the state from the header.
+inline bool load_checkpoint(const string& filename, trace_state& state,
+    checkpoint_header& header, string& error) {
+  auto data = vector<byte>{};
+  if (!load_binary(filename, data, error)) return false;
+  if (data.size() < sizeof(header)) {
+    error = filename + ": corrupted checkpoint";
+    return false;
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, checkpoint_header{}.magic, sizeof(header.magic)) !=
+          0 ||
+      header.version != checkpoint_version) {
+    error = filename + ": unsupported checkpoint";
+    return false;
+  }
+  auto pixels   = (size_t)header.width * header.height;
+  auto adaptive = header.adaptive ? pixels : 0;
+  state         = trace_state{};
+  state.width   = header.width;
+  state.height  = header.height;
+  state.samples = header.samples;
+  state.image.resize(pixels);
+  state.albedo.resize(pixels);
+  state.normal.resize(pixels);
+  state.hits.resize(pixels);
+  state.pixel_samples.resize(adaptive);
+  state.halfimage.resize(adaptive);
+  state.converged.resize(adaptive);
+  auto offset = sizeof(header);
+  if (!read_checkpoint_buffer(data, offset, state.image, sizeof(float)) ||
+      !read_checkpoint_buffer(data, offset, state.albedo, sizeof(float)) ||
+      !read_checkpoint_buffer(data, offset, state.normal, sizeof(float)) ||
+      !read_checkpoint_buffer(data, offset, state.hits, sizeof(int)) ||
+      !read_checkpoint_buffer(
+          data, offset, state.pixel_samples, sizeof(int)) ||
+      !read_checkpoint_buffer(data, offset, state.halfimage, sizeof(float)) ||
+      !read_checkpoint_buffer(
+          data, offset, state.converged, sizeof(uint8_t))) {
+    error = filename + ": corrupted checkpoint";
+    return false;
+  }
+  return true;
+}
+
+// Loads a checkpoint into a state made with `make_state` for the scene with
+// hash `scene` and the same params.
+inline bool load_checkpoint(const string& filename, trace_state& state,
+    const trace_params& params, const Hash& scene, string& error) {
+  auto loaded = trace_state{};
+  auto header = checkpoint_header{};
+  if (!load_checkpoint(filename, loaded, header, error)) return false;
+  auto expected = make_checkpoint_header(state, params, scene);
+  if (!match_checkpoint_header(header, expected) ||
+      header.first != expected.first) {
+    error = filename + ": checkpoint params do not match";
+    return false;
+  }
+  state = std::move(loaded);
+  return true;
+}
+
+// Adds the samples of a partial state, rendered from another range of samples,
+// to a state. Merged states mix sample ranges, so they are not resumed.
+inline bool merge_state(
+    trace_state& state, const trace_state& partial, string& error) {
+  if (state.width != partial.width || state.height != partial.height ||
+      state.pixel_samples.size() != partial.pixel_samples.size()) {
+    error = "partial states do not match";
+    return false;
+  }
+  state.samples += partial.samples;
+  for (auto idx = (size_t)0; idx < state.image.size(); idx++) {
+    state.image[idx] += partial.image[idx];
+    state.albedo[idx] += partial.albedo[idx];
+    state.normal[idx] += partial.normal[idx];
+    state.hits[idx] += partial.hits[idx];
+  }
+  for (auto idx = (size_t)0; idx < state.pixel_samples.size(); idx++) {
+    state.pixel_samples[idx] += partial.pixel_samples[idx];
+    state.halfimage[idx] += partial.halfimage[idx];
+    state.converged[idx] = state.converged[idx] && partial.converged[idx];
+  }
+  return true;
+}
+
+}  // namespace yash
@@ -6,6 +6,7 @@
 #include <yocto_gui/yocto_glview.h>
 #endif
 
+#include "checkpoint.h"
 #include "render.h"
 #include "scene/scene_hash.h"
 #include "scene/scene_view.h"
@@ -101,14 +102,144 @@ void run_info(const info_params& params) {
   for (auto stat : scene_stats(scene)) print_info(stat);
 }
 
+// merge params
+struct merge_params {
+  vector<string> partials = {};
+  string         output   = "out.png";
+  string         albedo   = "";
+  string         normal   = "";
+  string         heatmap  = "";
+  bool           denoise  = false;
+  float          exposure = 0;
+  bool           filmic   = false;
+};
+
+// Cli
+void add_options(const cli_command& cli, merge_params& params) {
+  add_argument(cli, "partials", params.partials,
+      "Partial render states, after all options.");
+  add_option(cli, "output", params.output, "Output filename.");
+  add_option(cli, "albedo", params.albedo, "Albedo filename.");
+  add_option(cli, "normal", params.normal, "Normal filename.");
+  add_option(cli, "heatmap", params.heatmap, "Sample count heatmap filename.");
+  add_option(cli, "denoise", params.denoise, "Enable denoiser.");
+  add_option(cli, "exposure", params.exposure, "Exposure value.");
+  add_option(cli, "filmic", params.filmic, "Filmic tone mapping.");
+}
+
+// merge partial renders
+void run_merge(const merge_params& params) {
+  // load partial states
+  auto error   = string{};
+  auto states  = vector<trace_state>(params.partials.size());
+  auto headers = vector<checkpoint_header>(params.partials.size());
+  if (params.partials.empty()) print_fatal("no partials to merge");
+  for (auto& filename : params.partials) {
+    if (filename.rfind("--", 0) == 0)
+      print_fatal(filename + ": options must come before the partials");
+  }
+  print_progress_begin("load partials", (int)params.partials.size());
+  for (auto idx = 0; idx < (int)params.partials.size(); idx++) {
+    auto& filename = params.partials[idx];
+    if (!load_checkpoint(filename, states[idx], headers[idx], error))
+      print_fatal(error);
+    if (!match_checkpoint_header(headers[idx], headers[0]))
+      print_fatal(filename + ": partial scene or params do not match");
+    print_progress_next();
+  }
+
+  // sum partial states in sample order, so that the result matches a single
+  // render up to float rounding
+  auto order = vector<int>(params.partials.size());
+  for (auto idx = 0; idx < (int)order.size(); idx++) order[idx] = idx;
+  std::sort(order.begin(), order.end(),
+      [&](int a, int b) { return headers[a].first < headers[b].first; });
+  auto state = std::move(states[order[0]]);
+  for (auto idx = 1; idx < (int)order.size(); idx++) {
+    auto& previous = headers[order[idx - 1]];
+    auto& header   = headers[order[idx]];
+    auto& filename = params.partials[order[idx]];
+    if (header.first < previous.first + previous.samples)
+      print_fatal(filename + ": partial samples overlap " +
+                  params.partials[order[idx - 1]]);
+    if (!merge_state(state, states[order[idx]], error))
+      print_fatal(filename + ": " + error);
+  }
+
+  // save image
+  print_progress_begin("save image");
+  auto image = params.denoise ? get_denoised(state) : get_render(state);
+  if (!is_hdr_filename(params.output))
+    image = tonemap_image(image, params.exposure, params.filmic);
+  if (!save_image(params.output, image, error)) print_fatal(error);
+  print_progress_end();
+
+  // save denoiser buffers
+  if (!params.albedo.empty()) {
+    print_progress_begin("save albedo");
+    if (!save_image(params.albedo, get_albedo(state), error))
+      print_fatal(error);
+    print_progress_end();
+  }
+  if (!params.normal.empty()) {
+    print_progress_begin("save normal");
+    if (!save_image(params.normal, get_normal(state), error))
+      print_fatal(error);
+    print_progress_end();
+  }
+
+  // save sample heatmap
+  if (!params.heatmap.empty()) {
+    print_progress_begin("save heatmap");
+    if (!save_image(params.heatmap, get_samples(state), error))
+      print_fatal(error);
+    print_progress_end();
+  }
+}
+
+// Loads a scene. If a texture `cache` is given, textures are written to its
+// store as they are loaded, so that they are not all decoded in memory at
+// once. Textures used for displacement stay loaded, since tesselation reads
+// them.
+bool load_scene(const string& filename, scene_data& scene,
+    Texture_Cache* cache, string& error) {
+  if (!cache) return load_scene(filename, scene, error);
+  auto loader = [&scene, cache](const string& filename, texture_data& texture,
+                    string& error) {
+    if (!load_texture(filename, texture, error)) return false;
+    auto index = (int)(&texture - scene.textures.data());
+    for (auto& subdiv : scene.subdivs) {
+      if (subdiv.displacement_tex == index) return true;
+    }
+    stream_texture(*cache, index, texture);
+    return true;
+  };
+  return load_scene(filename, scene, error, loader);
+}
+
 // render params
 struct render_params : trace_params {
-  string scene     = "scene.json";
-  string output    = "out.png";
-  string camname   = "";
-  bool   addsky    = false;
-  string envname   = "";
-  bool   savebatch = false;
+  string scene            = "scene.json";
+  string output           = "out.png";
+  string camname          = "";
+  bool   addsky           = false;
+  string envname          = "";
+  bool   savebatch        = false;
+  string heatmap          = "";
+  string albedo           = "";
+  string normal           = "";
+  bool   compresstextures = false;
+  int    texturecache     = 0;
+  string checkpoint       = "";
+  int    checkpointtime   = 600;
+  string resume           = "";
+  int    partition        = 0;
+  int    partitions       = 1;
+  string partial          = "";
+  int    workers          = 0;
+
+  // command line, used to spawn workers
+  vector<string> command = {};
 };
 
 // Cli
@@ -119,6 +250,28 @@ void add_options(const cli_command& cli, render_params& params) {
   add_option(cli, "addsky", params.addsky, "Add sky.");
   add_option(cli, "envname", params.envname, "Add environment map.");
   add_option(cli, "savebatch", params.savebatch, "Save batch.");
+  add_option(cli, "heatmap", params.heatmap, "Sample count heatmap filename.");
+  add_option(cli, "albedo", params.albedo, "Albedo filename.");
+  add_option(cli, "normal", params.normal, "Normal filename.");
+  add_option(cli, "compresstextures", params.compresstextures,
+      "Block compress color textures.");
+  add_option(cli, "texturecache", params.texturecache,
+      "Stream textures through a cache of this size in MB.");
+  add_option(cli, "checkpoint", params.checkpoint,
+      "Checkpoint filename, written periodically while rendering.");
+  add_option(cli, "checkpointtime", params.checkpointtime,
+      "Seconds between checkpoints.", {1, 86400});
+  add_option(cli, "resume", params.resume,
+      "Resume rendering from a checkpoint.");
+  add_option(cli, "partition", params.partition,
+      "Partition of the samples to render.", {0, 4095});
+  add_option(cli, "partitions", params.partitions,
+      "Number of sample partitions.", {1, 4096});
+  add_option(cli, "partial", params.partial,
+      "Save the render state to merge, instead of the image.");
+  add_option(cli, "workers", params.workers,
+      "Render with single threaded worker processes and merge their states.",
+      {0, 4096});
   add_option(
       cli, "resolution", params.resolution, "Image resolution.", {1, 4096});
   add_option(
@@ -127,6 +280,8 @@ void add_options(const cli_command& cli, render_params& params) {
       trace_falsecolor_names);
   add_option(cli, "samples", params.samples, "Number of samples.", {1, 4096});
   add_option(cli, "bounces", params.bounces, "Number of bounces.", {1, 128});
+  add_option(cli, "sequence", params.sequence, "Sample sequence.",
+      trace_sequence_names);
   add_option(cli, "denoise", params.denoise, "Enable denoiser.");
   add_option(cli, "batch", params.batch, "Sample batch.");
   add_option(cli, "clamp", params.clamp, "Clamp params.", {10, flt_max});
@@ -136,21 +291,130 @@ void add_options(const cli_command& cli, render_params& params) {
   add_option(cli, "embreebvh", params.embreebvh, "Use Embree as BVH.");
   add_option(
       cli, "highqualitybvh", params.highqualitybvh, "Use high quality BVH.");
+  add_option(cli, "packedbvh", params.packedbvh, "Pack triangles in BVH.");
+  add_option(
+      cli, "spatialbvh", params.spatialbvh, "Use spatial splits in BVH.");
+  add_option(cli, "spatialbudget", params.spatialbudget,
+      "Max fraction of duplicated references in spatial splits.");
+  add_option(cli, "raypackets", params.raypackets, "Trace camera ray packets.");
+  add_option(
+      cli, "wavefront", params.wavefront, "Trace paths in wavefront stages.");
+  add_option(cli, "sortpaths", params.sortpaths,
+      "Sort wavefront paths by material before shading.");
+  add_option(cli, "batchshading", params.batchshading,
+      "Evaluate wavefront BRDFs in batches of 8 paths.");
+  add_option(cli, "tiled", params.tiled, "Schedule work in image tiles.");
+  add_option(cli, "tilesize", params.tilesize, "Tile size.", {4, 256});
+  add_option(cli, "tileorder", params.tileorder, "Tile order.",
+      trace_tileorder_names);
+  add_option(cli, "targeterror", params.targeterror,
+      "Target error for adaptive sampling.");
+  add_option(cli, "lightbvh", params.lightbvh, "Sample lights with a bvh.");
+  add_option(cli, "mipmaps", params.mipmaps,
+      "Filter textures with tiled mip pyramids.");
+  add_option(cli, "trilinear", params.trilinear,
+      "Blend mip levels when filtering textures.");
   add_option(cli, "exposure", params.exposure, "Exposure value.");
   add_option(cli, "filmic", params.filmic, "Filmic tone mapping.");
   add_option(cli, "noparallel", params.noparallel, "Disable threading.");
 }
 
+// Quote a command line argument for the shell.
+inline string quote_argument(const string& arg) {
+  auto quoted = string{"'"};
+  for (auto c : arg) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+// Render with local worker processes. Each worker renders a partition of the
+// samples to a partial state, and the partials are merged into the output.
+// Workers are single threaded, so there should be one for each core.
+void run_workers(const render_params& params) {
+  // workers write partials of their own, which are not resumed
+  if (!params.checkpoint.empty() || !params.resume.empty())
+    print_fatal("checkpoints are not supported with workers");
+  if (!params.partial.empty() || params.partitions > 1)
+    print_fatal("partitions are not supported with workers");
+
+  // spawn workers with the same command line
+  auto partials = vector<string>{};
+  auto workers  = vector<future<int>>{};
+  for (auto worker = 0; worker < params.workers; worker++) {
+    auto partial = params.output + ".part" + std::to_string(worker);
+    auto command = string{};
+    for (auto& arg : params.command) command += quote_argument(arg) + " ";
+    command += "--workers 0 --noparallel --partitions " +
+               std::to_string(params.workers) +
+               " --partition " + std::to_string(worker) + " --partial " +
+               quote_argument(partial) + " > " +
+               quote_argument(partial + ".log") + " 2>&1";
+    partials.push_back(partial);
+    workers.push_back(std::async(std::launch::async,
+        [command]() { return std::system(command.c_str()); }));
+  }
+  print_progress_begin("render workers", params.workers);
+  for (auto worker = 0; worker < params.workers; worker++) {
+    if (workers[worker].get() != 0)
+      print_fatal("worker " + std::to_string(worker) + " failed, see " +
+                  partials[worker] + ".log");
+    std::remove((partials[worker] + ".log").c_str());
+    print_progress_next();
+  }
+
+  // merge partials
+  auto mparams     = merge_params{};
+  mparams.partials = partials;
+  mparams.output   = params.output;
+  mparams.albedo   = params.albedo;
+  mparams.normal   = params.normal;
+  mparams.heatmap  = params.heatmap;
+  mparams.denoise  = params.denoise;
+  mparams.exposure = params.exposure;
+  mparams.filmic   = params.filmic;
+  run_merge(mparams);
+  for (auto& partial : partials) std::remove(partial.c_str());
+}
+
 // convert images
 void run_render(const render_params& params_) {
+  // wavefront stages trace all the pixels at each sample
+  if (params_.wavefront && params_.targeterror > 0)
+    print_fatal("adaptive sampling is not supported with wavefront");
+
+  // local workers
+  if (params_.workers > 1) return run_workers(params_);
+
   // copy params
   auto params = params_;
 
+  // partitions split the samples in ranges
+  if (params.partitions > 1) {
+    auto range = partition_samples(
+        params, params.partition, params.partitions);
+    params.firstsample = range.x;
+    params.samples     = range.y;
+  }
+
+  // texture cache, without fallbacks, so that renders do not depend on timing
+  auto texture_cache = Texture_Cache{};
+  if (params.texturecache > 0) {
+    init_texture_cache(
+        texture_cache, (size_t)params.texturecache << 20, false);
+  }
+
   // scene loading
   auto error = string{};
   print_progress_begin("load scene");
   auto old_scene = scene_data{};
-  if (!load_scene(params.scene, old_scene, error)) print_fatal(error);
+  if (!load_scene(params.scene, old_scene,
+          params.texturecache > 0 ? &texture_cache : nullptr, error))
+    print_fatal(error);
   print_progress_end();
 
   // add sky
@@ -180,7 +444,20 @@ void run_render(const render_params& params_) {
   //
 
   auto data       = Data_Table{};
-  auto scene_hash = create_scene_hash(old_scene, data);
+  auto scene_hash = create_scene_hash(old_scene, data, params.compresstextures,
+      params.texturecache > 0 ? &texture_cache : nullptr);
+  old_scene.textures = {};  // now in the data table or cache
+
+  // build mipmaps
+  if (params.mipmaps) {
+    print_progress_begin("build mipmaps");
+    make_texture_mipmaps(scene_hash, params);
+    print_progress_end();
+  }
+
+  // classify materials
+  make_material_plans(scene_hash);
+
   auto scene_view = create_scene_view(scene_hash);
 
   auto node        = scene_hash.cameras()[0];
@@ -214,10 +491,44 @@ void run_render(const render_params& params_) {
 
   auto& scene = scene_hash;
 
+  // resume
+  if (!params.resume.empty()) {
+    print_progress_begin("resume render");
+    if (!load_checkpoint(
+            params.resume, state, params, scene_hash.root->hash, error))
+      print_fatal(error);
+    print_progress_end();
+  }
+
+  // checkpoints are saved in the background from copies of the state, and
+  // skipped while the previous one is still being saved
+  auto checkpoint_name   = params.checkpoint.empty() ? params.resume
+                                                     : params.checkpoint;
+  auto checkpoint_timer  = simple_timer{};
+  auto checkpoint_worker = future<bool>{};
+  auto checkpoint_error  = string{};
+
   // render
-  print_progress_begin("render image", params.samples);
-  for (auto sample = 0; sample < params.samples; sample++) {
+  print_progress_begin("render image",
+      (params.targeterror > 0 ? params.samples * trace_adaptive_max
+                              : params.samples) -
+          state.samples);
+  for (auto sample = state.samples; !is_done(state, params); sample++) {
     trace_samples(state, scene, bvh, lights, params);
+    if (!checkpoint_name.empty() && !is_done(state, params) &&
+        elapsed_seconds(checkpoint_timer) >= params.checkpointtime &&
+        (!checkpoint_worker.valid() ||
+            checkpoint_worker.wait_for(std::chrono::seconds(0)) ==
+                std::future_status::ready)) {
+      if (checkpoint_worker.valid() && !checkpoint_worker.get())
+        print_fatal(checkpoint_error);
+      checkpoint_worker = std::async(
+          std::launch::async, [&, checkpoint_state = state]() {
+            return save_checkpoint(checkpoint_name, checkpoint_state, params,
+                scene_hash.root->hash, checkpoint_error);
+          });
+      start_timer(checkpoint_timer);
+    }
     if (params.savebatch && state.samples % params.batch == 0) {
       auto image = params.denoise ? get_denoised(state) : get_render(state);
       auto ext = "-s" + std::to_string(sample) + path_extension(params.output);
@@ -228,6 +539,24 @@ void run_render(const render_params& params_) {
     }
     print_progress_next();
   }
+  if (checkpoint_worker.valid() && !checkpoint_worker.get())
+    print_fatal(checkpoint_error);
+
+  // texture cache stats
+  if (params.texturecache > 0) {
+    print_info("texture cache ----------");
+    for (auto stat : cache_stats(texture_cache)) print_info(stat);
+  }
+
+  // save partial state
+  if (!params.partial.empty()) {
+    print_progress_begin("save partial");
+    if (!save_checkpoint(
+            params.partial, state, params, scene_hash.root->hash, error))
+      print_fatal(error);
+    print_progress_end();
+    return;
+  }
 
   // save image
   print_progress_begin("save image");
@@ -236,15 +565,40 @@ void run_render(const render_params& params_) {
     image = tonemap_image(image, params.exposure, params.filmic);
   if (!save_image(params.output, image, error)) print_fatal(error);
   print_progress_end();
+
+  // save denoiser buffers
+  if (!params.albedo.empty()) {
+    print_progress_begin("save albedo");
+    if (!save_image(params.albedo, get_albedo(state), error))
+      print_fatal(error);
+    print_progress_end();
+  }
+  if (!params.normal.empty()) {
+    print_progress_begin("save normal");
+    if (!save_image(params.normal, get_normal(state), error))
+      print_fatal(error);
+    print_progress_end();
+  }
+
+  // save sample heatmap
+  if (!params.heatmap.empty()) {
+    print_progress_begin("save heatmap");
+    if (!save_image(params.heatmap, get_samples(state), error))
+      print_fatal(error);
+    print_progress_end();
+  }
 }
 
 // convert params
 struct view_params : trace_params {
-  string scene   = "scene.json";
-  string output  = "out.png";
-  string camname = "";
-  bool   addsky  = false;
-  string envname = "";
+  string scene            = "scene.json";
+  string output           = "out.png";
+  string camname          = "";
+  bool   addsky           = false;
+  string envname          = "";
+  bool   compresstextures = false;
+  int    texturecache     = 0;
+  bool   texturefallback  = false;
 };
 
 // Cli
@@ -255,6 +609,12 @@ void add_options(const cli_command& cli, view_params& params) {
   add_option(cli, "camera", params.camname, "Camera name.");
   add_option(cli, "addsky", params.addsky, "Add sky.");
   add_option(cli, "envname", params.envname, "Add environment map.");
+  add_option(cli, "compresstextures", params.compresstextures,
+      "Block compress color textures.");
+  add_option(cli, "texturecache", params.texturecache,
+      "Stream textures through a cache of this size in MB.");
+  add_option(cli, "texturefallback", params.texturefallback,
+      "Use low resolution textures while tiles load.");
   add_option(
       cli, "resolution", params.resolution, "Image resolution.", {1, 4096});
   add_option(
@@ -263,6 +623,8 @@ void add_options(const cli_command& cli, view_params& params) {
       trace_falsecolor_names);
   add_option(cli, "samples", params.samples, "Number of samples.", {1, 4096});
   add_option(cli, "bounces", params.bounces, "Number of bounces.", {1, 128});
+  add_option(cli, "sequence", params.sequence, "Sample sequence.",
+      trace_sequence_names);
   add_option(cli, "denoise", params.denoise, "Enable denoiser.");
   add_option(cli, "batch", params.batch, "Sample batch.");
   add_option(cli, "clamp", params.clamp, "Clamp params.", {10, flt_max});
@@ -272,6 +634,29 @@ void add_options(const cli_command& cli, view_params& params) {
   add_option(cli, "embreebvh", params.embreebvh, "Use Embree as BVH.");
   add_option(
       cli, "highqualitybvh", params.highqualitybvh, "Use high quality BVH.");
+  add_option(cli, "packedbvh", params.packedbvh, "Pack triangles in BVH.");
+  add_option(
+      cli, "spatialbvh", params.spatialbvh, "Use spatial splits in BVH.");
+  add_option(cli, "spatialbudget", params.spatialbudget,
+      "Max fraction of duplicated references in spatial splits.");
+  add_option(cli, "raypackets", params.raypackets, "Trace camera ray packets.");
+  add_option(
+      cli, "wavefront", params.wavefront, "Trace paths in wavefront stages.");
+  add_option(cli, "sortpaths", params.sortpaths,
+      "Sort wavefront paths by material before shading.");
+  add_option(cli, "batchshading", params.batchshading,
+      "Evaluate wavefront BRDFs in batches of 8 paths.");
+  add_option(cli, "tiled", params.tiled, "Schedule work in image tiles.");
+  add_option(cli, "tilesize", params.tilesize, "Tile size.", {4, 256});
+  add_option(cli, "tileorder", params.tileorder, "Tile order.",
+      trace_tileorder_names);
+  add_option(cli, "targeterror", params.targeterror,
+      "Target error for adaptive sampling.");
+  add_option(cli, "lightbvh", params.lightbvh, "Sample lights with a bvh.");
+  add_option(cli, "mipmaps", params.mipmaps,
+      "Filter textures with tiled mip pyramids.");
+  add_option(cli, "trilinear", params.trilinear,
+      "Blend mip levels when filtering textures.");
   add_option(cli, "exposure", params.exposure, "Exposure value.");
   add_option(cli, "filmic", params.filmic, "Filmic tone mapping.");
   add_option(cli, "noparallel", params.noparallel, "Disable threading.");
@@ -491,14 +876,29 @@ void view_scene(const string& title, const string& name, Scene_Hash& scene,
   // copy params and camera
   auto params = params_;
 
+  // wavefront stages trace all the pixels at each sample
+  if (params.wavefront && params.targeterror > 0)
+    print_fatal("adaptive sampling is not supported with wavefront");
+
+  // classify materials, before the bvh that stores their plans
+  make_material_plans(scene);
+
   // build bvh
   if (print) print_progress_begin("build bvh");
   auto bvh = make_bvh(scene, params);
   if (print) print_progress_end();
 
+  // build mipmaps
+  if (params.mipmaps) {
+    if (print) print_progress_begin("build mipmaps");
+    make_texture_mipmaps(scene, params);
+    if (print) print_progress_end();
+  }
+
   // init renderer
   if (print) print_progress_begin("init lights");
-  auto lights = make_lights(scene, params);
+  auto lcache = light_cache{};
+  auto lights = make_lights(scene, params, lcache);
   if (print) print_progress_end();
 
   // fix renderer type if no lights
@@ -551,6 +951,12 @@ void view_scene(const string& title, const string& name, Scene_Hash& scene,
     render_worker = {};
     render_stop   = false;
 
+    // update shapes and instances edited since the last reset
+    make_material_plans(scene);
+    update_scene_bvh(bvh, scene, params);
+    make_texture_mipmaps(scene, params);
+    lights = make_lights(scene, params, lcache);
+
     // preview
     auto pparams = params;
     pparams.resolution /= params.pratio;
@@ -580,12 +986,41 @@ void view_scene(const string& title, const string& name, Scene_Hash& scene,
         auto  r     = scene.root;
         auto& d     = scene.data;
         auto  scene = Scene_Hash{r, d};
-        parallel_for(state.width, state.height, [&](int i, int j) {
+        if (params.wavefront &&
+            params.sampler == trace_sampler_type::path) {
           for (auto s = 0; s < params.batch; s++) {
             if (render_stop) return;
-            trace_sample(state, scene, bvh, lights, i, j, params);
+            trace_wavefront(
+                state, scene, bvh, lights, state.samples + s, params);
           }
-        });
+        } else if (params.tiled) {
+          auto tiles = make_tiles(
+              state.width, state.height, params.tilesize, params.tileorder);
+          parallel_for_tiles(tiles, false, [&](const image_tile& tile) {
+            if (render_stop) return;
+            trace_tile_samples(state, scene, bvh, lights, tile, state.samples,
+                params.batch, params);
+          });
+        } else if (params.raypackets) {
+          auto tiles_x = (state.width + trace_tile_size - 1) / trace_tile_size;
+          auto tiles_y = (state.height + trace_tile_size - 1) /
+                         trace_tile_size;
+          parallel_for(tiles_x, tiles_y, [&](int i, int j) {
+            for (auto s = 0; s < params.batch; s++) {
+              if (render_stop) return;
+              trace_tile(
+                  state, scene, bvh, lights, i, j, state.samples + s, params);
+            }
+          });
+        } else {
+          parallel_for(state.width, state.height, [&](int i, int j) {
+            for (auto s = 0; s < params.batch; s++) {
+              if (render_stop) return;
+              trace_sample(
+                  state, scene, bvh, lights, i, j, state.samples + s, params);
+            }
+          });
+        }
         state.samples += params.batch;
         if (!render_stop) {
           auto lock      = std::lock_guard{render_mutex};
@@ -706,11 +1141,20 @@ void run_view(const view_params& params_) {
   // copy params
   auto params = params_;
 
+  // texture cache
+  auto texture_cache = Texture_Cache{};
+  if (params.texturecache > 0) {
+    init_texture_cache(texture_cache, (size_t)params.texturecache << 20,
+        params.texturefallback);
+  }
+
   // load scene
   auto error = string{};
   print_progress_begin("load scene");
   auto scene = scene_data{};
-  if (!load_scene(params.scene, scene, error)) print_fatal(error);
+  if (!load_scene(params.scene, scene,
+          params.texturecache > 0 ? &texture_cache : nullptr, error))
+    print_fatal(error);
   print_progress_end();
 
   // add sky
@@ -735,7 +1179,9 @@ void run_view(const view_params& params_) {
 
   // run view
   auto data   = Data_Table{};
-  auto gscene = create_scene_hash(scene, data);
+  auto gscene = create_scene_hash(scene, data, params.compresstextures,
+      params.texturecache > 0 ? &texture_cache : nullptr);
+  scene.textures = {};  // now in the data table or cache
   view_scene("yscene", params.scene, gscene, params, false, true);
 }
 
@@ -793,6 +1239,7 @@ struct app_params {
   string         command = "convert";
   convert_params convert = {};
   info_params    info    = {};
+  merge_params   merge   = {};
   render_params  render  = {};
   view_params    view    = {};
   glview_params  glview  = {};
@@ -803,6 +1250,7 @@ void add_options(const cli_command& cli, app_params& params) {
   set_command_var(cli, params.command);
   add_command(cli, "convert", params.convert, "Convert scenes.");
   add_command(cli, "info", params.info, "Print scenes info.");
+  add_command(cli, "merge", params.merge, "Merge partial renders.");
   add_command(cli, "render", params.render, "Render scenes.");
   add_command(cli, "view", params.view, "View scenes.");
   add_command(cli, "glview", params.glview, "View scenes with OpenGL.");
@@ -821,7 +1269,10 @@ void run(const vector<string>& args) {
     return run_convert(params.convert);
   } else if (params.command == "info") {
     return run_info(params.info);
+  } else if (params.command == "merge") {
+    return run_merge(params.merge);
   } else if (params.command == "render") {
+    params.render.command = args;
     return run_render(params.render);
   } else if (params.command == "view") {
     return run_view(params.view);
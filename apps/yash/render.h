@@ -3,7 +3,10 @@
 #include <yocto/yocto_shading.h>
 #include <yocto/yocto_trace.h>
 
+#include "scene/scene_hash.h"
 #include "scene/shape.h"
+#include "sequences.h"
+#include "shading.h"
 
 // -----------------------------------------------------------------------------
 // USING DIRECTIVES
@@ -18,6 +21,7 @@ using yocto::acos;
 using yocto::atan2;
 using yocto::cos;
 using yocto::fmod;
+using yocto::sample_discrete;
 using yocto::sin;
 using yocto::sqrt;
 using namespace yocto;
@@ -33,7 +37,11 @@ template <typename Texture>
 vec4f lookup_texture(
     const Texture& texture, int i, int j, bool as_linear = false) {
   auto color = vec4f{0, 0, 0, 0};
-  if (!texture.pixelsf.empty()) {
+  if (texture.encoding == texture_encoding::streamed) {
+    color = lookup_texture(*(const streamed_texture*)texture.texels.data, i, j);
+  } else if (texture.encoding != texture_encoding::raw) {
+    color = decode_texel(texture.encoding, texture.texels, texture.width, i, j);
+  } else if (!texture.pixelsf.empty()) {
     color = texture.pixelsf[j * texture.width + i];
   } else {
     color = byte_to_float(texture.pixelsb[j * texture.width + i]);
@@ -45,16 +53,38 @@ vec4f lookup_texture(
   }
 }
 
-// Evaluates an image at a point `uv`.
+// Looks up a texel in a level of the mip pyramid of a texture.
 template <typename Texture>
-vec4f eval_texture(const Texture& texture, const vec2f& uv,
-    bool as_linear = false, bool no_interpolation = false,
-    bool clamp_to_edge = false) {
-  if (texture.width == 0 || texture.height == 0) return {0, 0, 0, 0};
-
-  // get texture width/height
-  auto size = vec2i{texture.width, texture.height};
+vec4f lookup_texture(const Texture& texture, const texture_level& level, int i,
+    int j, bool as_linear = false) {
+  if (texture.encoding != texture_encoding::raw) {
+    auto texels = view<byte>{
+        texture.mips.data + level.offset, texture.mips.size() - level.offset};
+    auto color = decode_texel(texture.encoding, texels, level.width, i, j);
+    return (as_linear && !texture.linear) ? srgb_to_rgb(color) : color;
+  }
+  auto tile = (j / texture_tile_size) * level.tiles + i / texture_tile_size;
+  auto idx  = level.offset + tile * texture_tile_size * texture_tile_size +
+             (j % texture_tile_size) * texture_tile_size +
+             i % texture_tile_size;
+  auto color = vec4f{0, 0, 0, 0};
+  if (!texture.mipsf.empty()) {
+    color = texture.mipsf[idx];
+  } else {
+    color = byte_to_float(texture.mipsb[idx]);
+  }
+  if (as_linear && !texture.linear) {
+    return srgb_to_rgb(color);
+  } else {
+    return color;
+  }
+}
 
+// Evaluates an image of size `size` at a point `uv`, reading texels with
+// `lookup(i, j)`.
+template <typename Lookup>
+vec4f eval_texels(const vec2i& size, const vec2f& uv, bool no_interpolation,
+    bool clamp_to_edge, Lookup&& lookup) {
   // get coordinates normalized for tiling
   auto s = 0.0f, t = 0.0f;
   if (clamp_to_edge) {
@@ -74,22 +104,208 @@ vec4f eval_texture(const Texture& texture, const vec2f& uv,
 
   // handle interpolation
   if (no_interpolation) {
-    return lookup_texture(texture, i, j, as_linear);
+    return lookup(i, j);
   } else {
-    return lookup_texture(texture, i, j, as_linear) * (1 - u) * (1 - v) +
-           lookup_texture(texture, i, jj, as_linear) * (1 - u) * v +
-           lookup_texture(texture, ii, j, as_linear) * u * (1 - v) +
-           lookup_texture(texture, ii, jj, as_linear) * u * v;
+    return lookup(i, j) * (1 - u) * (1 - v) + lookup(i, jj) * (1 - u) * v +
+           lookup(ii, j) * u * (1 - v) + lookup(ii, jj) * u * v;
+  }
+}
+
+// Evaluates a level of the mip pyramid of a texture at a point `uv`. The first
+// level is the texture itself.
+template <typename Texture>
+vec4f eval_texture_level(const Texture& texture, int level, const vec2f& uv,
+    bool as_linear = false, bool no_interpolation = false,
+    bool clamp_to_edge = false) {
+  if (level == 0) {
+    return eval_texels({texture.width, texture.height}, uv, no_interpolation,
+        clamp_to_edge,
+        [&](int i, int j) { return lookup_texture(texture, i, j, as_linear); });
+  }
+  auto& level_ = texture.levels[level];
+  return eval_texels({level_.width, level_.height}, uv, no_interpolation,
+      clamp_to_edge, [&](int i, int j) {
+        return lookup_texture(texture, level_, i, j, as_linear);
+      });
+}
+
+// Evaluates an image at a point `uv`. If the texture has a mip pyramid, the
+// level is picked from the `footprint` of the lookup in uv space, blending
+// the two closest levels if `trilinear` is set.
+template <typename Texture>
+vec4f eval_texture(const Texture& texture, const vec2f& uv,
+    bool as_linear = false, bool no_interpolation = false,
+    bool clamp_to_edge = false, float footprint = 0, bool trilinear = false) {
+  if (texture.width == 0 || texture.height == 0) return {0, 0, 0, 0};
+
+  // filter with the mip pyramid
+  if (!texture.levels.empty()) {
+    auto& levels = texture.levels;
+    auto  lod    = 0.0f;
+    if (footprint > 0) {
+      lod = std::log2(footprint * max(texture.width, texture.height));
+      lod = clamp(lod, 0.0f, (float)(levels.size() - 1));
+    }
+    if (!trilinear) {
+      return eval_texture_level(texture, (int)round(lod), uv, as_linear,
+          no_interpolation, clamp_to_edge);
+    }
+    auto level = (int)lod;
+    auto alpha = lod - level;
+    auto color = eval_texture_level(
+        texture, level, uv, as_linear, no_interpolation, clamp_to_edge);
+    if (alpha == 0) return color;
+    return color * (1 - alpha) +
+           eval_texture_level(texture, level + 1, uv, as_linear,
+               no_interpolation, clamp_to_edge) *
+               alpha;
   }
+
+  return eval_texels({texture.width, texture.height}, uv, no_interpolation,
+      clamp_to_edge,
+      [&](int i, int j) { return lookup_texture(texture, i, j, as_linear); });
 }
 
 template <typename Scene>
 vec4f eval_texture(const Scene& scene, int texture, const vec2f& uv,
     bool ldr_as_linear = false, bool no_interpolation = false,
-    bool clamp_to_edge = false) {
+    bool clamp_to_edge = false, float footprint = 0, bool trilinear = false) {
   if (texture == invalidid) return {1, 1, 1, 1};
-  return eval_texture(
-      scene.textures(texture), uv, ldr_as_linear, no_interpolation);
+  return eval_texture(scene.textures(texture), uv, ldr_as_linear,
+      no_interpolation, clamp_to_edge, footprint, trilinear);
+}
+
+// Builds the mip pyramid of a texture. Each level halves the previous one with
+// a box filter, averaging texels in linear space. The first level is read from
+// the texture, so it stores no texels. Raw textures store the other levels as
+// floats or bytes following their pixels, in tiles of `texture_tile_size`
+// texels. Encoded textures store them in their encoding, as rows of texels,
+// or of blocks for `bc1`.
+template <typename Texture, typename T>
+inline void make_texture_mipmaps(vector<texture_level>& levels,
+    vector<T>& texels, const Texture& texture) {
+  auto encode = [&](vec4f color, auto& texel) {
+    if (!texture.linear) color = rgb_to_srgb(color);
+    if constexpr (std::is_same_v<std::decay_t<decltype(texel)>, vec4b>) {
+      texel = float_to_byte(color);
+    } else {
+      texel = color;
+    }
+  };
+  auto texel_index = [](const texture_level& level, int i, int j) {
+    auto tile = (j / texture_tile_size) * level.tiles + i / texture_tile_size;
+    return level.offset + tile * texture_tile_size * texture_tile_size +
+           (j % texture_tile_size) * texture_tile_size + i % texture_tile_size;
+  };
+  auto add_level = [&](int width, int height, const vector<vec4f>& linear) {
+    auto& level  = levels.emplace_back();
+    level.width  = width;
+    level.height = height;
+    level.offset = (int)texels.size();
+    if constexpr (std::is_same_v<T, byte>) {
+      auto pixels   = texture_data{};
+      pixels.width  = width;
+      pixels.height = height;
+      pixels.linear = texture.linear;
+      if (has_float_texels(texture)) {
+        pixels.pixelsf.resize(linear.size());
+        for (auto idx = (size_t)0; idx < linear.size(); idx++)
+          encode(linear[idx], pixels.pixelsf[idx]);
+      } else {
+        pixels.pixelsb.resize(linear.size());
+        for (auto idx = (size_t)0; idx < linear.size(); idx++)
+          encode(linear[idx], pixels.pixelsb[idx]);
+      }
+      auto encoded = vector<byte>{};
+      encode_texels(encoded, pixels, texture.encoding);
+      texels.insert(texels.end(), encoded.begin(), encoded.end());
+    } else {
+      level.tiles = (width + texture_tile_size - 1) / texture_tile_size;
+      auto rows   = (height + texture_tile_size - 1) / texture_tile_size;
+      texels.resize(texels.size() +
+                    level.tiles * rows * texture_tile_size * texture_tile_size);
+      parallel_for(height, [&](int j) {
+        for (auto i = 0; i < width; i++) {
+          encode(linear[j * width + i], texels[texel_index(level, i, j)]);
+        }
+      });
+    }
+  };
+
+  // first level, decoded
+  auto width = texture.width, height = texture.height;
+  levels.push_back({width, height, 0, 0});
+  auto linear = vector<vec4f>(width * height);
+  parallel_for(height, [&](int j) {
+    for (auto i = 0; i < width; i++) {
+      linear[j * width + i] = lookup_texture(texture, i, j, true);
+    }
+  });
+
+  // other levels
+  while (width > 1 || height > 1) {
+    auto next_width = max(width / 2, 1), next_height = max(height / 2, 1);
+    auto next       = vector<vec4f>(next_width * next_height);
+    parallel_for(next_height, [&](int j) {
+      auto j0 = min(2 * j, height - 1), j1 = min(2 * j + 1, height - 1);
+      for (auto i = 0; i < next_width; i++) {
+        auto i0 = min(2 * i, width - 1), i1 = min(2 * i + 1, width - 1);
+        next[j * next_width + i] =
+            (linear[j0 * width + i0] + linear[j0 * width + i1] +
+                linear[j1 * width + i0] + linear[j1 * width + i1]) /
+            4;
+      }
+    });
+    add_level(next_width, next_height, next);
+    linear = std::move(next);
+    width  = next_width;
+    height = next_height;
+  }
+}
+
+// Erases the data derived from textures and shapes that are no longer in the
+// scene, like mip pyramids and material plans of edited textures and shapes.
+inline void erase_stale_data(const Scene_Hash& scene) {
+  auto used = hash_set<Hash, ArrayHasher>{};
+  for (auto node : scene.textures()) used.insert(node->hash);
+  for (auto node : scene.shapes()) used.insert(node->hash);
+  scene.data.erase_derived(
+      [&](const Hash& source) { return used.count(source) != 0; });
+}
+
+// Builds the mip pyramids of the scene textures if `params.mipmaps` is set.
+// Pyramids are cached in the data table by texture hash, so only new or edited
+// textures are processed. Streamed textures, and scenes not backed by a table,
+// are left as is.
+template <typename Scene>
+inline void make_texture_mipmaps(
+    const Scene& scene, const trace_params& params) {}
+inline void make_texture_mipmaps(
+    const Scene_Hash& scene, const trace_params& params) {
+  if (!params.mipmaps) return;
+  for (auto node : scene.textures()) {
+    auto levels_hash = mipmap_levels_hash(node->hash);
+    if (scene.data.contains(levels_hash)) continue;
+    auto texture = make_texture_view(node, scene.data);
+    if (texture.width == 0 || texture.height == 0) continue;
+    if (texture.encoding == texture_encoding::streamed) continue;
+    auto levels = vector<texture_level>{};
+    if (texture.encoding != texture_encoding::raw) {
+      auto texels = vector<byte>{};
+      make_texture_mipmaps(levels, texels, texture);
+      scene.data.set_derived(mipmap_texels_hash(node->hash), node->hash, texels);
+    } else if (has_float_texels(texture)) {
+      auto texels = vector<vec4f>{};
+      make_texture_mipmaps(levels, texels, texture);
+      scene.data.set_derived(mipmap_texels_hash(node->hash), node->hash, texels);
+    } else {
+      auto texels = vector<vec4b>{};
+      make_texture_mipmaps(levels, texels, texture);
+      scene.data.set_derived(mipmap_texels_hash(node->hash), node->hash, texels);
+    }
+    scene.data.set_derived(levels_hash, node->hash, levels);
+  }
+  erase_stale_data(scene);
 }
 }  // namespace yash
 
@@ -258,6 +474,39 @@ vec2f eval_texcoord(const Scene& scene, const instance_data& instance,
   }
 }
 
+// Texture footprint, in uv units, of a ray cone of the given `width` hitting an
+// element along `direction`, from the ratio of the element uv and world areas.
+// Elements without texcoords use their surface parametrization.
+template <typename Scene>
+float eval_texture_footprint(const Scene& scene, const instance_data& instance,
+    int element, const vec3f& direction, float width) {
+  auto shape   = scene.shapes(instance.shape);
+  auto corners = vec3i{0, 0, 0};
+  if (shape.num_triangles() != 0) {
+    corners = shape.triangles(element);
+  } else if (shape.num_quads() != 0) {
+    auto q  = shape.quads(element);
+    corners = {q.x, q.y, q.w};
+  } else {
+    return 0;
+  }
+  auto p0 = transform_point(instance.frame, shape.positions(corners.x));
+  auto p1 = transform_point(instance.frame, shape.positions(corners.y));
+  auto p2 = transform_point(instance.frame, shape.positions(corners.z));
+  auto t0 = vec2f{0, 0}, t1 = vec2f{1, 0}, t2 = vec2f{0, 1};
+  if (shape.num_texcoords() != 0) {
+    t0 = shape.texcoords(corners.x);
+    t1 = shape.texcoords(corners.y);
+    t2 = shape.texcoords(corners.z);
+  }
+  auto normal     = cross(p1 - p0, p2 - p0);
+  auto world_area = length(normal);
+  auto uv_area    = abs(cross(t1 - t0, t2 - t0));
+  if (world_area == 0 || uv_area == 0) return 0;
+  auto cosine = abs(dot(normal, direction)) / world_area;
+  return width * sqrt(uv_area / world_area) / max(cosine, 0.01f);
+}
+
 #if 0
 // Shape element normal.
 inline pair<vec3f, vec3f> eval_tangents(
@@ -408,22 +657,90 @@ vec4f eval_color(const Scene& scene, const instance_data& instance, int element,
   }
 }
 
-// Evaluate material
+// Evaluation plans of instance materials, picked by the textures and vertex
+// colors they use. Specialized evaluations skip the unused texture and shape
+// lookups. `full` evaluates everything and is used when shapes are not
+// classified.
+enum struct material_plan : uint8_t { full, constant, colors, color_texture };
+
+// Plan of an untextured material on a shape, either `constant` or `colors`.
+// Scenes stored in hash trees read the plans classified by
+// `make_material_plans`, and return `full` for other shapes. Plans are looked
+// up when instances are added to the bvh, not at each evaluation.
+template <typename Scene>
+inline material_plan get_shape_plan(const Scene& scene, int shape) {
+  return scene.shapes(shape).num_colors() == 0 ? material_plan::constant
+                                               : material_plan::colors;
+}
+inline material_plan get_shape_plan(const Scene_Hash& scene, int shape) {
+  return scene.data.get<material_plan>(
+      material_plan_hash(scene.shapes()[shape]->hash));
+}
+
+// Plan of the material of an instance.
+template <typename Scene>
+inline material_plan get_material_plan(const Scene& scene,
+    const instance_data& instance, const material_data& material) {
+  if (material.emission_tex != invalidid ||
+      material.roughness_tex != invalidid ||
+      material.scattering_tex != invalidid)
+    return material_plan::full;
+  auto shape_plan = get_shape_plan(scene, instance.shape);
+  if (material.color_tex == invalidid) return shape_plan;
+  return shape_plan == material_plan::constant ? material_plan::color_texture
+                                               : material_plan::full;
+}
+
+// Classifies the shapes of a scene for material plans. Plans are cached in the
+// data table by shape hash, so only new or edited shapes are processed. Other
+// scenes classify shapes at each lookup.
 template <typename Scene>
+inline void make_material_plans(const Scene& scene) {}
+inline void make_material_plans(const Scene_Hash& scene) {
+  for (auto node : scene.shapes()) {
+    auto key = material_plan_hash(node->hash);
+    if (scene.data.contains(key)) continue;
+    auto shape = make_shape_view(node, scene.data);
+    scene.data.set_derived(key, node->hash,
+        shape.num_colors() == 0 ? material_plan::constant
+                                : material_plan::colors);
+  }
+  erase_stale_data(scene);
+}
+
+// Evaluate material with a given plan
+template <material_plan plan, typename Scene>
 material_point eval_material(const Scene& scene, const instance_data& instance,
-    int element, const vec2f& uv) {
-  auto& material = scene.materials(instance.material);
-  auto  texcoord = eval_texcoord(scene, instance, element, uv);
+    const material_data& material, int element, const vec2f& uv,
+    float footprint, bool trilinear) {
+  constexpr auto textured = plan == material_plan::full ||
+                            plan == material_plan::color_texture;
+  constexpr auto colored = plan == material_plan::full ||
+                           plan == material_plan::colors;
 
   // evaluate textures
-  auto emission_tex = eval_texture(
-      scene, material.emission_tex, texcoord, true);
-  auto color_shp     = eval_color(scene, instance, element, uv);
-  auto color_tex     = eval_texture(scene, material.color_tex, texcoord, true);
-  auto roughness_tex = eval_texture(
-      scene, material.roughness_tex, texcoord, false);
-  auto scattering_tex = eval_texture(
-      scene, material.scattering_tex, texcoord, true);
+  auto emission_tex   = vec4f{1, 1, 1, 1};
+  auto color_shp      = vec4f{1, 1, 1, 1};
+  auto color_tex      = vec4f{1, 1, 1, 1};
+  auto roughness_tex  = vec4f{1, 1, 1, 1};
+  auto scattering_tex = vec4f{1, 1, 1, 1};
+  auto texcoord       = vec2f{0, 0};
+  if constexpr (textured) {
+    texcoord  = eval_texcoord(scene, instance, element, uv);
+    color_tex = eval_texture(scene, material.color_tex, texcoord, true, false,
+        false, footprint, trilinear);
+  }
+  if constexpr (plan == material_plan::full) {
+    emission_tex = eval_texture(scene, material.emission_tex, texcoord, true,
+        false, false, footprint, trilinear);
+    roughness_tex = eval_texture(scene, material.roughness_tex, texcoord,
+        false, false, false, footprint, trilinear);
+    scattering_tex = eval_texture(scene, material.scattering_tex, texcoord,
+        true, false, false, footprint, trilinear);
+  }
+  if constexpr (colored) {
+    color_shp = eval_color(scene, instance, element, uv);
+  }
 
   // material point
   auto point         = material_point{};
@@ -462,6 +779,38 @@ material_point eval_material(const Scene& scene, const instance_data& instance,
   return point;
 }
 
+// Evaluate material, dispatching on a plan resolved by `get_material_plan`
+template <typename Scene>
+material_point eval_material(const Scene& scene, const instance_data& instance,
+    material_plan plan, int element, const vec2f& uv, float footprint = 0,
+    bool trilinear = false) {
+  auto& material = scene.materials(instance.material);
+  switch (plan) {
+    case material_plan::constant:
+      return eval_material<material_plan::constant>(
+          scene, instance, material, element, uv, footprint, trilinear);
+    case material_plan::colors:
+      return eval_material<material_plan::colors>(
+          scene, instance, material, element, uv, footprint, trilinear);
+    case material_plan::color_texture:
+      return eval_material<material_plan::color_texture>(
+          scene, instance, material, element, uv, footprint, trilinear);
+    default:
+      return eval_material<material_plan::full>(
+          scene, instance, material, element, uv, footprint, trilinear);
+  }
+}
+
+// Evaluate material, dispatching on its plan
+template <typename Scene>
+material_point eval_material(const Scene& scene, const instance_data& instance,
+    int element, const vec2f& uv, float footprint = 0, bool trilinear = false) {
+  auto plan = get_material_plan(
+      scene, instance, scene.materials(instance.material));
+  return eval_material(
+      scene, instance, plan, element, uv, footprint, trilinear);
+}
+
 // check if an instance is volumetric
 template <typename Scene>
 bool is_volumetric(const Scene& scene, const instance_data& instance) {
@@ -499,7 +848,76 @@ vec3f eval_environment(const Scene& scene, const vec3f& direction) {
   return emission;
 }
 
-struct bvh_scene : bvh_data {};
+// Instance data used during traversal and shading. The frame is stored
+// already inverted. The material plan is resolved when the instance is added.
+struct bvh_instance {
+  frame3f       frame = identity3x4f;
+  int           shape = invalidid;
+  material_plan plan  = material_plan::full;
+};
+
+// Scene BVH. Shape BVHs replace the ones in `bvh_data` to carry packed data.
+// Instances are indexed like the scene ones, while hashes are used to update
+// shapes and instances after edits.
+struct bvh_scene : bvh_data {
+  vector<shape_bvh>    shapes          = {};
+  vector<bvh_instance> instances       = {};
+  vector<Hash>         shape_hashes    = {};
+  vector<Hash>         instance_hashes = {};
+};
+
+// Check whether a frame has orthonormal axes, so it can be inverted by
+// transposition.
+inline bool is_rigid(const frame3f& frame, float epsilon = 1e-5f) {
+  return abs(dot(frame.x, frame.x) - 1) < epsilon &&
+         abs(dot(frame.y, frame.y) - 1) < epsilon &&
+         abs(dot(frame.z, frame.z) - 1) < epsilon &&
+         abs(dot(frame.x, frame.y)) < epsilon &&
+         abs(dot(frame.y, frame.z)) < epsilon &&
+         abs(dot(frame.z, frame.x)) < epsilon;
+}
+
+// Make the traversal data for an instance.
+template <typename Scene>
+inline bvh_instance make_bvh_instance(
+    const Scene& scene, const instance_data& instance) {
+  return {inverse(instance.frame, !is_rigid(instance.frame)), instance.shape,
+      get_material_plan(scene, instance, scene.materials(instance.material))};
+}
+
+// Update the material plans of the bvh instances, since materials and shape
+// plans change without changing instance hashes.
+template <typename Scene>
+inline void update_material_plans(bvh_scene& bvh, const Scene& scene) {
+  for (auto idx = 0; idx < (int)bvh.instances.size(); idx++) {
+    auto& instance          = scene.instances(idx);
+    bvh.instances[idx].plan = get_material_plan(
+        scene, instance, scene.materials(instance.material));
+  }
+}
+
+// Instance bounding box in world space.
+inline bbox3f instance_bbox(
+    const bvh_scene& bvh, const instance_data& instance) {
+  auto& sbvh = bvh.shapes[instance.shape];
+  return sbvh.nodes.empty()
+             ? invalidb3f
+             : transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+}
+
+// Cache shape and instance hashes. Only scenes stored in hash trees have them.
+template <typename Scene>
+void update_scene_hashes(bvh_scene& bvh, const Scene& scene) {}
+inline void update_scene_hashes(bvh_scene& bvh, const Scene_Hash& scene) {
+  bvh.shape_hashes.resize(scene.shapes().size());
+  for (auto idx = 0; idx < (int)bvh.shape_hashes.size(); idx++) {
+    bvh.shape_hashes[idx] = scene.shapes()[idx]->hash;
+  }
+  bvh.instance_hashes.resize(scene.instances().size());
+  for (auto idx = 0; idx < (int)bvh.instance_hashes.size(); idx++) {
+    bvh.instance_hashes[idx] = scene.instances()[idx]->hash;
+  }
+}
 // vector<instance_data> scene_instances = {};
 // vector<Shape_View>    scene_shapes    = {};
 //   const Scene* scene = nullptr;
@@ -509,14 +927,52 @@ struct bvh_scene : bvh_data {};
 // }
 // };
 
+#ifdef YOCTO_EMBREE
+// Set an Embree instance geometry from a scene instance.
 template <typename Scene>
-bvh_scene make_scene_bvh(
-    const Scene& scene, bool highquality, bool embree, bool noparallel) {
-  // embree
-  // #ifdef YOCTO_EMBREE
-  //   if (embree) return make_embree_bvh(scene, highquality, noparallel);
-  // #endif
+inline void set_embree_instance(const bvh_scene& bvh, const Scene& scene,
+    RTCGeometry egeometry, int instance_id) {
+  auto& instance = scene.instances(instance_id);
+  rtcSetGeometryInstancedScene(
+      egeometry, (RTCScene)bvh.shapes[instance.shape].embree_bvh.get());
+  rtcSetGeometryTransform(
+      egeometry, 0, RTC_FORMAT_FLOAT3X4_COLUMN_MAJOR, &instance.frame);
+  rtcCommitGeometry(egeometry);
+}
+
+// Initialize the Embree instance BVH. Shape BVHs must be Embree scenes.
+template <typename Scene>
+inline void make_embree_bvh(
+    bvh_scene& bvh, const Scene& scene, bool highquality) {
+  auto escene = make_embree_scene(bvh, highquality);
+  for (auto idx = 0; idx < (int)scene.instances().size(); idx++) {
+    auto egeometry = rtcNewGeometry(
+        embree_device(), RTC_GEOMETRY_TYPE_INSTANCE);
+    set_embree_instance(bvh, scene, egeometry, idx);
+    rtcAttachGeometryByID(escene, egeometry, idx);
+    rtcReleaseGeometry(egeometry);
+  }
+  rtcCommitScene(escene);
+  check_embree_error();
+}
+
+// Update the Embree instance BVH after `updated_instances` changed. Shape
+// BVHs are updated in place, so only the top scene needs to be committed.
+template <typename Scene>
+inline void update_embree_bvh(bvh_scene& bvh, const Scene& scene,
+    const vector<int>& updated_instances) {
+  auto escene = (RTCScene)bvh.embree_bvh.get();
+  for (auto instance : updated_instances) {
+    set_embree_instance(bvh, scene, rtcGetGeometry(escene, instance), instance);
+  }
+  rtcCommitScene(escene);
+  check_embree_error();
+}
+#endif
 
+template <typename Scene>
+bvh_scene make_scene_bvh(const Scene& scene, bool highquality, bool embree,
+    bool noparallel, bool packed = false, float spatial_budget = 0) {
   // bvh
   auto bvh = bvh_scene{};
 
@@ -524,23 +980,33 @@ bvh_scene make_scene_bvh(
   bvh.shapes.resize(scene.shapes().size());
   if (noparallel) {
     for (auto idx = (size_t)0; idx < scene.shapes().size(); idx++) {
-      bvh.shapes[idx] = make_shape_bvh(scene.shapes(idx), highquality, embree);
+      bvh.shapes[idx] = make_shape_bvh(
+          scene.shapes(idx), highquality, embree, packed, spatial_budget);
     }
   } else {
     parallel_for(scene.shapes().size(), [&](size_t idx) {
-      bvh.shapes[idx] = make_shape_bvh(scene.shapes(idx), highquality, embree);
+      bvh.shapes[idx] = make_shape_bvh(
+          scene.shapes(idx), highquality, embree, packed, spatial_budget);
     });
   }
 
-  // instance bboxes
+  // instance bboxes and inverse frames
   auto bboxes = vector<bbox3f>(scene.instances().size());
+  bvh.instances.resize(scene.instances().size());
   for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto& instance = scene.instances(idx);
-    auto& sbvh     = bvh.shapes[instance.shape];
-    bboxes[idx]    = sbvh.nodes.empty()
-                         ? invalidb3f
-                         : transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+    auto& instance     = scene.instances(idx);
+    bboxes[idx]        = instance_bbox(bvh, instance);
+    bvh.instances[idx] = make_bvh_instance(scene, instance);
   }
+  update_scene_hashes(bvh, scene);
+
+  // embree
+#ifdef YOCTO_EMBREE
+  if (embree) {
+    make_embree_bvh(bvh, scene, highquality);
+    return bvh;
+  }
+#endif
 
   // build nodes
   build_bvh(bvh, bboxes, highquality);
@@ -560,21 +1026,113 @@ bvh_scene make_scene_bvh(
 
 template <typename Scene>
 bvh_scene make_bvh(const Scene& scene, const trace_params& params) {
-  return make_scene_bvh(
-      scene, params.highqualitybvh, params.embreebvh, params.noparallel);
+  return make_scene_bvh(scene, params.highqualitybvh, params.embreebvh,
+      params.noparallel, params.packedbvh,
+      params.spatialbvh ? params.spatialbudget : 0);
 }
 
+// Refit the scene bvh after the vertices of `updated_shapes` moved and the
+// frames of `updated_instances` changed. Elements, shapes and instances must
+// not be added or removed. Shapes are refit in turn, each in parallel, then
+// the instance bvh is refit in parallel.
 template <typename Scene>
+void refit_scene_bvh(bvh_scene& bvh, const Scene& scene,
+    const vector<int>& updated_instances, const vector<int>& updated_shapes,
+    bool noparallel = false) {
+  // refit shapes
+  for (auto shape : updated_shapes) {
+    refit_shape_bvh(bvh.shapes[shape], scene.shapes(shape), noparallel);
+  }
+
+  // update instances
+  for (auto instance : updated_instances) {
+    bvh.instances[instance] = make_bvh_instance(
+        scene, scene.instances(instance));
+  }
+
+  // embree
+#ifdef YOCTO_EMBREE
+  if (bvh.embree_bvh) return update_embree_bvh(bvh, scene, updated_instances);
+#endif
+
+  // refit instance bvh
+  refit_bvh(
+      bvh,
+      [&](int instance) {
+        return instance_bbox(bvh, scene.instances(instance));
+      },
+      noparallel);
+}
+
+// Update the shapes and instances whose hash changed and refit the nodes
+// above them. Shape BVHs are refit or rebuilt depending on how much their
+// quality degraded. The bvh is rebuilt if shapes or instances were added or
+// removed. Material plans are updated for all instances, so they must be made
+// before.
+inline void update_scene_bvh(
+    bvh_scene& bvh, const Scene_Hash& scene, const trace_params& params) {
+  // rebuild if counts changed
+  if (bvh.shapes.size() != scene.shapes().size() ||
+      bvh.instances.size() != scene.instances().size()) {
+    bvh = make_bvh(scene, params);
+    return;
+  }
+
+  // find updated shapes
+  auto updated_shapes = vector<int>{};
+  for (auto idx = 0; idx < (int)bvh.shapes.size(); idx++) {
+    auto node = scene.shapes()[idx];
+    if (node->hash == bvh.shape_hashes[idx]) continue;
+    bvh.shape_hashes[idx] = node->hash;
+    updated_shapes.push_back(idx);
+  }
+
+  // update shapes in parallel, or a single shape with parallel builds
+  auto spatial_budget = params.spatialbvh ? params.spatialbudget : 0;
+  auto update_shape   = [&](int idx, bool noparallel) {
+    auto shape = updated_shapes[idx];
+    update_shape_bvh(bvh.shapes[shape], scene.shapes(shape),
+        params.highqualitybvh, params.embreebvh, spatial_budget, noparallel);
+  };
+  if (updated_shapes.size() == 1 || params.noparallel) {
+    for (auto idx = 0; idx < (int)updated_shapes.size(); idx++)
+      update_shape(idx, params.noparallel);
+  } else {
+    parallel_for((int)updated_shapes.size(),
+        [&](int idx) { update_shape(idx, true); });
+  }
+
+  // find updated instances
+  auto updated_instances = vector<int>{};
+  for (auto idx = 0; idx < (int)bvh.instances.size(); idx++) {
+    auto node = scene.instances()[idx];
+    if (node->hash == bvh.instance_hashes[idx]) continue;
+    bvh.instance_hashes[idx] = node->hash;
+    updated_instances.push_back(idx);
+  }
+
+  // material plans
+  update_material_plans(bvh, scene);
+
+  // refit instances, shapes are already up to date
+  if (updated_shapes.empty() && updated_instances.empty()) return;
+  refit_scene_bvh(bvh, scene, updated_instances, {}, params.noparallel);
+}
+
+// Intersect ray with a bvh. Closest-hit and any-hit queries are compiled as
+// separate kernels, selected by `find_any`. The any-hit kernel returns at the
+// first hit found, without updating instance and element.
+template <bool find_any, typename Scene, typename Counters = bvh_no_counters>
 bool intersect_scene(const bvh_scene& bvh, const Scene& scene,
-    const ray3f& ray_, int& instance, int& element, vec2f& uv, float& distance,
-    bool find_any, bool non_rigid_frames) {
-  // #ifdef YOCTO_EMBREE
-  //   // call Embree if needed
-  //   if (bvh.embree_bvh) {
-  //     return intersect_embree_bvh(
-  //         bvh, scene, ray_, instance, element, uv, distance, find_any);
-  //   }
-  // #endif
+    const ray3f& ray_, int& instance, int& element, vec2f& uv,
+    float& distance, Counters&& counters = {}) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (bvh.embree_bvh) {
+    return intersect_embree_bvh<find_any>(
+        bvh, ray_, instance, element, uv, distance);
+  }
+#endif
 
   // check empty
   if (bvh.nodes.empty()) return false;
@@ -599,6 +1157,7 @@ bool intersect_scene(const bvh_scene& bvh, const Scene& scene,
   while (node_cur != 0) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    counters.visit_node();
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -618,57 +1177,144 @@ bool intersect_scene(const bvh_scene& bvh, const Scene& scene,
       }
     } else {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& instance_ = scene.instances(bvh.primitives[idx]);
-        auto  inv_ray   = transform_ray(
-            inverse(instance_.frame, non_rigid_frames), ray);
-        if (intersect_shape(bvh.shapes[instance_.shape],
+        auto& instance_ = bvh.instances[bvh.primitives[idx]];
+        auto  inv_ray   = transform_ray(instance_.frame, ray);
+        if (intersect_shape<find_any>(bvh.shapes[instance_.shape],
                 scene.shapes(instance_.shape), inv_ray, element, uv, distance,
-                find_any)) {
+                counters)) {
+          if constexpr (find_any) return true;
           hit      = true;
           instance = bvh.primitives[idx];
           ray.tmax = distance;
         }
       }
     }
-
-    // check for early exit
-    if (find_any && hit) return hit;
   }
 
   return hit;
 }
 
 // Intersect ray with a bvh.
-template <typename Scene>
+template <bool find_any, typename Scene>
 bool intersect_scene(const bvh_scene& bvh, const Scene& scene, int instance_,
-    const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
-  auto& instance = scene.instances(instance_);
-  auto  inv_ray = transform_ray(inverse(instance.frame, non_rigid_frames), ray);
-  return intersect_shape(bvh.shapes[instance.shape],
-      scene.shapes(instance.shape), inv_ray, element, uv, distance, find_any);
+    const ray3f& ray, int& element, vec2f& uv, float& distance) {
+  auto& instance = bvh.instances[instance_];
+  auto  inv_ray  = transform_ray(instance.frame, ray);
+  return intersect_shape<find_any>(bvh.shapes[instance.shape],
+      scene.shapes(instance.shape), inv_ray, element, uv, distance);
 }
-template <typename Scene>
-bvh_intersection intersect_scene(const bvh_scene& bvh, const Scene& scene,
-    const ray3f& ray, bool find_any = true, bool non_rigid_frames = false) {
+template <bool find_any = false, typename Scene>
+bvh_intersection intersect_scene(
+    const bvh_scene& bvh, const Scene& scene, const ray3f& ray) {
   auto intersection = bvh_intersection{};
-  intersection.hit  = intersect_scene(bvh, scene, ray, intersection.instance,
-      intersection.element, intersection.uv, intersection.distance, find_any,
-      non_rigid_frames);
+  intersection.hit  = intersect_scene<find_any>(bvh, scene, ray,
+      intersection.instance, intersection.element, intersection.uv,
+      intersection.distance);
   return intersection;
 }
-template <typename Scene>
-bvh_intersection intersect_scene(const bvh_scene& bvh, const Scene& scene,
-    int instance, const ray3f& ray, bool find_any = true,
-    bool non_rigid_frames = false) {
+template <bool find_any = false, typename Scene>
+bvh_intersection intersect_scene(
+    const bvh_scene& bvh, const Scene& scene, int instance, const ray3f& ray) {
   auto intersection     = bvh_intersection{};
-  intersection.hit      = intersect_scene(bvh, scene, instance, ray,
-      intersection.element, intersection.uv, intersection.distance, find_any,
-      non_rigid_frames);
+  intersection.hit      = intersect_scene<find_any>(bvh, scene, instance, ray,
+      intersection.element, intersection.uv, intersection.distance);
   intersection.instance = instance;
   return intersection;
 }
 
+// Intersect a packet of up to 32 coherent rays with the scene, returning the
+// closest hit for each active ray in `mask`. Returns the mask of rays that hit.
+template <typename Scene, size_t N>
+uint32_t intersect_scene_packet(const bvh_scene& bvh, const Scene& scene,
+    const array<ray3f, N>& rays_, uint32_t mask,
+    array<bvh_intersection, N>& intersections) {
+  static_assert(N <= 32, "packets are limited to 32 rays");
+
+  // Embree traces rays one at a time
+#ifdef YOCTO_EMBREE
+  if (bvh.embree_bvh) {
+    auto hits = (uint32_t)0;
+    for (auto idx = 0; idx < (int)N; idx++) {
+      if (!(mask & (1u << idx))) continue;
+      intersections[idx] = intersect_scene(bvh, scene, rays_[idx]);
+      if (intersections[idx].hit) hits |= 1u << idx;
+    }
+    return hits;
+  }
+#endif
+
+  // check empty
+  if (bvh.nodes.empty() || mask == 0) return 0;
+
+  // copy rays to modify them
+  auto rays = rays_;
+
+  // prepare rays for fast queries
+  auto rays_dinv = array<vec3f, N>{};
+  auto first     = -1;
+  for (auto i = 0; i < (int)N; i++) {
+    if (!(mask & (1u << i))) continue;
+    rays_dinv[i] = {1 / rays[i].d.x, 1 / rays[i].d.y, 1 / rays[i].d.z};
+    if (first < 0) first = i;
+  }
+  auto bounds = make_packet_bounds(rays, rays_dinv, mask);
+
+  // node stack with the rays active for each node
+  auto node_stack        = array<pair<int, uint32_t>, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = {0, mask};
+
+  // shared variables
+  auto hits = 0u;
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto [nodeid, node_mask] = node_stack[--node_cur];
+    auto& node               = bvh.nodes[nodeid];
+
+    // intersect bbox for the whole packet, then for each ray
+    if (bounds.valid && cull_packet_bbox(bounds, node.bbox)) continue;
+    auto active = 0u;
+    for (auto i = 0; i < (int)N; i++) {
+      if (!(node_mask & (1u << i))) continue;
+      if (intersect_bbox(rays[i], rays_dinv[i], node.bbox)) active |= 1u << i;
+    }
+    if (active == 0) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // order children by the direction of the first ray in the packet
+      if (rays_dinv[first][node.axis] < 0) {
+        node_stack[node_cur++] = {node.start + 0, active};
+        node_stack[node_cur++] = {node.start + 1, active};
+      } else {
+        node_stack[node_cur++] = {node.start + 1, active};
+        node_stack[node_cur++] = {node.start + 0, active};
+      }
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& instance_ = bvh.instances[bvh.primitives[idx]];
+        auto  inv_rays  = array<ray3f, N>{};
+        for (auto i = 0; i < (int)N; i++) {
+          if (!(active & (1u << i))) continue;
+          inv_rays[i] = transform_ray(instance_.frame, rays[i]);
+        }
+        auto instance_hits = intersect_shape_packet(bvh.shapes[instance_.shape],
+            scene.shapes(instance_.shape), inv_rays, active, intersections);
+        for (auto i = 0; i < (int)N; i++) {
+          if (!(instance_hits & (1u << i))) continue;
+          intersections[i].instance = bvh.primitives[idx];
+          rays[i].tmax              = intersections[i].distance;
+        }
+        hits |= instance_hits;
+      }
+    }
+  }
+
+  return hits;
+}
+
 template <typename Scene>
 vec3f eval_position(const Scene& scene, const bvh_intersection& intersection) {
   return eval_position(scene, scene.instances(intersection.instance),
@@ -703,10 +1349,19 @@ vec2f eval_texcoord(const Scene& scene, const bvh_intersection& intersection) {
       intersection.element, intersection.uv);
 }
 template <typename Scene>
-material_point eval_material(
-    const Scene& scene, const bvh_intersection& intersection) {
+material_point eval_material(const Scene& scene, const bvh_scene& bvh,
+    const bvh_intersection& intersection, float footprint = 0,
+    bool trilinear = false) {
   return eval_material(scene, scene.instances(intersection.instance),
-      intersection.element, intersection.uv);
+      bvh.instances[intersection.instance].plan, intersection.element,
+      intersection.uv, footprint, trilinear);
+}
+template <typename Scene>
+float eval_texture_footprint(const Scene& scene,
+    const bvh_intersection& intersection, const vec3f& direction,
+    float width) {
+  return eval_texture_footprint(scene, scene.instances(intersection.instance),
+      intersection.element, direction, width);
 }
 template <typename Scene>
 bool is_volumetric(const Scene& scene, const bvh_intersection& intersection) {
@@ -751,8 +1406,259 @@ inline trace_light& add_light(trace_lights& lights) {
   return lights.lights.emplace_back();
 }
 
+// Build an alias table for sampling `weights` in constant time, with Vose's
+// method. Each slot keeps its own index with probability `probs[idx]`, and
+// otherwise picks `ids[idx]`.
+inline void make_alias_table(
+    const vector<float>& weights, vector<float>& probs, vector<int>& ids) {
+  auto size  = (int)weights.size();
+  auto total = 0.0;
+  for (auto weight : weights) total += weight;
+  probs.assign(size, 1);
+  ids.resize(size);
+  for (auto idx = 0; idx < size; idx++) ids[idx] = idx;
+  if (total <= 0) return;
+  auto scaled = vector<double>(size);
+  auto small = vector<int>{}, large = vector<int>{};
+  for (auto idx = 0; idx < size; idx++) {
+    scaled[idx] = weights[idx] * size / total;
+    (scaled[idx] < 1 ? small : large).push_back(idx);
+  }
+  while (!small.empty() && !large.empty()) {
+    auto less = small.back(), more = large.back();
+    small.pop_back();
+    probs[less] = (float)scaled[less];
+    ids[less]   = more;
+    scaled[more] -= 1 - scaled[less];
+    if (scaled[more] < 1) {
+      large.pop_back();
+      small.push_back(more);
+    }
+  }
+}
+
+// Sample an alias table.
+inline int sample_alias(
+    const vector<float>& probs, const vector<int>& ids, float r) {
+  auto size = (int)probs.size();
+  auto x    = r * size;
+  auto idx  = clamp((int)x, 0, size - 1);
+  return (x - idx) < probs[idx] ? idx : ids[idx];
+}
+
+// Sample a discrete distribution given as the cdf in `[cdf, cdf + size)`.
+inline int sample_discrete(const float* cdf, int size, float r) {
+  auto total = cdf[size - 1];
+  r          = clamp(r * total, 0.0f, total - 0.00001f);
+  auto idx   = (int)(std::upper_bound(cdf, cdf + size, r) - cdf);
+  return clamp(idx, 0, size - 1);
+}
+
+// Hash of a texture, used to cache light distributions. Only scenes stored
+// in hash trees have them.
 template <typename Scene>
-trace_lights make_lights(const Scene& scene, const trace_params& params) {
+inline Hash texture_hash(const Scene& scene, int texture) {
+  return invalid_hash;
+}
+inline Hash texture_hash(const Scene_Hash& scene, int texture) {
+  return scene.textures()[texture]->hash;
+}
+
+// Environment distributions cached by emission texture hash. Lights share
+// the cached distributions.
+using light_cache = unordered_map<Hash,
+    shared_ptr<const trace_environment_distribution>, ArrayHasher>;
+
+// Build the distribution of an environment map, weighting texels by their
+// value and solid angle. Rows are built in parallel, unless `noparallel`.
+template <typename Texture>
+inline shared_ptr<const trace_environment_distribution>
+make_environment_distribution(const Texture& texture, bool noparallel) {
+  auto distribution = std::make_shared<trace_environment_distribution>();
+  auto width        = texture.width;
+  auto height       = texture.height;
+  auto& rows_cdf    = distribution->rows_cdf;
+  auto& texels_cdf  = distribution->texels_cdf;
+  texels_cdf.assign(width * height, 0);
+  rows_cdf.assign(height, 0);
+  auto make_row = [&](int j) {
+    auto th  = (j + 0.5f) * pif / height;
+    auto cdf = texels_cdf.data() + j * width;
+    for (auto i = 0; i < width; i++) {
+      cdf[i] = max(lookup_texture(texture, i, j)) * sin(th);
+      if (i != 0) cdf[i] += cdf[i - 1];
+    }
+  };
+  if (noparallel) {
+    for (auto j = 0; j < height; j++) make_row(j);
+  } else {
+    parallel_for(height, make_row);
+  }
+  for (auto j = 0; j < height; j++) {
+    rows_cdf[j] = texels_cdf[j * width + width - 1];
+    if (j != 0) rows_cdf[j] += rows_cdf[j - 1];
+  }
+  return distribution;
+}
+
+// Merge two cones of directions, given as axis and angle, into a cone that
+// bounds both.
+inline pair<vec3f, float> merge_cones(
+    const vec3f& axis_a, float theta_a, const vec3f& axis_b, float theta_b) {
+  if (theta_a < theta_b) return merge_cones(axis_b, theta_b, axis_a, theta_a);
+  auto theta_d = acos(clamp(dot(axis_a, axis_b), -1.0f, 1.0f));
+  if (min(theta_d + theta_b, pif) <= theta_a) return {axis_a, theta_a};
+  auto theta = (theta_a + theta_d + theta_b) / 2;
+  if (theta >= pif) return {axis_a, pif};
+  auto ortho = axis_b - axis_a * dot(axis_a, axis_b);
+  if (length(ortho) < 1e-6f) return {axis_a, pif};
+  auto theta_r = theta - theta_a;
+  auto axis    = normalize(
+      axis_a * cos(theta_r) + normalize(ortho) * sin(theta_r));
+  return {axis, theta};
+}
+
+// Light bvh node for an instance light, bounding the world-space positions,
+// the element normals and the emitted power.
+template <typename Scene>
+inline trace_light_node make_light_node(
+    const Scene& scene, const trace_light& light, int light_id) {
+  auto& instance = scene.instances(light.instance);
+  auto& material = scene.materials(instance.material);
+  auto  shape    = scene.shapes(instance.shape);
+  auto  node     = trace_light_node{};
+  node.light     = light_id;
+  for (auto idx = 0; idx < (int)shape.num_positions(); idx++) {
+    auto position = transform_point(instance.frame, shape.positions(idx));
+    node.bbox     = merge(node.bbox, position);
+  }
+  // pad flat lights, so that rays along their plane hit their bounds
+  auto pad = 1e-4f * max(length(node.bbox.max - node.bbox.min), 1.0f);
+  node.bbox.min -= pad;
+  node.bbox.max += pad;
+  auto num_elements = (int)(shape.num_triangles() != 0 ? shape.num_triangles()
+                                                       : shape.num_quads());
+  auto normal_sum   = vec3f{0, 0, 0};
+  for (auto element = 0; element < num_elements; element++) {
+    auto normal = eval_element_normal(scene, instance, element);
+    auto earea  = element != 0 ? light.elements_cdf[element] -
+                                    light.elements_cdf[element - 1]
+                               : light.elements_cdf[element];
+    normal_sum += normal * earea;
+  }
+  if (length(normal_sum) < 1e-6f) {
+    node.theta = pif;
+  } else {
+    node.axis = normalize(normal_sum);
+    for (auto element = 0; element < num_elements; element++) {
+      auto normal = eval_element_normal(scene, instance, element);
+      node.theta  = max(
+          node.theta, acos(clamp(dot(node.axis, normal), -1.0f, 1.0f)));
+    }
+  }
+  auto scale = length(transform_direction(instance.frame, {1, 0, 0}));
+  node.power = max(material.emission) * light.elements_cdf.back() * scale *
+               scale;
+  return node;
+}
+
+// Estimated contribution of a light bvh node to a point. Emitters are
+// two-sided, so the orientation bound uses the angle between the point and
+// the cone axis, or its opposite.
+inline float light_importance(
+    const trace_light_node& node, const vec3f& position) {
+  if (node.power == 0) return 0;
+  auto center   = (node.bbox.min + node.bbox.max) / 2;
+  auto radius   = length(node.bbox.max - node.bbox.min) / 2;
+  auto distance = length(position - center);
+  if (distance <= radius) return node.power / max(radius * radius, flt_eps);
+  auto direction = (position - center) / distance;
+  auto theta     = acos(clamp(abs(dot(node.axis, direction)), 0.0f, 1.0f));
+  auto theta_u   = asin(clamp(radius / distance, 0.0f, 1.0f));
+  auto theta_p   = max(theta - node.theta - theta_u, 0.0f);
+  if (theta_p >= pif / 2) return 0;
+  return node.power * cos(theta_p) /
+         max(distance * distance, radius * radius);
+}
+
+// Probability of choosing the first child of a light bvh node.
+inline float light_child_prob(const trace_lights& lights,
+    const trace_light_node& node, const vec3f& position) {
+  auto importance_a = light_importance(lights.nodes[node.child], position);
+  auto importance_b = light_importance(lights.nodes[node.child + 1], position);
+  if (importance_a + importance_b == 0) return 0.5f;
+  return importance_a / (importance_a + importance_b);
+}
+
+// Build the light bvh node `node_id` for `lights[start, end)`, with a median
+// split along the largest axis of the light centers. Children are stored
+// next to each other, as in `trace_light_node`.
+inline void make_light_nodes(vector<trace_light_node>& nodes,
+    vector<trace_light_node>& lights, int node_id, int start, int end,
+    int parent) {
+  if (end - start == 1) {
+    nodes[node_id]        = lights[start];
+    nodes[node_id].parent = parent;
+    return;
+  }
+  auto cbbox = invalidb3f;
+  for (auto idx = start; idx < end; idx++) {
+    cbbox = merge(cbbox, center(lights[idx].bbox));
+  }
+  auto size = cbbox.max - cbbox.min;
+  auto axis = size.x >= size.y && size.x >= size.z ? 0
+              : size.y >= size.z                   ? 1
+                                                   : 2;
+  auto mid  = (start + end) / 2;
+  std::nth_element(lights.begin() + start, lights.begin() + mid,
+      lights.begin() + end, [axis](auto& a, auto& b) {
+        return center(a.bbox)[axis] < center(b.bbox)[axis];
+      });
+  auto child = (int)nodes.size();
+  nodes.resize(nodes.size() + 2);
+  make_light_nodes(nodes, lights, child, start, mid, node_id);
+  make_light_nodes(nodes, lights, child + 1, mid, end, node_id);
+  auto& node  = nodes[node_id];
+  auto& a     = nodes[child];
+  auto& b     = nodes[child + 1];
+  node.parent = parent;
+  node.child  = child;
+  node.light  = -1;
+  node.bbox   = merge(a.bbox, b.bbox);
+  node.power  = a.power + b.power;
+  std::tie(node.axis, node.theta) = merge_cones(
+      a.axis, a.theta, b.axis, b.theta);
+}
+
+// Build the light bvh over instance lights.
+template <typename Scene>
+inline void make_light_bvh(trace_lights& lights, const Scene& scene) {
+  auto leaves = vector<trace_light_node>{};
+  lights.leaves.assign(lights.lights.size(), -1);
+  lights.environments.clear();
+  for (auto light_id = 0; light_id < (int)lights.lights.size(); light_id++) {
+    auto& light = lights.lights[light_id];
+    if (light.instance != invalidid) {
+      leaves.push_back(make_light_node(scene, light, light_id));
+    } else {
+      lights.environments.push_back(light_id);
+    }
+  }
+  lights.nodes.clear();
+  if (leaves.empty()) return;
+  lights.nodes.resize(1);
+  make_light_nodes(lights.nodes, leaves, 0, 0, (int)leaves.size(), -1);
+  for (auto node_id = 0; node_id < (int)lights.nodes.size(); node_id++) {
+    auto& node = lights.nodes[node_id];
+    if (node.child < 0) lights.leaves[node.light] = node_id;
+  }
+}
+
+// Build the scene lights. Environment distributions are reused from `cache`
+// if their emission texture did not change.
+template <typename Scene>
+trace_lights make_lights(
+    const Scene& scene, const trace_params& params, light_cache& cache) {
   auto lights = trace_lights{};
 
   for (auto handle = 0; handle < scene.num_instances(); handle++) {
@@ -782,6 +1688,11 @@ trace_lights make_lights(const Scene& scene, const trace_params& params) {
         if (idx != 0) light.elements_cdf[idx] += light.elements_cdf[idx - 1];
       }
     }
+    auto areas = light.elements_cdf;
+    for (auto idx = (int)areas.size() - 1; idx > 0; idx--) {
+      areas[idx] -= areas[idx - 1];
+    }
+    make_alias_table(areas, light.alias_probs, light.alias_ids);
   }
   for (auto handle = 0; handle < scene.num_environments(); handle++) {
     auto& environment = scene.environments(handle);
@@ -790,21 +1701,35 @@ trace_lights make_lights(const Scene& scene, const trace_params& params) {
     light.instance    = invalidid;
     light.environment = handle;
     if (environment.emission_tex != invalidid) {
-      auto texture       = scene.textures(environment.emission_tex);
-      light.elements_cdf = vector<float>(texture.width * texture.height);
-      for (auto idx = 0; idx < light.elements_cdf.size(); idx++) {
-        auto ij    = vec2i{idx % texture.width, idx / texture.width};
-        auto th    = (ij.y + 0.5f) * pif / texture.height;
-        auto value = lookup_texture(texture, ij.x, ij.y);
-        light.elements_cdf[idx] = max(value) * sin(th);
-        if (idx != 0) light.elements_cdf[idx] += light.elements_cdf[idx - 1];
+      auto hash = texture_hash(scene, environment.emission_tex);
+      if (auto it = cache.find(hash); it != cache.end()) {
+        light.distribution = it->second;
+      } else {
+        light.distribution = make_environment_distribution(
+            scene.textures(environment.emission_tex), params.noparallel);
+        if (hash != invalid_hash) cache[hash] = light.distribution;
       }
     }
   }
 
+  // drop the distributions of textures no longer used by the lights
+  for (auto it = cache.begin(); it != cache.end();) {
+    auto used = false;
+    for (auto& light : lights.lights) used |= light.distribution == it->second;
+    it = used ? std::next(it) : cache.erase(it);
+  }
+
+  // light bvh
+  if (params.lightbvh) make_light_bvh(lights, scene);
+
   // handle progress
   return lights;
 }
+template <typename Scene>
+trace_lights make_lights(const Scene& scene, const trace_params& params) {
+  auto cache = light_cache{};
+  return make_lights(scene, params, cache);
+}
 
 struct trace_result {
   vec3f radiance = {0, 0, 0};
@@ -854,15 +1779,14 @@ ray3f sample_camera(const camera_data& camera, const vec2i& ij,
   }
 }
 
+// Sample a direction toward a light.
 template <typename Scene>
-vec3f sample_lights(const Scene& scene, const trace_lights& lights,
-    const vec3f& position, float rl, float rel, const vec2f& ruv) {
-  auto  light_id = sample_uniform((int)lights.lights.size(), rl);
-  auto& light    = lights.lights[light_id];
+vec3f sample_light(const Scene& scene, const trace_light& light,
+    const vec3f& position, float rel, const vec2f& ruv) {
   if (light.instance != invalidid) {
     auto& instance  = scene.instances(light.instance);
     auto  shape     = scene.shapes(instance.shape);
-    auto  element   = sample_discrete(light.elements_cdf, rel);
+    auto  element   = sample_alias(light.alias_probs, light.alias_ids, rel);
     auto  uv        = (shape.num_triangles() == 0) ? sample_triangle(ruv) : ruv;
     auto  lposition = eval_position(scene, instance, element, uv);
     return normalize(lposition - position);
@@ -870,9 +1794,12 @@ vec3f sample_lights(const Scene& scene, const trace_lights& lights,
     auto& environment = scene.environments(light.environment);
     if (environment.emission_tex != invalidid) {
       auto emission_tex = scene.textures(environment.emission_tex);
-      auto idx          = sample_discrete(light.elements_cdf, rel);
-      auto uv = vec2f{((idx % emission_tex.width) + 0.5f) / emission_tex.width,
-          ((idx / emission_tex.width) + 0.5f) / emission_tex.height};
+      auto width        = emission_tex.width;
+      auto& distribution = *light.distribution;
+      auto  j = sample_discrete(distribution.rows_cdf, rel);
+      auto  i = sample_discrete(
+          distribution.texels_cdf.data() + j * width, width, ruv.x);
+      auto uv = vec2f{(i + 0.5f) / width, (j + 0.5f) / emission_tex.height};
       return transform_direction(environment.frame,
           {cos(uv.x * 2 * pif) * sin(uv.y * pif), cos(uv.y * pif),
               sin(uv.x * 2 * pif) * sin(uv.y * pif)});
@@ -1001,57 +1928,150 @@ inline float sample_delta_pdf(const material_point& material,
   }
 }
 
-// Sample lights pdf
+// Pick a light with the light bvh. Environment lights and the light bvh are
+// picked uniformly, then the light bvh is traversed choosing children by
+// their importance, reusing the random number.
+inline int sample_light_bvh(
+    const trace_lights& lights, const vec3f& position, float rl) {
+  auto num_environments = (int)lights.environments.size();
+  auto num_choices = num_environments + (lights.nodes.empty() ? 0 : 1);
+  auto choice      = sample_uniform(num_choices, rl);
+  if (choice < num_environments) return lights.environments[choice];
+  rl           = min(rl * num_choices - choice, 1 - flt_eps);
+  auto node_id = 0;
+  while (lights.nodes[node_id].child >= 0) {
+    auto& node = lights.nodes[node_id];
+    auto  prob = light_child_prob(lights, node, position);
+    if (rl < prob) {
+      rl      = rl / prob;
+      node_id = node.child;
+    } else {
+      rl      = (rl - prob) / (1 - prob);
+      node_id = node.child + 1;
+    }
+  }
+  return lights.nodes[node_id].light;
+}
+
+// Probability of picking a light with the light bvh. Multiplies the
+// probabilities of the choices from the leaf of the light up to the root.
+inline float sample_light_bvh_pdf(
+    const trace_lights& lights, int light_id, const vec3f& position) {
+  auto num_choices = (int)lights.environments.size() +
+                     (lights.nodes.empty() ? 0 : 1);
+  auto pdf     = sample_uniform_pdf(num_choices);
+  auto node_id = lights.leaves[light_id];
+  if (node_id < 0) return pdf;
+  while (lights.nodes[node_id].parent >= 0) {
+    auto& parent = lights.nodes[lights.nodes[node_id].parent];
+    auto  prob   = light_child_prob(lights, parent, position);
+    pdf *= node_id == parent.child ? prob : 1 - prob;
+    node_id = lights.nodes[node_id].parent;
+  }
+  return pdf;
+}
+
+// Sample a direction toward the lights. With the light bvh, lights are
+// picked proportionally to their estimated contribution.
+template <typename Scene>
+vec3f sample_lights(const Scene& scene, const trace_lights& lights,
+    const vec3f& position, float rl, float rel, const vec2f& ruv) {
+  if (!lights.leaves.empty()) {
+    auto light_id = sample_light_bvh(lights, position, rl);
+    return sample_light(scene, lights.lights[light_id], position, rel, ruv);
+  }
+  auto light_id = sample_uniform((int)lights.lights.size(), rl);
+  return sample_light(scene, lights.lights[light_id], position, rel, ruv);
+}
+
+// Pdf of sampling a direction toward a light.
+template <typename Scene>
+inline float sample_light_pdf(const Scene& scene, const bvh_scene& bvh,
+    const trace_light& light, const vec3f& position, const vec3f& direction) {
+  if (light.instance != invalidid) {
+    auto& instance = scene.instances(light.instance);
+    // check all intersection
+    auto lpdf          = 0.0f;
+    auto next_position = position;
+    for (auto bounce = 0; bounce < 100; bounce++) {
+      auto intersection = intersect_scene(
+          bvh, scene, light.instance, {next_position, direction});
+      if (!intersection.hit) break;
+      // accumulate pdf
+      auto lposition = eval_position(
+          scene, instance, intersection.element, intersection.uv);
+      auto lnormal = eval_element_normal(
+          scene, instance, intersection.element);
+      // prob triangle * area triangle = area triangle mesh
+      auto area = light.elements_cdf.back();
+      lpdf += distance_squared(lposition, position) /
+              (abs(dot(lnormal, direction)) * area);
+      // continue
+      next_position = lposition + direction * 1e-3f;
+    }
+    return lpdf;
+  } else if (light.environment != invalidid) {
+    auto& environment = scene.environments(light.environment);
+    if (environment.emission_tex != invalidid) {
+      auto& emission_tex = scene.textures(environment.emission_tex);
+      auto  wl = transform_direction(inverse(environment.frame), direction);
+      auto  texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
+          acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
+      if (texcoord.x < 0) texcoord.x += 1;
+      auto i = clamp(
+          (int)(texcoord.x * emission_tex.width), 0, emission_tex.width - 1);
+      auto j    = clamp((int)(texcoord.y * emission_tex.height), 0,
+          emission_tex.height - 1);
+      // row prob * texel prob in the row = texel weight / total weight
+      auto& distribution = *light.distribution;
+      auto  cdf  = distribution.texels_cdf.data() + j * emission_tex.width;
+      auto  prob = (cdf[i] - (i != 0 ? cdf[i - 1] : 0)) /
+                  distribution.rows_cdf.back();
+      auto angle = (2 * pif / emission_tex.width) *
+                   (pif / emission_tex.height) *
+                   sin(pif * (j + 0.5f) / emission_tex.height);
+      return prob / angle;
+    } else {
+      return 1 / (4 * pif);
+    }
+  }
+  return 0;
+}
+
+// Sample lights pdf. With the light bvh, only the lights whose bounds are
+// hit by the direction are checked.
 template <typename Scene>
 inline float sample_lights_pdf(const Scene& scene, const bvh_scene& bvh,
     const trace_lights& lights, const vec3f& position, const vec3f& direction) {
-  auto pdf = 0.0f;
-  for (auto& light : lights.lights) {
-    if (light.instance != invalidid) {
-      auto& instance = scene.instances(light.instance);
-      // check all intersection
-      auto lpdf          = 0.0f;
-      auto next_position = position;
-      for (auto bounce = 0; bounce < 100; bounce++) {
-        auto intersection = intersect_scene(
-            bvh, scene, light.instance, {next_position, direction});
-        if (!intersection.hit) break;
-        // accumulate pdf
-        auto lposition = eval_position(
-            scene, instance, intersection.element, intersection.uv);
-        auto lnormal = eval_element_normal(
-            scene, instance, intersection.element);
-        // prob triangle * area triangle = area triangle mesh
-        auto area = light.elements_cdf.back();
-        lpdf += distance_squared(lposition, position) /
-                (abs(dot(lnormal, direction)) * area);
-        // continue
-        next_position = lposition + direction * 1e-3f;
-      }
-      pdf += lpdf;
-    } else if (light.environment != invalidid) {
-      auto& environment = scene.environments(light.environment);
-      if (environment.emission_tex != invalidid) {
-        auto& emission_tex = scene.textures(environment.emission_tex);
-        auto  wl = transform_direction(inverse(environment.frame), direction);
-        auto  texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
-            acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
-        if (texcoord.x < 0) texcoord.x += 1;
-        auto i = clamp(
-            (int)(texcoord.x * emission_tex.width), 0, emission_tex.width - 1);
-        auto j    = clamp((int)(texcoord.y * emission_tex.height), 0,
-            emission_tex.height - 1);
-        auto prob = sample_discrete_pdf(
-                        light.elements_cdf, j * emission_tex.width + i) /
-                    light.elements_cdf.back();
-        auto angle = (2 * pif / emission_tex.width) *
-                     (pif / emission_tex.height) *
-                     sin(pif * (j + 0.5f) / emission_tex.height);
-        pdf += prob / angle;
+  if (!lights.leaves.empty()) {
+    auto pdf = 0.0f;
+    for (auto light_id : lights.environments) {
+      pdf += sample_light_pdf(
+                 scene, bvh, lights.lights[light_id], position, direction) *
+             sample_light_bvh_pdf(lights, light_id, position);
+    }
+    if (lights.nodes.empty()) return pdf;
+    auto ray        = ray3f{position, direction};
+    auto stack      = array<int, 128>{};
+    auto stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+      auto& node = lights.nodes[stack[--stack_size]];
+      if (!intersect_bbox(ray, node.bbox)) continue;
+      if (node.child >= 0) {
+        stack[stack_size++] = node.child;
+        stack[stack_size++] = node.child + 1;
       } else {
-        pdf += 1 / (4 * pif);
+        pdf += sample_light_pdf(scene, bvh, lights.lights[node.light],
+                   position, direction) *
+               sample_light_bvh_pdf(lights, node.light, position);
       }
     }
+    return pdf;
+  }
+  auto pdf = 0.0f;
+  for (auto& light : lights.lights) {
+    pdf += sample_light_pdf(scene, bvh, light, position, direction);
   }
   pdf *= sample_uniform_pdf((int)lights.lights.size());
   return pdf;
@@ -1074,18 +2094,54 @@ trace_state make_state(const Scene& scene, const trace_params& params) {
   state.albedo.assign(state.width * state.height, {0, 0, 0});
   state.normal.assign(state.width * state.height, {0, 0, 0});
   state.hits.assign(state.width * state.height, 0);
-  state.rngs.assign(state.width * state.height, {});
-  auto rng_ = make_rng(1301081);
-  for (auto& rng : state.rngs) {
-    rng = make_rng(params.seed, rand1i(rng_, 1 << 31) / 2 + 1);
+  if (params.targeterror > 0) {
+    state.pixel_samples.assign(state.width * state.height, 0);
+    state.halfimage.assign(state.width * state.height, {0, 0, 0, 0});
+    state.converged.assign(state.width * state.height, 0);
   }
   return state;
 }
 
+// Ray cone used to pick texture mip levels, with its `width` at the ray origin
+// and its `spread` angle.
+struct ray_cone {
+  float width  = 0;
+  float spread = 0;
+};
+
+// Cone of the camera rays through a pixel.
+inline ray_cone make_ray_cone(
+    const camera_data& camera, const trace_params& params) {
+  auto pixel = camera.film / (camera.lens * params.resolution);
+  return camera.orthographic ? ray_cone{pixel, 0} : ray_cone{0, pixel};
+}
+
+// Widens a ray cone after scattering off a surface. Surface curvature is
+// ignored, so delta materials keep the cone, while other materials widen it to
+// the width of their lobe.
+inline void scatter_ray_cone(ray_cone& cone, const material_point& material) {
+  if (is_delta(material)) return;
+  auto lobe = material.type == material_type::matte ? 1.0f : material.roughness;
+  cone.spread = max(cone.spread, lobe);
+}
+
+// Evaluates the material at a hit, filtering textures with the footprint of a
+// ray cone that reached the hit, if mipmaps are enabled.
+template <typename Scene>
+material_point eval_material(const Scene& scene, const bvh_scene& bvh,
+    const bvh_intersection& intersection, const vec3f& direction,
+    const ray_cone& cone, const trace_params& params) {
+  if (!params.mipmaps) return eval_material(scene, bvh, intersection);
+  auto footprint = eval_texture_footprint(
+      scene, intersection, direction, cone.width);
+  return eval_material(scene, bvh, intersection, footprint, params.trilinear);
+}
+
+// Path tracing. If given, `primary` is used as the first intersection.
 template <typename Scene>
 trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
-    const trace_lights& lights, const ray3f& ray_, rng_state& rng,
-    const trace_params& params) {
+    const trace_lights& lights, const ray3f& ray_, sample_rng& rng,
+    const trace_params& params, const bvh_intersection* primary = nullptr) {
   // initialize
   auto radiance      = vec3f{0, 0, 0};
   auto weight        = vec3f{1, 1, 1};
@@ -1096,11 +2152,15 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
   auto hit_albedo    = vec3f{0, 0, 0};
   auto hit_normal    = vec3f{0, 0, 0};
   auto opbounce      = 0;
+  auto cone          = make_ray_cone(scene.cameras(params.camera), params);
 
   // trace  path
   for (auto bounce = 0; bounce < params.bounces; bounce++) {
+    start_vertex(rng, bounce + opbounce);
+
     // intersect next point
-    auto intersection = intersect_scene(bvh, scene, ray);
+    auto intersection = primary ? *primary : intersect_scene(bvh, scene, ray);
+    primary           = nullptr;
     if (!intersection.hit) {
       if (bounce > 0 || !params.envhidden)
         radiance += weight * eval_environment(scene, ray.d);
@@ -1110,6 +2170,7 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
     // handle transmission if inside a volume
     auto in_volume = false;
     if (!volume_stack.empty()) {
+      start_decision(rng, sequence_decision::transmittance);
       auto& vsdf     = volume_stack.back();
       auto  distance = sample_transmittance(
           vsdf.density, intersection.distance, rand1f(rng), rand1f(rng));
@@ -1119,6 +2180,7 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
       in_volume             = distance < intersection.distance;
       intersection.distance = distance;
     }
+    cone.width += cone.spread * intersection.distance;
 
     // switch between surface and volume
     if (!in_volume) {
@@ -1126,7 +2188,8 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
       auto outgoing = -ray.d;
       auto position = eval_shading_position(scene, intersection, outgoing);
       auto normal   = eval_shading_normal(scene, intersection, outgoing);
-      auto material = eval_material(scene, intersection);
+      auto material = eval_material(
+          scene, bvh, intersection, ray.d, cone, params);
 
       // correct roughness
       if (params.nocaustics) {
@@ -1135,6 +2198,7 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
       }
 
       // handle opacity
+      start_decision(rng, sequence_decision::opacity);
       if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
         if (opbounce++ > 128) break;
         ray = {position + ray.d * 1e-2f, ray.d};
@@ -1155,10 +2219,13 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
       // next direction
       auto incoming = vec3f{0, 0, 0};
       if (!is_delta(material)) {
+        start_decision(rng, sequence_decision::lobe);
         if (rand1f(rng) < 0.5f) {
+          start_decision(rng, sequence_decision::direction);
           incoming = sample_bsdfcos(
               material, normal, outgoing, rand1f(rng), rand2f(rng));
         } else {
+          start_decision(rng, sequence_decision::light);
           incoming = sample_lights(
               scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
         }
@@ -1169,6 +2236,7 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
                 0.5f *
                     sample_lights_pdf(scene, bvh, lights, position, incoming));
       } else {
+        start_decision(rng, sequence_decision::direction);
         incoming = sample_delta(material, normal, outgoing, rand1f(rng));
         weight *= eval_delta(material, normal, outgoing, incoming) /
                   sample_delta_pdf(material, normal, outgoing, incoming);
@@ -1178,7 +2246,7 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
       if (is_volumetric(scene, intersection) &&
           dot(normal, outgoing) * dot(normal, incoming) < 0) {
         if (volume_stack.empty()) {
-          auto material = eval_material(scene, intersection);
+          auto material = eval_material(scene, bvh, intersection);
           volume_stack.push_back(material);
         } else {
           volume_stack.pop_back();
@@ -1187,6 +2255,7 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
 
       // setup next iteration
       ray = {position, incoming};
+      scatter_ray_cone(cone, material);
     } else {
       // prepare shading point
       auto  outgoing = -ray.d;
@@ -1198,9 +2267,12 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
 
       // next direction
       auto incoming = vec3f{0, 0, 0};
+      start_decision(rng, sequence_decision::lobe);
       if (rand1f(rng) < 0.5f) {
+        start_decision(rng, sequence_decision::direction);
         incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
       } else {
+        start_decision(rng, sequence_decision::light);
         incoming = sample_lights(
             scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
       }
@@ -1220,6 +2292,7 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
     // russian roulette
     if (bounce > 3) {
       auto rr_prob = min((float)0.99, max(weight));
+      start_decision(rng, sequence_decision::roulette);
       if (rand1f(rng) >= rr_prob) break;
       weight *= 1 / rr_prob;
     }
@@ -1228,18 +2301,182 @@ trace_result trace_path(const Scene& scene, const bvh_scene& bvh,
   return {radiance, hit, hit_albedo, hit_normal};
 }
 
+// Eyelight for quick previewing.
 template <typename Scene>
-void trace_sample(trace_state& state, const Scene& scene, const bvh_scene& bvh,
-    const trace_lights& lights, int i, int j, const trace_params& params) {
-  auto& camera = scene.cameras(params.camera);
-  // auto  sampler = get_trace_sampler_func(params);
-  auto idx = state.width * j + i;
-  auto ray = sample_camera(camera, {i, j}, {state.width, state.height},
-      rand2f(state.rngs[idx]), rand2f(state.rngs[idx]), params.tentfilter);
-  // auto [radiance, hit, albedo, normal] = sampler(
-  // scene, bvh, lights, ray, state.rngs[idx], params);
-  auto [radiance, hit, albedo, normal] = trace_path(
-      scene, bvh, lights, ray, state.rngs[idx], params);
+trace_result trace_eyelight(const Scene& scene, const bvh_scene& bvh,
+    const trace_lights& lights, const ray3f& ray_, sample_rng& rng,
+    const trace_params& params, const bvh_intersection* primary = nullptr) {
+  // initialize
+  auto radiance   = vec3f{0, 0, 0};
+  auto weight     = vec3f{1, 1, 1};
+  auto ray        = ray_;
+  auto hit        = false;
+  auto hit_albedo = vec3f{0, 0, 0};
+  auto hit_normal = vec3f{0, 0, 0};
+  auto opbounce   = 0;
+  auto cone       = make_ray_cone(scene.cameras(params.camera), params);
+
+  // trace  path
+  for (auto bounce = 0; bounce < max(params.bounces, 4); bounce++) {
+    start_vertex(rng, bounce + opbounce);
+
+    // intersect next point
+    auto intersection = primary ? *primary : intersect_scene(bvh, scene, ray);
+    primary           = nullptr;
+    if (!intersection.hit) {
+      if (bounce > 0 || !params.envhidden)
+        radiance += weight * eval_environment(scene, ray.d);
+      break;
+    }
+
+    // prepare shading point
+    cone.width += cone.spread * intersection.distance;
+    auto outgoing = -ray.d;
+    auto position = eval_shading_position(scene, intersection, outgoing);
+    auto normal   = eval_shading_normal(scene, intersection, outgoing);
+    auto material = eval_material(
+        scene, bvh, intersection, ray.d, cone, params);
+
+    // handle opacity
+    start_decision(rng, sequence_decision::opacity);
+    if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
+      if (opbounce++ > 128) break;
+      ray = {position + ray.d * 1e-2f, ray.d};
+      bounce -= 1;
+      continue;
+    }
+
+    // set hit variables
+    if (bounce == 0) {
+      hit        = true;
+      hit_albedo = material.color;
+      hit_normal = normal;
+    }
+
+    // accumulate emission
+    auto incoming = outgoing;
+    radiance += weight * eval_emission(material, normal, outgoing);
+
+    // brdf * light
+    radiance += weight * pif *
+                eval_bsdfcos(material, normal, outgoing, incoming);
+
+    // continue path
+    if (!is_delta(material)) break;
+    start_decision(rng, sequence_decision::direction);
+    incoming = sample_delta(material, normal, outgoing, rand1f(rng));
+    if (incoming == vec3f{0, 0, 0}) break;
+    weight *= eval_delta(material, normal, outgoing, incoming) /
+              sample_delta_pdf(material, normal, outgoing, incoming);
+    if (weight == vec3f{0, 0, 0} || !isfinite(weight)) break;
+
+    // setup next iteration
+    ray = {position, incoming};
+  }
+
+  return {radiance, hit, hit_albedo, hit_normal};
+}
+
+// Eyelight with ambient occlusion for quick previewing.
+template <typename Scene>
+trace_result trace_eyelightao(const Scene& scene, const bvh_scene& bvh,
+    const trace_lights& lights, const ray3f& ray_, sample_rng& rng,
+    const trace_params& params, const bvh_intersection* primary = nullptr) {
+  // initialize
+  auto radiance   = vec3f{0, 0, 0};
+  auto weight     = vec3f{1, 1, 1};
+  auto ray        = ray_;
+  auto hit        = false;
+  auto hit_albedo = vec3f{0, 0, 0};
+  auto hit_normal = vec3f{0, 0, 0};
+  auto opbounce   = 0;
+  auto cone       = make_ray_cone(scene.cameras(params.camera), params);
+
+  // trace  path
+  for (auto bounce = 0; bounce < max(params.bounces, 4); bounce++) {
+    start_vertex(rng, bounce + opbounce);
+
+    // intersect next point
+    auto intersection = primary ? *primary : intersect_scene(bvh, scene, ray);
+    primary           = nullptr;
+    if (!intersection.hit) {
+      if (bounce > 0 || !params.envhidden)
+        radiance += weight * eval_environment(scene, ray.d);
+      break;
+    }
+
+    // prepare shading point
+    cone.width += cone.spread * intersection.distance;
+    auto outgoing = -ray.d;
+    auto position = eval_shading_position(scene, intersection, outgoing);
+    auto normal   = eval_shading_normal(scene, intersection, outgoing);
+    auto material = eval_material(
+        scene, bvh, intersection, ray.d, cone, params);
+
+    // handle opacity
+    start_decision(rng, sequence_decision::opacity);
+    if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
+      if (opbounce++ > 128) break;
+      ray = {position + ray.d * 1e-2f, ray.d};
+      bounce -= 1;
+      continue;
+    }
+
+    // set hit variables
+    if (bounce == 0) {
+      hit        = true;
+      hit_albedo = material.color;
+      hit_normal = normal;
+    }
+
+    // accumulate emission
+    auto incoming = outgoing;
+    radiance += weight * eval_emission(material, normal, outgoing);
+
+    // occlusion
+    start_decision(rng, sequence_decision::light);
+    auto occluding = sample_hemisphere_cos(normal, rand2f(rng));
+    if (intersect_scene<true>(bvh, scene, {position, occluding}).hit) break;
+
+    // brdf * light
+    radiance += weight * pif *
+                eval_bsdfcos(material, normal, outgoing, incoming);
+
+    // continue path
+    if (!is_delta(material)) break;
+    start_decision(rng, sequence_decision::direction);
+    incoming = sample_delta(material, normal, outgoing, rand1f(rng));
+    if (incoming == vec3f{0, 0, 0}) break;
+    weight *= eval_delta(material, normal, outgoing, incoming) /
+              sample_delta_pdf(material, normal, outgoing, incoming);
+    if (weight == vec3f{0, 0, 0} || !isfinite(weight)) break;
+
+    // setup next iteration
+    ray = {position, incoming};
+  }
+
+  return {radiance, hit, hit_albedo, hit_normal};
+}
+
+// Dispatch to the sampler selected in params.
+template <typename Scene>
+trace_result trace_sampler(const Scene& scene, const bvh_scene& bvh,
+    const trace_lights& lights, const ray3f& ray, sample_rng& rng,
+    const trace_params& params, const bvh_intersection* primary = nullptr) {
+  switch (params.sampler) {
+    case trace_sampler_type::eyelight:
+      return trace_eyelight(scene, bvh, lights, ray, rng, params, primary);
+    case trace_sampler_type::eyelightao:
+      return trace_eyelightao(scene, bvh, lights, ray, rng, params, primary);
+    default: return trace_path(scene, bvh, lights, ray, rng, params, primary);
+  }
+}
+
+// Accumulate a sample in the pixel `idx`.
+template <typename Scene>
+void accumulate_sample(trace_state& state, const Scene& scene, int idx,
+    const ray3f& ray, const trace_result& result, const trace_params& params) {
+  auto [radiance, hit, albedo, normal] = result;
   if (!isfinite(radiance)) radiance = {0, 0, 0};
   if (max(radiance) > params.clamp)
     radiance = radiance * (params.clamp / max(radiance));
@@ -1253,22 +2490,857 @@ void trace_sample(trace_state& state, const Scene& scene, const bvh_scene& bvh,
     state.albedo[idx] += {1, 1, 1};
     state.normal[idx] += -ray.d;
     state.hits[idx] += 1;
+  } else {
+    radiance = {0, 0, 0};
+  }
+  if (!state.pixel_samples.empty()) {
+    if (state.pixel_samples[idx] % 2 == 1) {
+      state.halfimage[idx] += {radiance.x, radiance.y, radiance.z, 1};
+    }
+    state.pixel_samples[idx] += 1;
+  }
+}
+
+// Hash used to derive sample generators, from splitmix64.
+inline uint64_t hash_sample(uint64_t key) {
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ull;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebull;
+  key ^= key >> 31;
+  return key;
+}
+
+// Random number generator for the sample `sample` of the pixel `pixel`. The
+// generator is derived by hashing the seed, pixel and sample, so that samples
+// are computed independently of each other and of the order they are traced
+// in. Successive draws are the dimensions of the sample.
+inline rng_state make_sample_rng(uint64_t seed, int pixel, int sample) {
+  auto key = hash_sample(
+      seed ^ hash_sample(((uint64_t)pixel << 32) | (uint32_t)sample));
+  return make_rng(key, hash_sample(key) >> 1);
+}
+
+// Random numbers of the sample `sample` of a pixel, from the sequence selected
+// in params. Sobol points are scrambled with a seed for each pixel, while blue
+// noise dithered points share the seed of the render. The sample index is
+// given by the caller, since the sample counts of the state advance only after
+// a batch of samples.
+inline sample_rng make_sample_rng(const trace_state& state, int pixel,
+    int sample, const trace_params& params) {
+  auto rng     = sample_rng{};
+  rng.sequence = params.sequence;
+  rng.index    = (uint32_t)sample;
+  rng.i        = pixel % state.width;
+  rng.j        = pixel / state.width;
+  if (params.sequence == trace_sequence_type::independent) {
+    rng.rng = make_sample_rng(params.seed, pixel, sample);
+  } else if (params.sequence == trace_sequence_type::sobol) {
+    rng.seed = (uint32_t)hash_sample(params.seed ^ hash_sample(pixel));
+  } else {
+    rng.seed = (uint32_t)hash_sample(params.seed);
+  }
+  return rng;
+}
+
+// Trace the sample `sample` of the pixel `i, j`.
+template <typename Scene>
+void trace_sample(trace_state& state, const Scene& scene, const bvh_scene& bvh,
+    const trace_lights& lights, int i, int j, int sample,
+    const trace_params& params) {
+  auto& camera = scene.cameras(params.camera);
+  auto  idx    = state.width * j + i;
+  auto  rng    = make_sample_rng(state, idx, sample, params);
+  auto  ray    = sample_camera(camera, {i, j}, {state.width, state.height},
+      rand2f(rng), rand2f(rng), params.tentfilter);
+  auto  result = trace_sampler(scene, bvh, lights, ray, rng, params);
+  accumulate_sample(state, scene, idx, ray, result, params);
+}
+
+// Size of the pixel tiles traced as ray packets.
+const auto trace_tile_size = 4;
+
+// Trace the sample `sample` for each pixel in the tile `tile_i, tile_j`. Camera
+// rays are intersected as a single packet, while the rest of the path is traced
+// per ray.
+template <typename Scene>
+void trace_tile(trace_state& state, const Scene& scene, const bvh_scene& bvh,
+    const trace_lights& lights, int tile_i, int tile_j, int sample,
+    const trace_params& params) {
+  constexpr auto size   = (size_t)(trace_tile_size * trace_tile_size);
+  auto&          camera = scene.cameras(params.camera);
+  auto           rays   = array<ray3f, size>{};
+  auto           rngs   = array<sample_rng, size>{};
+  auto           mask   = 0u;
+  for (auto k = 0; k < (int)size; k++) {
+    auto i = tile_i * trace_tile_size + k % trace_tile_size;
+    auto j = tile_j * trace_tile_size + k / trace_tile_size;
+    if (i >= state.width || j >= state.height) continue;
+    auto idx = state.width * j + i;
+    rngs[k]  = make_sample_rng(state, idx, sample, params);
+    rays[k]  = sample_camera(camera, {i, j}, {state.width, state.height},
+        rand2f(rngs[k]), rand2f(rngs[k]), params.tentfilter);
+    mask |= 1u << k;
+  }
+  auto intersections = array<bvh_intersection, size>{};
+  intersect_scene_packet(bvh, scene, rays, mask, intersections);
+  for (auto k = 0; k < (int)size; k++) {
+    if (!(mask & (1u << k))) continue;
+    auto i      = tile_i * trace_tile_size + k % trace_tile_size;
+    auto j      = tile_j * trace_tile_size + k / trace_tile_size;
+    auto idx    = state.width * j + i;
+    auto result = trace_sampler(
+        scene, bvh, lights, rays[k], rngs[k], params, &intersections[k]);
+    accumulate_sample(state, scene, idx, rays[k], result, params);
+  }
+}
+
+// Number of paths traced together by the wavefront integrator.
+const auto wavefront_size = 65536;
+
+// Events found when extending a path.
+enum struct wavefront_event : uint8_t { escaped, surface, volume };
+
+// Paths traced in stages by the wavefront integrator, stored as arrays indexed
+// by path. Queues hold the paths processed by each stage. The volume stack of
+// `trace_path` holds at most one volume, so it is stored as a flag and a
+// material.
+struct wavefront_paths {
+  // paths
+  vector<int>              pixels        = {};
+  vector<sample_rng>       rngs          = {};
+  vector<ray3f>            cameras       = {};
+  vector<ray3f>            rays          = {};
+  vector<bvh_intersection> intersections = {};
+  vector<wavefront_event>  events        = {};
+  vector<trace_result>     results       = {};
+  vector<vec3f>            weights       = {};
+  vector<int>              bounces       = {};
+  vector<int>              opbounces     = {};
+  vector<float>            roughness     = {};
+  vector<uint8_t>          inside        = {};
+  vector<material_point>   volumes       = {};
+  vector<ray_cone>         cones         = {};
+  vector<uint8_t>          alive         = {};
+  vector<uint64_t>         keys          = {};
+
+  // paths sorted by key
+  vector<pair<uint64_t, int>> sorted = {};
+
+  // queues
+  vector<int> active   = {};
+  vector<int> escaped  = {};
+  vector<int> surfaces = {};
+  vector<int> media    = {};
+};
+
+// Run `func` on all paths in a queue.
+template <typename Func>
+inline void parallel_for_queue(
+    const vector<int>& queue, bool noparallel, Func&& func) {
+  if (noparallel) {
+    for (auto path : queue) func(path);
+  } else {
+    parallel_for_batch(
+        (int)queue.size(), 256, [&](int idx) { func(queue[idx]); });
+  }
+}
+
+// Start paths for the sample `sample` of the pixels in `[start, start + count)`
+// from camera rays.
+template <typename Scene>
+void init_paths(wavefront_paths& paths, trace_state& state, const Scene& scene,
+    int start, int count, int sample, const trace_params& params) {
+  paths.pixels.resize(count);
+  paths.rngs.resize(count);
+  paths.cameras.resize(count);
+  paths.rays.resize(count);
+  paths.intersections.resize(count);
+  paths.events.resize(count);
+  paths.results.assign(count, {});
+  paths.weights.assign(count, {1, 1, 1});
+  paths.bounces.assign(count, 0);
+  paths.opbounces.assign(count, 0);
+  paths.roughness.assign(count, 0);
+  paths.inside.assign(count, 0);
+  paths.volumes.resize(count);
+  paths.cones.assign(
+      count, make_ray_cone(scene.cameras(params.camera), params));
+  paths.alive.assign(count, 0);
+  paths.keys.resize(count);
+  paths.active.resize(count);
+  auto& camera = scene.cameras(params.camera);
+  for (auto path = 0; path < count; path++) {
+    auto idx            = start + path;
+    auto i              = idx % state.width;
+    auto j              = idx / state.width;
+    auto& rng           = paths.rngs[path];
+    paths.pixels[path]  = idx;
+    rng                 = make_sample_rng(state, idx, sample, params);
+    paths.cameras[path] = sample_camera(camera, {i, j},
+        {state.width, state.height}, rand2f(rng), rand2f(rng),
+        params.tentfilter);
+    paths.rays[path]    = paths.cameras[path];
+    paths.active[path]  = path;
+  }
+}
+
+// Elements grouped in the same block when sorting paths.
+const auto wavefront_element_block = 64;
+
+// Key used to sort surface hits by material, shape and element block.
+template <typename Scene>
+inline uint64_t shading_key(
+    const Scene& scene, const bvh_intersection& intersection) {
+  auto& instance = scene.instances(intersection.instance);
+  auto  block    = intersection.element / wavefront_element_block;
+  return ((uint64_t)min(instance.material, 0xffffff) << 40) |
+         ((uint64_t)min(instance.shape, 0xfffff) << 20) |
+         (uint64_t)min(block, 0xfffff);
+}
+
+// Extend stage. Intersects active paths, samples the distance travelled
+// inside volumes, then sorts paths into escaped, surface and volume queues.
+// If `sortpaths` is set, the surface queue is sorted by shading key, so that
+// shading reads materials, textures and vertices in contiguous runs.
+template <typename Scene>
+void extend_paths(wavefront_paths& paths, const Scene& scene,
+    const bvh_scene& bvh, const trace_params& params) {
+  parallel_for_queue(paths.active, params.noparallel, [&](int path) {
+    auto& intersection = paths.intersections[path];
+    auto& rng          = paths.rngs[path];
+    start_vertex(rng, paths.bounces[path] + paths.opbounces[path]);
+    intersection = intersect_scene(bvh, scene, paths.rays[path]);
+    if (!intersection.hit) {
+      paths.events[path] = wavefront_event::escaped;
+      return;
+    }
+    auto in_volume = false;
+    if (paths.inside[path]) {
+      start_decision(rng, sequence_decision::transmittance);
+      auto& vsdf     = paths.volumes[path];
+      auto  distance = sample_transmittance(
+          vsdf.density, intersection.distance, rand1f(rng), rand1f(rng));
+      paths.weights[path] *= eval_transmittance(vsdf.density, distance) /
+                             sample_transmittance_pdf(vsdf.density, distance,
+                                 intersection.distance);
+      in_volume             = distance < intersection.distance;
+      intersection.distance = distance;
+    }
+    paths.cones[path].width += paths.cones[path].spread * intersection.distance;
+    paths.events[path] = in_volume ? wavefront_event::volume
+                                   : wavefront_event::surface;
+    if (params.sortpaths && !in_volume) {
+      paths.keys[path] = shading_key(scene, intersection);
+    }
+  });
+
+  // build queues
+  paths.escaped.clear();
+  paths.surfaces.clear();
+  paths.media.clear();
+  for (auto path : paths.active) {
+    switch (paths.events[path]) {
+      case wavefront_event::escaped: paths.escaped.push_back(path); break;
+      case wavefront_event::surface: paths.surfaces.push_back(path); break;
+      case wavefront_event::volume: paths.media.push_back(path); break;
+    }
+  }
+
+  // sort surface hits
+  if (params.sortpaths) {
+    auto& sorted = paths.sorted;
+    sorted.resize(paths.surfaces.size());
+    for (auto idx = 0; idx < (int)sorted.size(); idx++) {
+      auto path   = paths.surfaces[idx];
+      sorted[idx] = {paths.keys[path], path};
+    }
+    std::sort(sorted.begin(), sorted.end());
+    for (auto idx = 0; idx < (int)sorted.size(); idx++) {
+      paths.surfaces[idx] = sorted[idx].second;
+    }
+  }
+}
+
+// Shade stage for paths leaving the scene.
+template <typename Scene>
+void shade_escaped(
+    wavefront_paths& paths, const Scene& scene, const trace_params& params) {
+  parallel_for_queue(paths.escaped, params.noparallel, [&](int path) {
+    auto& ray = paths.rays[path];
+    if (paths.bounces[path] > 0 || !params.envhidden) {
+      paths.results[path].radiance += paths.weights[path] *
+                                      eval_environment(scene, ray.d);
+    }
+    paths.alive[path] = 0;
+  });
+}
+
+// Check the path weight, apply russian roulette and advance the bounce.
+// Returns whether the path continues.
+inline bool continue_path(
+    wavefront_paths& paths, int path, sample_rng& rng, int bounces) {
+  auto& weight = paths.weights[path];
+  auto& bounce = paths.bounces[path];
+  if (weight == vec3f{0, 0, 0} || !isfinite(weight)) return false;
+  if (bounce > 3) {
+    auto rr_prob = min((float)0.99, max(weight));
+    start_decision(rng, sequence_decision::roulette);
+    if (rand1f(rng) >= rr_prob) return false;
+    weight *= 1 / rr_prob;
+  }
+  return ++bounce < bounces;
+}
+
+// Shading point of a path that hit a surface, kept between sampling the next
+// direction and evaluating the path weight.
+struct wavefront_shading {
+  vec3f          position = {0, 0, 0};
+  vec3f          normal   = {0, 0, 0};
+  vec3f          outgoing = {0, 0, 0};
+  vec3f          incoming = {0, 0, 0};
+  material_point material = {};
+};
+
+// Last part of the surface shade stage, as in `trace_path`. Updates the
+// volume stack and starts the next bounce.
+template <typename Scene>
+inline void continue_surface(wavefront_paths& paths, int path,
+    const wavefront_shading& shading, sample_rng& rng, const Scene& scene,
+    const bvh_scene& bvh, const trace_params& params) {
+  auto& intersection = paths.intersections[path];
+  auto& [position, normal, outgoing, incoming, material] = shading;
+
+  // update volume stack
+  if (is_volumetric(scene, intersection) &&
+      dot(normal, outgoing) * dot(normal, incoming) < 0) {
+    if (!paths.inside[path]) {
+      paths.volumes[path] = eval_material(scene, bvh, intersection);
+      paths.inside[path]  = 1;
+    } else {
+      paths.inside[path] = 0;
+    }
+  }
+
+  // setup next iteration
+  paths.rays[path]  = {position, incoming};
+  paths.alive[path] = continue_path(paths, path, rng, params.bounces);
+  scatter_ray_cone(paths.cones[path], material);
+}
+
+// First part of the surface shade stage, as in `trace_path`. Accumulates
+// emission and samples the next direction. Returns true if the path weight
+// still needs the BRDF and its pdf, as for non-delta materials. Paths that
+// pass through the surface or hit a delta material are handled here.
+template <typename Scene>
+inline bool sample_surface(wavefront_paths& paths, int path,
+    wavefront_shading& shading, sample_rng& rng, const Scene& scene,
+    const bvh_scene& bvh, const trace_lights& lights,
+    const trace_params& params) {
+  auto& intersection = paths.intersections[path];
+  auto& ray          = paths.rays[path];
+  auto& weight       = paths.weights[path];
+  auto& result       = paths.results[path];
+  paths.alive[path]  = 0;
+
+  // prepare shading point
+  auto& [position, normal, outgoing, incoming, material] = shading;
+  outgoing = -ray.d;
+  position = eval_shading_position(scene, intersection, outgoing);
+  normal   = eval_shading_normal(scene, intersection, outgoing);
+  material = eval_material(
+      scene, bvh, intersection, ray.d, paths.cones[path], params);
+
+  // correct roughness
+  if (params.nocaustics) {
+    paths.roughness[path] = max(material.roughness, paths.roughness[path]);
+    material.roughness    = paths.roughness[path];
+  }
+
+  // handle opacity
+  start_decision(rng, sequence_decision::opacity);
+  if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
+    if (paths.opbounces[path]++ > 128) return false;
+    ray               = {position + ray.d * 1e-2f, ray.d};
+    paths.alive[path] = 1;
+    return false;
+  }
+
+  // set hit variables
+  if (paths.bounces[path] == 0) {
+    result.hit    = true;
+    result.albedo = material.color;
+    result.normal = normal;
+  }
+
+  // accumulate emission
+  result.radiance += weight * eval_emission(material, normal, outgoing);
+
+  // next direction
+  if (!is_delta(material)) {
+    start_decision(rng, sequence_decision::lobe);
+    if (rand1f(rng) < 0.5f) {
+      start_decision(rng, sequence_decision::direction);
+      incoming = sample_bsdfcos(
+          material, normal, outgoing, rand1f(rng), rand2f(rng));
+    } else {
+      start_decision(rng, sequence_decision::light);
+      incoming = sample_lights(
+          scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+    }
+    return incoming != vec3f{0, 0, 0};
+  } else {
+    start_decision(rng, sequence_decision::direction);
+    incoming = sample_delta(material, normal, outgoing, rand1f(rng));
+    if (incoming == vec3f{0, 0, 0}) return false;
+    weight *= eval_delta(material, normal, outgoing, incoming) /
+              sample_delta_pdf(material, normal, outgoing, incoming);
+    continue_surface(paths, path, shading, rng, scene, bvh, params);
+    return false;
+  }
+}
+
+// Shade stage for paths that hit a surface, as in `trace_path`.
+template <typename Scene>
+void shade_surfaces(wavefront_paths& paths, const Scene& scene,
+    const bvh_scene& bvh, const trace_lights& lights,
+    const trace_params& params) {
+  parallel_for_queue(paths.surfaces, params.noparallel, [&](int path) {
+    auto& rng     = paths.rngs[path];
+    auto  shading = wavefront_shading{};
+    auto  sampled = sample_surface(
+        paths, path, shading, rng, scene, bvh, lights, params);
+    if (!sampled) return;
+    auto& [position, normal, outgoing, incoming, material] = shading;
+    paths.weights[path] *=
+        eval_bsdfcos(material, normal, outgoing, incoming) /
+        (0.5f * sample_bsdfcos_pdf(material, normal, outgoing, incoming) +
+            0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming));
+    continue_surface(paths, path, shading, rng, scene, bvh, params);
+  });
+}
+
+// Shade stage for paths that hit a surface, with the BRDFs of rough matte,
+// glossy, reflective and gltfpbr materials evaluated in batches of
+// `shading_lanes` paths by the kernels in `shading.h`. Other materials fall
+// back to the scalar functions. Paths draw the same random numbers as in
+// `shade_surfaces`, and weights match up to float rounding.
+template <typename Scene>
+void shade_surfaces_batched(wavefront_paths& paths, const Scene& scene,
+    const bvh_scene& bvh, const trace_lights& lights,
+    const trace_params& params) {
+  auto& queue       = paths.surfaces;
+  auto  num_lanes   = (int)queue.size();
+  auto  shade_batch = [&](int batch_idx) {
+    auto start    = batch_idx * shading_lanes;
+    auto count    = min(shading_lanes, num_lanes - start);
+    auto shadings = array<wavefront_shading, shading_lanes>{};
+    auto sampled  = array<bool, shading_lanes>{};
+    auto batch    = shading_batch{};
+    for (auto lane = 0; lane < count; lane++) {
+      auto  path    = queue[start + lane];
+      auto& rng     = paths.rngs[path];
+      auto& shading = shadings[lane];
+      sampled[lane] = sample_surface(
+          paths, path, shading, rng, scene, bvh, lights, params);
+      if (!sampled[lane] || !is_batched(shading.material)) continue;
+      set_lane(batch, lane, shading.material, shading.normal,
+          shading.outgoing, shading.incoming);
+    }
+    auto bsdfcos = vec3f_lanes{};
+    auto pdf     = float_lanes{};
+    eval_bsdfcos_lanes(batch, bsdfcos, pdf);
+    for (auto lane = 0; lane < count; lane++) {
+      if (!sampled[lane]) continue;
+      auto  path    = queue[start + lane];
+      auto& rng     = paths.rngs[path];
+      auto& shading = shadings[lane];
+      auto& [position, normal, outgoing, incoming, material] = shading;
+      auto lane_bsdfcos = get_lane(bsdfcos, lane);
+      auto lane_pdf     = pdf[lane];
+      if (!is_batched(material)) {
+        lane_bsdfcos = eval_bsdfcos(material, normal, outgoing, incoming);
+        lane_pdf = sample_bsdfcos_pdf(material, normal, outgoing, incoming);
+      }
+      paths.weights[path] *=
+          lane_bsdfcos /
+          (0.5f * lane_pdf +
+              0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming));
+      continue_surface(paths, path, shading, rng, scene, bvh, params);
+    }
+  };
+  auto num_batches = (num_lanes + shading_lanes - 1) / shading_lanes;
+  if (params.noparallel) {
+    for (auto batch_idx = 0; batch_idx < num_batches; batch_idx++)
+      shade_batch(batch_idx);
+  } else {
+    parallel_for_batch(num_batches, 32, shade_batch);
+  }
+}
+
+// Shade stage for paths scattered inside a volume, as in `trace_path`.
+template <typename Scene>
+void shade_media(wavefront_paths& paths, const Scene& scene,
+    const bvh_scene& bvh, const trace_lights& lights,
+    const trace_params& params) {
+  parallel_for_queue(paths.media, params.noparallel, [&](int path) {
+    auto& intersection = paths.intersections[path];
+    auto& ray          = paths.rays[path];
+    auto& weight       = paths.weights[path];
+    auto& vsdf         = paths.volumes[path];
+    auto& rng          = paths.rngs[path];
+    paths.alive[path]  = 0;
+
+    // prepare shading point
+    auto outgoing = -ray.d;
+    auto position = ray.o + ray.d * intersection.distance;
+
+    // next direction
+    auto incoming = vec3f{0, 0, 0};
+    start_decision(rng, sequence_decision::lobe);
+    if (rand1f(rng) < 0.5f) {
+      start_decision(rng, sequence_decision::direction);
+      incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
+    } else {
+      start_decision(rng, sequence_decision::light);
+      incoming = sample_lights(
+          scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+    }
+    if (incoming == vec3f{0, 0, 0}) return;
+    weight *=
+        eval_scattering(vsdf, outgoing, incoming) /
+        (0.5f * sample_scattering_pdf(vsdf, outgoing, incoming) +
+            0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming));
+
+    // setup next iteration
+    ray               = {position, incoming};
+    paths.alive[path] = continue_path(paths, path, rng, params.bounces);
+  });
+}
+
+// Keep the paths that continue as the next active queue.
+inline void compact_paths(wavefront_paths& paths) {
+  paths.active.clear();
+  for (auto path : paths.surfaces) {
+    if (paths.alive[path]) paths.active.push_back(path);
+  }
+  for (auto path : paths.media) {
+    if (paths.alive[path]) paths.active.push_back(path);
   }
 }
 
+// Accumulate stage. Adds the finished paths to their pixels.
+template <typename Scene>
+void accumulate_paths(wavefront_paths& paths, trace_state& state,
+    const Scene& scene, const trace_params& params) {
+  auto count = (int)paths.pixels.size();
+  auto accumulate = [&](int path) {
+    accumulate_sample(state, scene, paths.pixels[path], paths.cameras[path],
+        paths.results[path], params);
+  };
+  if (params.noparallel) {
+    for (auto path = 0; path < count; path++) accumulate(path);
+  } else {
+    parallel_for_batch(count, 256, accumulate);
+  }
+}
+
+// Trace the sample `sample` for each pixel with the wavefront integrator.
+// Pixels are traced in batches of paths that go through the extend, shade and
+// accumulate stages until all paths terminate. Each path draws the same
+// random numbers as `trace_path`, so the two integrators produce the same
+// image.
+template <typename Scene>
+void trace_wavefront(trace_state& state, const Scene& scene,
+    const bvh_scene& bvh, const trace_lights& lights, int sample,
+    const trace_params& params) {
+  auto paths      = wavefront_paths{};
+  auto num_pixels = state.width * state.height;
+  for (auto start = 0; start < num_pixels; start += wavefront_size) {
+    auto count = min(wavefront_size, num_pixels - start);
+    init_paths(paths, state, scene, start, count, sample, params);
+    while (!paths.active.empty()) {
+      extend_paths(paths, scene, bvh, params);
+      shade_escaped(paths, scene, params);
+      if (params.batchshading) {
+        shade_surfaces_batched(paths, scene, bvh, lights, params);
+      } else {
+        shade_surfaces(paths, scene, bvh, lights, params);
+      }
+      shade_media(paths, scene, bvh, lights, params);
+      compact_paths(paths);
+    }
+    accumulate_paths(paths, state, scene, params);
+  }
+}
+
+// Image tile, as a range of pixels.
+struct image_tile {
+  vec2i start = {0, 0};
+  vec2i end   = {0, 0};
+};
+
+// Spread the lower 16 bits of `x` so that they occupy every other bit.
+inline uint32_t expand_tile_bits(uint32_t x) {
+  x = (x | (x << 8)) & 0x00FF00FFu;
+  x = (x | (x << 4)) & 0x0F0F0F0Fu;
+  x = (x | (x << 2)) & 0x33333333u;
+  x = (x | (x << 1)) & 0x55555555u;
+  return x;
+}
+
+// Split the image in tiles of `tile_size` pixels, sorted by `order`. Morton
+// order keeps consecutive tiles close in the image. Center-first order sorts
+// tiles by distance from the image center, and then along a Morton curve.
+// The tile size is rounded up to a multiple of the ray packet size.
+inline vector<image_tile> make_tiles(
+    int width, int height, int tile_size_, trace_tile_order order) {
+  auto tile_size = max(
+      (tile_size_ + trace_tile_size - 1) / trace_tile_size * trace_tile_size,
+      trace_tile_size);
+  auto tiles_x = (width + tile_size - 1) / tile_size;
+  auto tiles_y = (height + tile_size - 1) / tile_size;
+  auto keys    = vector<pair<uint64_t, image_tile>>{};
+  keys.reserve(tiles_x * tiles_y);
+  for (auto j = 0; j < tiles_y; j++) {
+    for (auto i = 0; i < tiles_x; i++) {
+      auto tile   = image_tile{{i * tile_size, j * tile_size},
+          {min((i + 1) * tile_size, width), min((j + 1) * tile_size, height)}};
+      auto morton = (uint64_t)((expand_tile_bits(j) << 1) |
+                               expand_tile_bits(i));
+      if (order == trace_tile_order::centerfirst) {
+        auto dx = i + 0.5f - tiles_x / 2.0f, dy = j + 0.5f - tiles_y / 2.0f;
+        auto distance = (uint64_t)((dx * dx + dy * dy) * 16);
+        keys.push_back({(distance << 32) | morton, tile});
+      } else {
+        keys.push_back({morton, tile});
+      }
+    }
+  }
+  std::sort(keys.begin(), keys.end(),
+      [](auto& a, auto& b) { return a.first < b.first; });
+  auto tiles = vector<image_tile>{};
+  tiles.reserve(keys.size());
+  for (auto& [key, tile] : keys) tiles.push_back(tile);
+  return tiles;
+}
+
+// Number of consecutive tiles given to the same thread.
+const auto image_tile_run = 4;
+
+// Tiles owned by a thread.
+struct image_tile_queue {
+  std::mutex mutex = {};
+  deque<int> tiles = {};
+};
+
+// Run `func` on all tiles. Tiles are dealt to threads in runs of
+// `image_tile_run` consecutive tiles, so that neighboring tiles go to the
+// same thread and the order of the tiles is kept across threads. Each thread
+// takes tiles from the front of its own queue, and steals from the back of
+// the other queues when it runs out of work.
+template <typename Func>
+inline void parallel_for_tiles(
+    const vector<image_tile>& tiles, bool noparallel, Func&& func) {
+  if (noparallel) {
+    for (auto& tile : tiles) func(tile);
+    return;
+  }
+  auto nthreads = max((int)std::thread::hardware_concurrency(), 1);
+  auto queues   = vector<image_tile_queue>(nthreads);
+  for (auto idx = 0; idx < (int)tiles.size(); idx++) {
+    queues[(idx / image_tile_run) % nthreads].tiles.push_back(idx);
+  }
+  auto pop_tile = [&](int thread_id) {
+    {
+      auto& queue = queues[thread_id];
+      auto  lock  = std::lock_guard{queue.mutex};
+      if (!queue.tiles.empty()) {
+        auto idx = queue.tiles.front();
+        queue.tiles.pop_front();
+        return idx;
+      }
+    }
+    for (auto offset = 1; offset < nthreads; offset++) {
+      auto& queue = queues[(thread_id + offset) % nthreads];
+      auto  lock  = std::lock_guard{queue.mutex};
+      if (!queue.tiles.empty()) {
+        auto idx = queue.tiles.back();
+        queue.tiles.pop_back();
+        return idx;
+      }
+    }
+    return -1;
+  };
+  auto futures   = vector<future<void>>{};
+  auto has_error = atomic<bool>{false};
+  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
+    futures.emplace_back(std::async(std::launch::async, [&, thread_id]() {
+      try {
+        while (true) {
+          auto idx = pop_tile(thread_id);
+          if (idx < 0) break;
+          if (has_error) break;
+          func(tiles[idx]);
+        }
+      } catch (...) {
+        has_error = true;
+        throw;
+      }
+    }));
+  }
+  for (auto& f : futures) f.get();
+}
+
+// Trace the samples `[first, first + samples)` for each pixel in a tile.
+// Pixels are traced sample by sample, so that the tile stays in cache across
+// samples. With `raypackets`, camera rays are traced as packets of
+// `trace_tile_size` pixels.
+template <typename Scene>
+void trace_tile_samples(trace_state& state, const Scene& scene,
+    const bvh_scene& bvh, const trace_lights& lights, const image_tile& tile,
+    int first, int samples, const trace_params& params) {
+  for (auto sample = first; sample < first + samples; sample++) {
+    if (params.raypackets) {
+      for (auto j = tile.start.y; j < tile.end.y; j += trace_tile_size) {
+        for (auto i = tile.start.x; i < tile.end.x; i += trace_tile_size) {
+          trace_tile(state, scene, bvh, lights, i / trace_tile_size,
+              j / trace_tile_size, sample, params);
+        }
+      }
+    } else {
+      for (auto j = tile.start.y; j < tile.end.y; j++) {
+        for (auto i = tile.start.x; i < tile.end.x; i++) {
+          trace_sample(state, scene, bvh, lights, i, j, sample, params);
+        }
+      }
+    }
+  }
+}
+
+// Samples taken by all pixels before checking convergence.
+const auto trace_adaptive_min = 16;
+// Samples between convergence checks.
+const auto trace_adaptive_step = 8;
+// Largest number of samples for a pixel, relative to `samples`.
+const auto trace_adaptive_max = 4;
+
+// Error estimate of a tile for adaptive sampling. The half buffer holds every
+// other sample, so that it is an independent estimate of the pixel with half
+// the samples. The error is the difference between the two estimates relative
+// to the square root of the pixel intensity, averaged over the tile.
+inline float tile_error(const trace_state& state, const image_tile& tile) {
+  auto error = 0.0f;
+  for (auto j = tile.start.y; j < tile.end.y; j++) {
+    for (auto i = tile.start.x; i < tile.end.x; i++) {
+      auto idx     = state.width * j + i;
+      auto samples = (float)state.pixel_samples[idx];
+      auto all     = xyz(state.image[idx]) / samples;
+      auto half    = xyz(state.halfimage[idx]) / floor(samples / 2);
+      error += sum(abs(all - half)) / sqrt(max(sum(all), 1e-3f));
+    }
+  }
+  auto size = tile.end - tile.start;
+  return error / (float)(size.x * size.y);
+}
+
+// Check whether rendering is done. With adaptive sampling, rendering stops
+// when all pixels converged, when the samples taken reach the budget of
+// `samples` per pixel, or when noisy pixels reach `trace_adaptive_max` times
+// `samples`. The budget not used by converged pixels goes to noisy ones.
+inline bool is_done(const trace_state& state, const trace_params& params) {
+  if (params.targeterror <= 0 || state.pixel_samples.empty())
+    return state.samples >= params.samples;
+  if (state.samples >= params.samples * trace_adaptive_max) return true;
+  auto budget  = (int64_t)params.samples * state.width * state.height;
+  auto samples = (int64_t)0;
+  for (auto count : state.pixel_samples) samples += count;
+  if (samples >= budget) return true;
+  for (auto converged : state.converged) {
+    if (!converged) return false;
+  }
+  return true;
+}
+
+// Trace a sample for each pixel that did not converge. Convergence is
+// checked per tile every `trace_adaptive_step` samples, and converged tiles
+// are not sampled anymore.
+template <typename Scene>
+void trace_adaptive(trace_state& state, const Scene& scene,
+    const bvh_scene& bvh, const trace_lights& lights,
+    const trace_params& params) {
+  auto tiles = make_tiles(
+      state.width, state.height, params.tilesize, params.tileorder);
+  parallel_for_tiles(tiles, params.noparallel, [&](const image_tile& tile) {
+    auto first = state.width * tile.start.y + tile.start.x;
+    if (state.converged[first]) return;
+    trace_tile_samples(state, scene, bvh, lights, tile,
+        params.firstsample + state.pixel_samples[first], 1, params);
+    auto samples = state.pixel_samples[first];
+    if (samples < trace_adaptive_min || samples % trace_adaptive_step != 0)
+      return;
+    if (tile_error(state, tile) >= params.targeterror) return;
+    for (auto j = tile.start.y; j < tile.end.y; j++) {
+      for (auto i = tile.start.x; i < tile.end.x; i++) {
+        state.converged[state.width * j + i] = 1;
+      }
+    }
+  });
+}
+
+// Sample range of a partition of the samples of a render, as the first sample
+// and the number of samples. Partitions render consecutive ranges under the
+// same seed, so that they merge to the render of all the samples. Adaptive
+// ranges leave room for `trace_adaptive_max` times their samples.
+inline vec2i partition_samples(
+    const trace_params& params, int partition, int partitions) {
+  auto samples = params.samples / partitions;
+  auto extra   = params.samples % partitions;
+  auto first   = samples * partition + min(partition, extra);
+  auto count   = samples + (partition < extra ? 1 : 0);
+  auto scale   = params.targeterror > 0 ? trace_adaptive_max : 1;
+  return {params.firstsample + first * scale, count};
+}
+
+// Trace a sample for each pixel. Samples are numbered from `firstsample`.
 template <typename Scene>
 void trace_samples(trace_state& state, const Scene& scene, const bvh_scene& bvh,
     const trace_lights& lights, const trace_params& params) {
-  if (state.samples >= params.samples) return;
-  if (params.noparallel) {
+  if (is_done(state, params)) return;
+  auto sample = params.firstsample + state.samples;
+  if (params.wavefront && params.sampler == trace_sampler_type::path) {
+    trace_wavefront(state, scene, bvh, lights, sample, params);
+  } else if (!state.pixel_samples.empty()) {
+    trace_adaptive(state, scene, bvh, lights, params);
+  } else if (params.tiled) {
+    auto tiles = make_tiles(
+        state.width, state.height, params.tilesize, params.tileorder);
+    parallel_for_tiles(tiles, params.noparallel, [&](const image_tile& tile) {
+      trace_tile_samples(state, scene, bvh, lights, tile, sample, 1, params);
+    });
+  } else if (params.raypackets) {
+    auto tiles_x = (state.width + trace_tile_size - 1) / trace_tile_size;
+    auto tiles_y = (state.height + trace_tile_size - 1) / trace_tile_size;
+    if (params.noparallel) {
+      for (auto j = 0; j < tiles_y; j++) {
+        for (auto i = 0; i < tiles_x; i++) {
+          trace_tile(state, scene, bvh, lights, i, j, sample, params);
+        }
+      }
+    } else {
+      parallel_for(tiles_x, tiles_y, [&](int i, int j) {
+        trace_tile(state, scene, bvh, lights, i, j, sample, params);
+      });
+    }
+  } else if (params.noparallel) {
     for (auto j = 0; j < state.height; j++) {
       for (auto i = 0; i < state.width; i++) {
-        trace_sample(state, scene, bvh, lights, i, j, params);
+        trace_sample(state, scene, bvh, lights, i, j, sample, params);
       }
     }
   } else {
     parallel_for(state.width, state.height, [&](int i, int j) {
-      trace_sample(state, scene, bvh, lights, i, j, params);
+      trace_sample(state, scene, bvh, lights, i, j, sample, params);
     });
   }
   state.samples += 1;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstring>
 #include <unordered_map>
 
 #include "ext/robin_hood.h"
@@ -21,33 +22,88 @@ using hash_set = std::unordered_set<Key, Value>;
 
 using std::unordered_map;
 
+// Bytes allocated past the end of each blob, since vectorized readers, like
+// Embree, may read past the last element.
+const auto data_table_padding = 16;
+
+// Blob stored in a data table. The bytes are allocated with zeroed padding
+// after the `size` bytes of data.
+struct Data_Blob {
+  vector<byte> bytes = {};
+  size_t       size  = 0;
+};
+
+// Make a padded blob from `size` bytes of data.
+inline Data_Blob make_data_blob(const void* data, size_t size) {
+  auto blob  = Data_Blob{};
+  blob.bytes = vector<byte>(size + data_table_padding, (byte)0);
+  blob.size  = size;
+  if (size != 0) memcpy(blob.bytes.data(), data, size);
+  return blob;
+}
+
 struct Data_Table {
-  unordered_map<Hash, vector<byte>, ArrayHasher> map = {};
+  unordered_map<Hash, Data_Blob, ArrayHasher> map = {};
 
   template <typename T>
   inline const T& get(const Hash& hash) const {
     static auto default_value = T{};
     auto        it            = map.find(hash);
     if (it == map.end()) return default_value;
-    return *(T*)it->second.data();
+    return *(T*)it->second.bytes.data();
   }
 
   template <typename T>
   inline const view<T> get_view(const Hash& hash) const {
     auto it = map.find(hash);
     if (it == map.end()) return {};
-    auto& bytes = it->second;
-    return view<T>((T*)&bytes[0], bytes.size() / sizeof(T));
+    auto& blob = it->second;
+    return view<T>((T*)blob.bytes.data(), blob.size / sizeof(T));
   }
 
   template <typename T>
   inline bool set(const Hash& hash, const T& value) {
     static auto default_value = T{};
     if (memcmp(&value, &default_value, sizeof(T)) == 0) return false;
-    map[hash] = vector<byte>((byte*)&value, (byte*)&value + sizeof(T));
+    map[hash] = make_data_blob(&value, sizeof(T));
     return true;
   }
 
+  // Keys of the entries derived from other entries, mapped to the key of
+  // their source, so that they can be erased with `erase_derived`.
+  unordered_map<Hash, Hash, ArrayHasher> sources = {};
+
+  // Stores data derived from the entry `source` under a key chosen by the
+  // caller.
+  template <typename T>
+  inline void set_derived(
+      const Hash& hash, const Hash& source, const vector<T>& value) {
+    map[hash]     = make_data_blob(value.data(), value.size() * sizeof(T));
+    sources[hash] = source;
+  }
+  template <typename T>
+  inline void set_derived(const Hash& hash, const Hash& source, const T& value) {
+    map[hash]     = make_data_blob(&value, sizeof(T));
+    sources[hash] = source;
+  }
+
+  // Erases the derived entries whose source is not `used`.
+  template <typename Used>
+  inline void erase_derived(Used&& used) {
+    for (auto it = sources.begin(); it != sources.end();) {
+      if (used(it->second)) {
+        ++it;
+      } else {
+        map.erase(it->first);
+        it = sources.erase(it);
+      }
+    }
+  }
+
+  inline bool contains(const Hash& hash) const {
+    return map.find(hash) != map.end();
+  }
+
   template <typename T>
   inline Hash maybe_add(const view<T>& value) {
     if (value.empty()) return invalid_hash;
@@ -56,9 +112,8 @@ struct Data_Table {
     if (it != map.end()) {
       return it->first;
     } else {
-      auto bytes = vector<byte>(
-          (byte*)value.data, (byte*)(value.data + value.count));
-      map.insert(it, {hash, bytes});
+      map.insert(
+          it, {hash, make_data_blob(value.data, value.count * sizeof(T))});
       return hash;
     }
   }
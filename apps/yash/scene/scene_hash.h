@@ -40,14 +40,86 @@ inline Shape_View make_shape_view(
   return shape_view;
 }
 
+// Key of the texels blob of a streamed texture, derived from the hash of its
+// pixels, since the blob references the cache and is not a stable key.
+inline Hash streamed_texture_hash(const Hash& hash) {
+  auto key = hash;
+  key[0] ^= 0x73;
+  key[1] ^= 0x74;
+  return key;
+}
+
+// Textures are stored encoded if `encode_texture` finds a smaller encoding,
+// in which case the raw pixels are left out. If a `cache` is given, textures
+// are streamed from it instead, reusing the tiles written by `stream_texture`
+// while loading. Only the size and color space are stored as texture info, so
+// that node hashes depend on the pixels and not on where they are allocated.
 inline Hash_Node* add_texture_node(Hash_Node* parent,
-    const texture_data& texture, Data_Table& data, size_t id) {
-  auto node = add_node(parent, id);
-  add_leaf_node(node, texture.pixelsf, data);
-  add_leaf_node(node, texture.pixelsb, data);
-  add_leaf_node<texture_data>(node, texture, data);  // pixels copied too...
+    const texture_data& texture, Data_Table& data, size_t id,
+    bool lossy = false, Texture_Cache* cache = nullptr) {
+  auto node     = add_node(parent, id);
+  auto texels   = vector<byte>{};
+  auto encoding = texture_encoding::raw;
+  auto streamed = streamed_texture{};
+  auto hash     = Hash{};
+  if (cache && texture.width != 0 && texture.height != 0) {
+    auto cached = find_streamed_texture(*cache, (int)id, hash);
+    if (cached < 0) {
+      cached = add_texture(*cache, texture);
+      hash   = hash_texture_pixels(texture);
+    }
+    streamed = streamed_texture{cache, cached};
+    encoding = texture_encoding::streamed;
+  } else {
+    encoding = encode_texture(texels, texture, lossy);
+  }
+  if (encoding == texture_encoding::raw) {
+    add_leaf_node(node, texture.pixelsf, data);
+    add_leaf_node(node, texture.pixelsb, data);
+  } else {
+    add_leaf_node(node, vector<vec4f>{}, data);
+    add_leaf_node(node, vector<vec4b>{}, data);
+  }
+  auto info   = texture_data();  // value-initialized, with zeroed padding
+  info.width  = texture.width;
+  info.height = texture.height;
+  info.linear = texture.linear;
+  add_leaf_node<texture_data>(node, info, data);
+  if (encoding == texture_encoding::streamed) {
+    auto leaf  = add_node(node);
+    leaf->hash = streamed_texture_hash(hash);
+    data.set(leaf->hash, streamed);
+  } else {
+    add_leaf_node(node, texels, data);
+  }
+  add_leaf_node<texture_encoding>(node, encoding, data);
   return node;
 }
+// Keys of the mip pyramid of a texture, derived from the texture hash so that
+// pyramids are shared by unchanged textures across edits. Views are made at
+// each lookup, so the keys are a cheap tweak of the hash rather than a rehash.
+inline Hash mipmap_levels_hash(const Hash& hash) {
+  auto key = hash;
+  key[0] ^= 0x6d;
+  key[1] ^= 0x6c;
+  return key;
+}
+inline Hash mipmap_texels_hash(const Hash& hash) {
+  auto key = hash;
+  key[0] ^= 0x6d;
+  key[1] ^= 0x74;
+  return key;
+}
+
+// Key of the material evaluation plan of a shape, derived from the shape hash
+// as for mip pyramids.
+inline Hash material_plan_hash(const Hash& hash) {
+  auto key = hash;
+  key[0] ^= 0x70;
+  key[1] ^= 0x6c;
+  return key;
+}
+
 inline Texture_View make_texture_view(
     const Hash_Node* node, const Data_Table& data) {
   auto texture_view    = Texture_View{};
@@ -64,6 +136,23 @@ inline Texture_View make_texture_view(
   texture_view.height = info.height;
   texture_view.linear = info.linear;
 
+  texture_view.encoding = data.get<texture_encoding>(node->children[4]->hash);
+  if (texture_view.encoding != texture_encoding::raw) {
+    texture_view.texels = data.get_view<byte>(node->children[3]->hash);
+  }
+
+  texture_view.levels = data.get_view<texture_level>(
+      mipmap_levels_hash(node->hash));
+  if (!texture_view.levels.empty()) {
+    if (texture_view.encoding != texture_encoding::raw) {
+      texture_view.mips = data.get_view<byte>(mipmap_texels_hash(node->hash));
+    } else if (has_float_texels(texture_view)) {
+      texture_view.mipsf = data.get_view<vec4f>(mipmap_texels_hash(node->hash));
+    } else {
+      texture_view.mipsb = data.get_view<vec4b>(mipmap_texels_hash(node->hash));
+    }
+  }
+
   return texture_view;
 }
 
@@ -193,7 +282,39 @@ struct Scene_Hash {
   }
 };
 
-inline Scene_Hash create_scene_hash(const scene_data& scene, Data_Table& data) {
+// Textures that can be block compressed, since they are used only as color or
+// emission textures. Textures also used as data, like roughness, scattering,
+// normal or displacement maps, are kept exact.
+inline vector<bool> get_color_textures(const scene_data& scene) {
+  auto color = vector<bool>(scene.textures.size(), false);
+  auto data  = vector<bool>(scene.textures.size(), false);
+  auto mark  = [](vector<bool>& used, int texture) {
+    if (texture != invalidid) used[texture] = true;
+  };
+  for (auto& material : scene.materials) {
+    mark(color, material.color_tex);
+    mark(color, material.emission_tex);
+    mark(data, material.roughness_tex);
+    mark(data, material.scattering_tex);
+    mark(data, material.normal_tex);
+  }
+  for (auto& environment : scene.environments) {
+    mark(color, environment.emission_tex);
+  }
+  for (auto& subdiv : scene.subdivs) {
+    mark(data, subdiv.displacement_tex);
+  }
+  for (auto idx = 0; idx < (int)color.size(); idx++) {
+    color[idx] = color[idx] && !data[idx];
+  }
+  return color;
+}
+
+// If `lossy_textures` is set, opaque color textures, as found by
+// `get_color_textures`, are block compressed. If a `texture_cache` is given,
+// textures are streamed from it.
+inline Scene_Hash create_scene_hash(const scene_data& scene, Data_Table& data,
+    bool lossy_textures = false, Texture_Cache* texture_cache = nullptr) {
   auto root         = new Hash_Node{};
   auto cameras      = add_node(root, 0);
   auto instances    = add_node(root, 1);
@@ -219,9 +340,11 @@ inline Scene_Hash create_scene_hash(const scene_data& scene, Data_Table& data) {
     auto& shape = scene.shapes[i];
     add_shape_node(shapes, shape, data, i);
   }
+  auto color_textures = get_color_textures(scene);
   for (int i = 0; i < scene.textures.size(); i++) {
     auto& texture = scene.textures[i];
-    add_texture_node(textures, texture, data, i);
+    add_texture_node(textures, texture, data, i,
+        lossy_textures && color_textures[i], texture_cache);
   }
   for (int i = 0; i < scene.materials.size(); i++) {
     auto& material = scene.materials[i];
@@ -308,13 +431,13 @@ inline void apply_diff(Scene_View& scene, const Scene_Hash& diff) {
 
 inline Scene_View create_scene_view(const scene_data& scene) {
   auto scene_view = Scene_View{};
-  scene_view._cameras.resize(scene.cameras.size());
-  scene_view._instances.resize(scene.instances.size());
-  scene_view._environments.resize(scene.environments.size());
-  scene_view._shapes.resize(scene.shapes.size());
-  scene_view._textures.resize(scene.textures.size());
-  scene_view._materials.resize(scene.materials.size());
-  scene_view._subdivs.resize(scene.subdivs.size());
+  scene_view._cameras.reserve(scene.cameras.size());
+  scene_view._instances.reserve(scene.instances.size());
+  scene_view._environments.reserve(scene.environments.size());
+  scene_view._shapes.reserve(scene.shapes.size());
+  scene_view._textures.reserve(scene.textures.size());
+  scene_view._materials.reserve(scene.materials.size());
+  scene_view._subdivs.reserve(scene.subdivs.size());
 
   for (int i = 0; i < scene.cameras.size(); i++) {
     scene_view._cameras[i] = &scene.cameras[i];
@@ -342,13 +465,13 @@ inline Scene_View create_scene_view(const scene_data& scene) {
 
 inline Scene_View create_scene_view(const Scene_Hash& scene) {
   auto scene_view = Scene_View{};
-  scene_view._cameras.resize(scene.cameras().size());
-  scene_view._instances.resize(scene.instances().size());
-  scene_view._environments.resize(scene.environments().size());
-  scene_view._shapes.resize(scene.shapes().size());
-  scene_view._textures.resize(scene.textures().size());
-  scene_view._materials.resize(scene.materials().size());
-  scene_view._subdivs.resize(scene.subdivs().size());
+  scene_view._cameras.reserve(scene.cameras().size());
+  scene_view._instances.reserve(scene.instances().size());
+  scene_view._environments.reserve(scene.environments().size());
+  scene_view._shapes.reserve(scene.shapes().size());
+  scene_view._textures.reserve(scene.textures().size());
+  scene_view._materials.reserve(scene.materials().size());
+  scene_view._subdivs.reserve(scene.subdivs().size());
 
   for (int i = 0; i < scene.num_cameras(); i++) {
     scene_view._cameras[i] = &scene.cameras(i);
@@ -4,6 +4,9 @@
 
 #include <view.h>
 
+#include "texture_cache.h"
+#include "texture_encoding.h"
+
 namespace yash {
 using namespace yocto;
 
@@ -72,6 +75,19 @@ inline Shape_View make_shape_view(const shape_data& shape) {
   return shape_view;
 }
 
+// Side of the square tiles that mip levels are stored in.
+const auto texture_tile_size = 4;
+
+// Level of a mip pyramid. Raw texels are stored in tiles of `texture_tile_size`
+// texels per side, `tiles` per row, starting at `offset`. Encoded texels start
+// at byte `offset`. The first level is the texture itself and stores no texels.
+struct texture_level {
+  int width  = 0;
+  int height = 0;
+  int tiles  = 0;
+  int offset = 0;
+};
+
 struct Texture_View {
   int  width  = 0;
   int  height = 0;
@@ -83,8 +99,24 @@ struct Texture_View {
   view<vec4b> pixelsb = {};
   // };
   // Texture_View() {}
+
+  // encoded texels, used instead of the pixels above if not raw
+  texture_encoding encoding = texture_encoding::raw;
+  view<byte>       texels   = {};
+
+  // mip pyramid, if built, without its first level; tiled in the format of
+  // the pixels above for raw textures, or in the encoding of the texels above
+  view<texture_level> levels = {};
+  view<vec4f>         mipsf  = {};
+  view<vec4b>         mipsb  = {};
+  view<byte>          mips   = {};
 };
 
+// Whether texels are stored as floats, either raw or encoded.
+inline bool has_float_texels(const Texture_View& texture) {
+  return !texture.pixelsf.empty() || is_hdr_encoding(texture.encoding);
+}
+
 inline Texture_View make_texture_view(const texture_data& texture) {
   auto texture_view    = Texture_View{};
   texture_view.width   = texture.width;
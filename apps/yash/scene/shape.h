@@ -1,5 +1,15 @@
 #pragma once
 #include <yocto/yocto_bvh.h>
+#include <yocto/yocto_parallel.h>
+
+#include <atomic>
+
+#ifdef YOCTO_EMBREE
+#include <embree3/rtcore.h>
+
+#include <mutex>
+#include <stdexcept>
+#endif
 
 namespace yash {
 using namespace yocto;
@@ -26,16 +36,334 @@ vec3f eval_position(const Shape& shape, int element, const vec2f& uv) {
   }
 }
 
+// Four triangles stored in BVH leaf order with precomputed edges, one per
+// lane, with the coordinates of each vertex and edge split by axis. Each leaf
+// starts a new batch, so that the triangles of a leaf are tested together
+// without going through the shape indices and positions. Unused lanes have
+// zero edges and are never hit.
+struct bvh_triangle4 {
+  array<vec4f, 3> p0 = {};
+  array<vec4f, 3> e1 = {};
+  array<vec4f, 3> e2 = {};
+};
+
+// Shape BVH. Optionally stores a packed copy of the triangles in leaf order,
+// trading memory for fewer dependent loads during traversal, with the index
+// of the first batch of each leaf node. The number of elements and the SAH
+// cost at the last full build are kept to choose how to update the BVH after
+// edits.
+struct shape_bvh : bvh_data {
+  vector<bvh_triangle4> triangles = {};
+  vector<int>           batches   = {};
+  int                   elements  = 0;
+  float                 cost      = 0;
+};
+
+// Intersect a ray with a batch of packed triangles. Lanes are computed with
+// the same operations as the single triangle test, in loops over the lanes
+// that the compiler vectorizes. Returns the mask of the lanes hit, with their
+// coordinates and distances.
+inline uint32_t intersect_triangle4(const ray3f& ray,
+    const bvh_triangle4& triangles, vec4f& u, vec4f& v, vec4f& dist) {
+  // copy the ray and the results, so that the lane loop does not alias them
+  auto [ox, oy, oz]     = ray.o;
+  auto [dx, dy, dz]     = ray.d;
+  auto tmin             = ray.tmin;
+  auto tmax             = ray.tmax;
+  auto& [p0x, p0y, p0z] = triangles.p0;
+  auto& [e1x, e1y, e1z] = triangles.e1;
+  auto& [e2x, e2y, e2z] = triangles.e2;
+  auto lanes_u = vec4f{}, lanes_v = vec4f{}, lanes_dist = vec4f{};
+  auto lanes_hit = array<uint32_t, 4>{};
+  for (auto lane = 0; lane < 4; lane++) {
+    // compute determinant to solve a linear system
+    auto pvecx   = dy * e2z[lane] - dz * e2y[lane];
+    auto pvecy   = dz * e2x[lane] - dx * e2z[lane];
+    auto pvecz   = dx * e2y[lane] - dy * e2x[lane];
+    auto det     = e1x[lane] * pvecx + e1y[lane] * pvecy + e1z[lane] * pvecz;
+    auto inv_det = 1.0f / det;
+
+    // compute first bricentric coordinated
+    auto tvecx    = ox - p0x[lane];
+    auto tvecy    = oy - p0y[lane];
+    auto tvecz    = oz - p0z[lane];
+    lanes_u[lane] = (tvecx * pvecx + tvecy * pvecy + tvecz * pvecz) * inv_det;
+
+    // compute second bricentric coordinated
+    auto qvecx    = tvecy * e1z[lane] - tvecz * e1y[lane];
+    auto qvecy    = tvecz * e1x[lane] - tvecx * e1z[lane];
+    auto qvecz    = tvecx * e1y[lane] - tvecy * e1x[lane];
+    lanes_v[lane] = (dx * qvecx + dy * qvecy + dz * qvecz) * inv_det;
+
+    // compute ray parameter
+    lanes_dist[lane] = (e2x[lane] * qvecx + e2y[lane] * qvecy +
+                           e2z[lane] * qvecz) *
+                       inv_det;
+
+    // check determinant, coordinates and parameter, without branches
+    auto cu = lanes_u[lane], cv = lanes_v[lane], ct = lanes_dist[lane];
+    lanes_hit[lane] = (det != 0) & !((cu < 0) | (cu > 1)) &
+                      !((cv < 0) | (cu + cv > 1)) &
+                      !((ct < tmin) | (ct > tmax));
+  }
+  u    = lanes_u;
+  v    = lanes_v;
+  dist = lanes_dist;
+  return lanes_hit[0] | (lanes_hit[1] << 1) | (lanes_hit[2] << 2) |
+         (lanes_hit[3] << 3);
+}
+
+#ifdef YOCTO_EMBREE
+
+// First error reported by Embree since the last check. Errors are recorded by
+// the device callback, since exceptions cannot unwind through Embree frames,
+// and thrown by `check_embree_error` after commits.
+struct embree_error_state {
+  std::mutex mutex = {};
+  string     error = {};
+};
+inline embree_error_state& embree_error() {
+  static auto state = embree_error_state{};
+  return state;
+}
+
+// Embree device shared by all bvhs.
+inline RTCDevice embree_device() {
+  static auto device = []() {
+    auto device = rtcNewDevice("");
+    rtcSetDeviceErrorFunction(
+        device,
+        [](void* ctx, RTCError code, const char* message) {
+          auto& state = embree_error();
+          auto  lock  = std::lock_guard{state.mutex};
+          if (!state.error.empty()) return;
+          state.error = "embree error " + std::to_string((int)code) + ": " +
+                        (message ? message : "");
+        },
+        nullptr);
+    return device;
+  }();
+  return device;
+}
+
+// Throw the error recorded by Embree, if any.
+inline void check_embree_error() {
+  auto& state = embree_error();
+  auto  error = string{};
+  {
+    auto lock = std::lock_guard{state.mutex};
+    std::swap(error, state.error);
+  }
+  if (!error.empty()) throw std::runtime_error(error);
+}
+
+// Release an Embree scene.
+inline void clear_embree_scene(void* escene) {
+  if (escene) rtcReleaseScene((RTCScene)escene);
+}
+
+// Make an Embree scene for a bvh.
+inline RTCScene make_embree_scene(bvh_data& bvh, bool highquality) {
+  bvh.embree_bvh = unique_ptr<void, void (*)(void*)>{
+      rtcNewScene(embree_device()), &clear_embree_scene};
+  auto escene = (RTCScene)bvh.embree_bvh.get();
+  if (highquality) {
+    rtcSetSceneBuildQuality(escene, RTC_BUILD_QUALITY_HIGH);
+  } else {
+    rtcSetSceneFlags(escene, RTC_SCENE_FLAG_COMPACT);
+  }
+  return escene;
+}
+
+// Position and radius of a vertex, as stored by Embree curves and points.
+template <typename Shape>
+inline vec4f embree_vertex(const Shape& shape, int vertex) {
+  auto& position = shape.positions(vertex);
+  auto  radius   = shape.num_radius() != 0 ? shape.radius(vertex) : 0.001f;
+  return {position.x, position.y, position.z, radius};
+}
+
+// Set the buffers of an Embree geometry from a shape. Triangles, quads and
+// positions are shared with the shape, so no data is copied, but the shape
+// memory needs to outlive the bvh and be readable 16 bytes past the last
+// position. Points and lines need radius interleaved with positions, so
+// their buffers are copied.
+template <typename Shape>
+inline void set_embree_buffers(RTCGeometry egeometry, const Shape& shape) {
+  if (shape.num_points() != 0) {
+    auto epositions = (vec4f*)rtcSetNewGeometryBuffer(egeometry,
+        RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(vec4f),
+        shape.num_points());
+    for (auto idx = 0; idx < (int)shape.num_points(); idx++) {
+      auto& point     = shape.points(idx);
+      epositions[idx] = embree_vertex(shape, point);
+    }
+  } else if (shape.num_lines() != 0) {
+    auto epositions = (vec4f*)rtcSetNewGeometryBuffer(egeometry,
+        RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(vec4f),
+        shape.num_lines() * 2);
+    auto elines     = (int*)rtcSetNewGeometryBuffer(egeometry,
+        RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, sizeof(int),
+        shape.num_lines());
+    for (auto idx = 0; idx < (int)shape.num_lines(); idx++) {
+      auto& line              = shape.lines(idx);
+      elines[idx]             = idx * 2;
+      epositions[idx * 2 + 0] = embree_vertex(shape, line.x);
+      epositions[idx * 2 + 1] = embree_vertex(shape, line.y);
+    }
+  } else if (shape.num_triangles() != 0) {
+    rtcSetSharedGeometryBuffer(egeometry, RTC_BUFFER_TYPE_VERTEX, 0,
+        RTC_FORMAT_FLOAT3, &shape.positions(0), 0, sizeof(vec3f),
+        shape.num_positions());
+    rtcSetSharedGeometryBuffer(egeometry, RTC_BUFFER_TYPE_INDEX, 0,
+        RTC_FORMAT_UINT3, &shape.triangles(0), 0, sizeof(vec3i),
+        shape.num_triangles());
+  } else if (shape.num_quads() != 0) {
+    rtcSetSharedGeometryBuffer(egeometry, RTC_BUFFER_TYPE_VERTEX, 0,
+        RTC_FORMAT_FLOAT3, &shape.positions(0), 0, sizeof(vec3f),
+        shape.num_positions());
+    rtcSetSharedGeometryBuffer(egeometry, RTC_BUFFER_TYPE_INDEX, 0,
+        RTC_FORMAT_UINT4, &shape.quads(0), 0, sizeof(vec4i),
+        shape.num_quads());
+  }
+}
+
+// Initialize an Embree BVH for a shape.
+template <typename Shape>
+inline void make_embree_bvh(
+    bvh_data& bvh, const Shape& shape, bool highquality) {
+  auto escene    = make_embree_scene(bvh, highquality);
+  auto egeometry = RTCGeometry{};
+  if (shape.num_points() != 0) {
+    egeometry = rtcNewGeometry(embree_device(), RTC_GEOMETRY_TYPE_SPHERE_POINT);
+  } else if (shape.num_lines() != 0) {
+    egeometry = rtcNewGeometry(
+        embree_device(), RTC_GEOMETRY_TYPE_FLAT_LINEAR_CURVE);
+  } else if (shape.num_triangles() != 0) {
+    egeometry = rtcNewGeometry(embree_device(), RTC_GEOMETRY_TYPE_TRIANGLE);
+  } else if (shape.num_quads() != 0) {
+    egeometry = rtcNewGeometry(embree_device(), RTC_GEOMETRY_TYPE_QUAD);
+  } else {
+    rtcCommitScene(escene);
+    check_embree_error();
+    return;
+  }
+  set_embree_buffers(egeometry, shape);
+  rtcCommitGeometry(egeometry);
+  rtcAttachGeometryByID(escene, egeometry, 0);
+  rtcReleaseGeometry(egeometry);
+  rtcCommitScene(escene);
+  check_embree_error();
+}
+
+// Update an Embree BVH after the shape changed. The shape type must not
+// change, while element and vertex counts can.
 template <typename Shape>
-bool intersect_shape(const bvh_data& bvh, const Shape& shape, const ray3f& ray_,
-    int& element, vec2f& uv, float& distance, bool find_any) {
-  // #ifdef YOCTO_EMBREE
-  //   // call Embree if needed
-  //   if (bvh.embree_bvh) {
-  //     return intersect_embree_bvh(
-  //         bvh, shape, ray_, element, uv, distance, find_any);
-  //   }
-  // #endif
+inline void update_embree_bvh(bvh_data& bvh, const Shape& shape) {
+  auto escene    = (RTCScene)bvh.embree_bvh.get();
+  auto egeometry = rtcGetGeometry(escene, 0);
+  if (!egeometry) return;
+  set_embree_buffers(egeometry, shape);
+  rtcCommitGeometry(egeometry);
+  rtcCommitScene(escene);
+  check_embree_error();
+}
+
+// Intersect a ray with an Embree scene. Any-hit queries use occlusion rays
+// and only report the hit.
+template <bool find_any>
+inline bool intersect_embree_bvh(const bvh_data& bvh, const ray3f& ray,
+    int& instance, int& element, vec2f& uv, float& distance) {
+  auto embree_ray = RTCRayHit{};
+  embree_ray.ray.org_x     = ray.o.x;
+  embree_ray.ray.org_y     = ray.o.y;
+  embree_ray.ray.org_z     = ray.o.z;
+  embree_ray.ray.dir_x     = ray.d.x;
+  embree_ray.ray.dir_y     = ray.d.y;
+  embree_ray.ray.dir_z     = ray.d.z;
+  embree_ray.ray.tnear     = ray.tmin;
+  embree_ray.ray.tfar      = ray.tmax;
+  embree_ray.ray.mask      = (unsigned int)-1;
+  embree_ray.ray.flags     = 0;
+  embree_ray.hit.geomID    = RTC_INVALID_GEOMETRY_ID;
+  embree_ray.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+  auto embree_ctx          = RTCIntersectContext{};
+  rtcInitIntersectContext(&embree_ctx);
+  if constexpr (find_any) {
+    rtcOccluded1(
+        (RTCScene)bvh.embree_bvh.get(), &embree_ctx, &embree_ray.ray);
+    return embree_ray.ray.tfar < 0;
+  } else {
+    rtcIntersect1((RTCScene)bvh.embree_bvh.get(), &embree_ctx, &embree_ray);
+    if (embree_ray.hit.geomID == RTC_INVALID_GEOMETRY_ID) return false;
+    instance = (int)embree_ray.hit.instID[0];
+    element  = (int)embree_ray.hit.primID;
+    uv       = {embree_ray.hit.u, embree_ray.hit.v};
+    distance = embree_ray.ray.tfar;
+    return true;
+  }
+}
+
+#endif
+
+// Copy triangle data in leaf order, in batches of four triangles that start
+// at each leaf. Must be called after each build or refit.
+template <typename Shape>
+void pack_shape_bvh(shape_bvh& bvh, const Shape& shape) {
+  bvh.triangles.clear();
+  bvh.batches.clear();
+  if (shape.num_triangles() == 0) return;
+  bvh.batches.assign(bvh.nodes.size(), 0);
+  for (auto nodeid = 0; nodeid < (int)bvh.nodes.size(); nodeid++) {
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) continue;
+    bvh.batches[nodeid] = (int)bvh.triangles.size();
+    for (auto idx = node.start; idx < node.start + node.num; idx++) {
+      auto lane = (idx - node.start) % 4;
+      if (lane == 0) bvh.triangles.emplace_back();
+      auto& t     = shape.triangles(bvh.primitives[idx]);
+      auto& p0    = shape.positions(t.x);
+      auto  e1    = shape.positions(t.y) - p0;
+      auto  e2    = shape.positions(t.z) - p0;
+      auto& batch = bvh.triangles.back();
+      for (auto axis = 0; axis < 3; axis++) {
+        batch.p0[axis][lane] = p0[axis];
+        batch.e1[axis][lane] = e1[axis];
+        batch.e2[axis][lane] = e2[axis];
+      }
+    }
+  }
+}
+
+// Traversal counters of the intersection kernels, passed as a policy. The
+// default policy counts nothing and compiles away, while benchmarks count
+// visited nodes and tested primitives with `bvh_counters`.
+struct bvh_no_counters {
+  void visit_node() {}
+  void test_primitive() {}
+};
+struct bvh_counters {
+  int64_t nodes      = 0;
+  int64_t primitives = 0;
+  void    visit_node() { nodes += 1; }
+  void    test_primitive() { primitives += 1; }
+};
+
+// Intersect a ray with a shape bvh. Closest-hit and any-hit queries are
+// compiled as separate kernels, selected by `find_any`. The any-hit kernel
+// returns at the first hit found, without updating the element.
+template <bool find_any, typename Shape, typename Counters = bvh_no_counters>
+bool intersect_shape(const shape_bvh& bvh, const Shape& shape,
+    const ray3f& ray_, int& element, vec2f& uv, float& distance,
+    Counters&& counters = {}) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (bvh.embree_bvh) {
+    auto instance = 0;
+    return intersect_embree_bvh<find_any>(
+        bvh, ray_, instance, element, uv, distance);
+  }
+#endif
 
   // check empty
   if (bvh.nodes.empty()) return false;
@@ -59,7 +387,9 @@ bool intersect_shape(const bvh_data& bvh, const Shape& shape, const ray3f& ray_,
   // walking stack
   while (node_cur != 0) {
     // grab node
-    auto& node = bvh.nodes[node_stack[--node_cur]];
+    auto  nodeid = node_stack[--node_cur];
+    auto& node   = bvh.nodes[nodeid];
+    counters.visit_node();
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -77,11 +407,34 @@ bool intersect_shape(const bvh_data& bvh, const Shape& shape, const ray3f& ray_,
         node_stack[node_cur++] = node.start + 1;
         node_stack[node_cur++] = node.start + 0;
       }
+    } else if (!bvh.triangles.empty()) {
+      auto batch = bvh.batches[nodeid];
+      for (auto idx = node.start; idx < node.start + node.num;
+           idx += 4, batch++) {
+        auto lanes = min(node.start + node.num - idx, 4);
+        for (auto lane = 0; lane < lanes; lane++) counters.test_primitive();
+        auto lanes_u = vec4f{}, lanes_v = vec4f{}, lanes_dist = vec4f{};
+        auto hits    = intersect_triangle4(
+            ray, bvh.triangles[batch], lanes_u, lanes_v, lanes_dist);
+        if (hits == 0) continue;
+        if constexpr (find_any) return true;
+        // take lanes in order, as if tested one at a time
+        for (auto lane = 0; lane < lanes; lane++) {
+          if (!(hits & (1u << lane)) || lanes_dist[lane] > ray.tmax) continue;
+          hit      = true;
+          element  = bvh.primitives[idx + lane];
+          uv       = {lanes_u[lane], lanes_v[lane]};
+          distance = lanes_dist[lane];
+          ray.tmax = distance;
+        }
+      }
     } else if (shape.num_points() != 0) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        counters.test_primitive();
         auto& p = shape.points(bvh.primitives[idx]);
         if (intersect_point(
                 ray, shape.positions(p), shape.radius(p), uv, distance)) {
+          if constexpr (find_any) return true;
           hit      = true;
           element  = bvh.primitives[idx];
           ray.tmax = distance;
@@ -89,9 +442,11 @@ bool intersect_shape(const bvh_data& bvh, const Shape& shape, const ray3f& ray_,
       }
     } else if (shape.num_lines() != 0) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        counters.test_primitive();
         auto& l = shape.lines(bvh.primitives[idx]);
         if (intersect_line(ray, shape.positions(l.x), shape.positions(l.y),
                 shape.radius(l.x), shape.radius(l.y), uv, distance)) {
+          if constexpr (find_any) return true;
           hit      = true;
           element  = bvh.primitives[idx];
           ray.tmax = distance;
@@ -99,9 +454,11 @@ bool intersect_shape(const bvh_data& bvh, const Shape& shape, const ray3f& ray_,
       }
     } else if (shape.num_triangles() != 0) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        counters.test_primitive();
         auto& t = shape.triangles(bvh.primitives[idx]);
         if (intersect_triangle(ray, shape.positions(t.x), shape.positions(t.y),
                 shape.positions(t.z), uv, distance)) {
+          if constexpr (find_any) return true;
           hit      = true;
           element  = bvh.primitives[idx];
           ray.tmax = distance;
@@ -109,79 +466,969 @@ bool intersect_shape(const bvh_data& bvh, const Shape& shape, const ray3f& ray_,
       }
     } else if (shape.num_quads() != 0) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        counters.test_primitive();
         auto& q = shape.quads(bvh.primitives[idx]);
         if (intersect_quad(ray, shape.positions(q.x), shape.positions(q.y),
                 shape.positions(q.z), shape.positions(q.w), uv, distance)) {
+          if constexpr (find_any) return true;
           hit      = true;
           element  = bvh.primitives[idx];
           ray.tmax = distance;
         }
       }
     }
-
-    // check for early exit
-    if (find_any && hit) return hit;
   }
 
   return hit;
 }
 
-template <typename Shape>
-bvh_intersection intersect_shape(const bvh_data& bvh, const Shape& shape,
-    const ray3f& ray, bool find_any = false, bool non_rigid_frames = true) {
+template <bool find_any = false, typename Shape>
+bvh_intersection intersect_shape(
+    const shape_bvh& bvh, const Shape& shape, const ray3f& ray) {
   auto intersection = bvh_intersection{};
-  intersection.hit  = intersect_shape(bvh, shape, ray, intersection.element,
-      intersection.uv, intersection.distance, find_any);
+  intersection.hit  = intersect_shape<find_any>(bvh, shape, ray,
+      intersection.element, intersection.uv, intersection.distance);
   return intersection;
 }
 
+// Intersect a ray with the shape element at position `idx` in leaf order.
 template <typename Shape>
-bvh_data make_shape_bvh(const Shape& shape, bool highquality, bool embree) {
-  // embree
-  // #ifdef YOCTO_EMBREE
-  //   if (embree) return make_embree_bvh(shape, highquality);
-  // #endif
+inline bool intersect_element(const shape_bvh& bvh, const Shape& shape,
+    int idx, const ray3f& ray, vec2f& uv, float& distance) {
+  if (shape.num_points() != 0) {
+    auto& p = shape.points(bvh.primitives[idx]);
+    return intersect_point(
+        ray, shape.positions(p), shape.radius(p), uv, distance);
+  } else if (shape.num_lines() != 0) {
+    auto& l = shape.lines(bvh.primitives[idx]);
+    return intersect_line(ray, shape.positions(l.x), shape.positions(l.y),
+        shape.radius(l.x), shape.radius(l.y), uv, distance);
+  } else if (shape.num_triangles() != 0) {
+    auto& t = shape.triangles(bvh.primitives[idx]);
+    return intersect_triangle(ray, shape.positions(t.x), shape.positions(t.y),
+        shape.positions(t.z), uv, distance);
+  } else if (shape.num_quads() != 0) {
+    auto& q = shape.quads(bvh.primitives[idx]);
+    return intersect_quad(ray, shape.positions(q.x), shape.positions(q.y),
+        shape.positions(q.z), shape.positions(q.w), uv, distance);
+  } else {
+    return false;
+  }
+}
 
-  // bvh
-  auto bvh = bvh_data{};
+// Conservative bounds of a ray packet, used to reject nodes for all rays at
+// once with interval arithmetic on the slab test. Culling is only valid when
+// all active rays share the same direction signs.
+struct bvh_packet_bounds {
+  bool  valid = false;
+  vec3f omin  = {0, 0, 0};
+  vec3f omax  = {0, 0, 0};
+  vec3f imin  = {0, 0, 0};
+  vec3f imax  = {0, 0, 0};
+  float tmin  = 0;
+  float tmax  = 0;
+};
 
-  // build primitives
-  auto bboxes = vector<bbox3f>{};
-  if (shape.num_points() != 0) {
-    bboxes = vector<bbox3f>(shape.num_points());
-    for (auto idx = 0; idx < shape.num_points(); idx++) {
-      auto& point = shape.points(idx);
-      bboxes[idx] = point_bounds(shape.positions(point), shape.radius(point));
+// Init packet bounds from the active rays.
+template <size_t N>
+inline bvh_packet_bounds make_packet_bounds(const array<ray3f, N>& rays,
+    const array<vec3f, N>& rays_dinv, uint32_t mask) {
+  auto bounds = bvh_packet_bounds{};
+  auto first  = true;
+  for (auto i = 0; i < (int)N; i++) {
+    if (!(mask & (1u << i))) continue;
+    auto& ray  = rays[i];
+    auto& dinv = rays_dinv[i];
+    if (!isfinite(dinv)) return {};
+    if (first) {
+      bounds = {true, ray.o, ray.o, dinv, dinv, ray.tmin, ray.tmax};
+      first  = false;
+      continue;
     }
-  } else if (shape.num_lines() != 0) {
-    bboxes = vector<bbox3f>(shape.num_lines());
-    for (auto idx = 0; idx < shape.num_lines(); idx++) {
-      auto& line  = shape.lines(idx);
-      bboxes[idx] = line_bounds(shape.positions(line.x),
-          shape.positions(line.y), shape.radius(line.x), shape.radius(line.y));
+    for (auto axis = 0; axis < 3; axis++) {
+      if ((dinv[axis] < 0) != (bounds.imin[axis] < 0)) return {};
+    }
+    bounds.omin = min(bounds.omin, ray.o);
+    bounds.omax = max(bounds.omax, ray.o);
+    bounds.imin = min(bounds.imin, dinv);
+    bounds.imax = max(bounds.imax, dinv);
+    bounds.tmin = min(bounds.tmin, ray.tmin);
+    bounds.tmax = max(bounds.tmax, ray.tmax);
+  }
+  return bounds;
+}
+
+// Check whether all rays in the packet miss a bounding box.
+inline bool cull_packet_bbox(
+    const bvh_packet_bounds& bounds, const bbox3f& bbox) {
+  auto near = bounds.tmin, far = bounds.tmax;
+  for (auto axis = 0; axis < 3; axis++) {
+    auto negative = bounds.imin[axis] < 0;
+    auto pnear    = negative ? bbox.max[axis] : bbox.min[axis];
+    auto pfar     = negative ? bbox.min[axis] : bbox.max[axis];
+    // range of (plane - origin) * inverse direction over the packet
+    auto n0 = (pnear - bounds.omax[axis]) * bounds.imin[axis];
+    auto n1 = (pnear - bounds.omax[axis]) * bounds.imax[axis];
+    auto n2 = (pnear - bounds.omin[axis]) * bounds.imin[axis];
+    auto n3 = (pnear - bounds.omin[axis]) * bounds.imax[axis];
+    auto f0 = (pfar - bounds.omax[axis]) * bounds.imin[axis];
+    auto f1 = (pfar - bounds.omax[axis]) * bounds.imax[axis];
+    auto f2 = (pfar - bounds.omin[axis]) * bounds.imin[axis];
+    auto f3 = (pfar - bounds.omin[axis]) * bounds.imax[axis];
+    near    = max(near, min(min(n0, n1), min(n2, n3)));
+    far     = min(far, max(max(f0, f1), max(f2, f3)));
+  }
+  return near > far * 1.00000024f;
+}
+
+// Intersect a packet of up to 32 rays with a shape BVH, returning the closest
+// hit for each active ray in `mask`. Nodes are culled for the whole packet
+// first, then per ray, and only the rays that hit a node are carried down.
+// Ray `tmax` is updated on hit. Returns the mask of rays that hit.
+template <typename Shape, size_t N>
+uint32_t intersect_shape_packet(const shape_bvh& bvh, const Shape& shape,
+    array<ray3f, N>& rays, uint32_t mask,
+    array<bvh_intersection, N>& intersections) {
+  static_assert(N <= 32, "packets are limited to 32 rays");
+
+  // check empty
+  if (bvh.nodes.empty() || mask == 0) return 0;
+
+  // prepare rays for fast queries
+  auto rays_dinv = array<vec3f, N>{};
+  auto first     = -1;
+  for (auto i = 0; i < (int)N; i++) {
+    if (!(mask & (1u << i))) continue;
+    rays_dinv[i] = {1 / rays[i].d.x, 1 / rays[i].d.y, 1 / rays[i].d.z};
+    if (first < 0) first = i;
+  }
+  auto bounds = make_packet_bounds(rays, rays_dinv, mask);
+
+  // node stack with the rays active for each node
+  auto node_stack        = array<pair<int, uint32_t>, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = {0, mask};
+
+  // shared variables
+  auto hits = 0u;
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto [nodeid, node_mask] = node_stack[--node_cur];
+    auto& node               = bvh.nodes[nodeid];
+
+    // intersect bbox for the whole packet, then for each ray
+    if (bounds.valid && cull_packet_bbox(bounds, node.bbox)) continue;
+    auto active = 0u;
+    for (auto i = 0; i < (int)N; i++) {
+      if (!(node_mask & (1u << i))) continue;
+      if (intersect_bbox(rays[i], rays_dinv[i], node.bbox)) active |= 1u << i;
+    }
+    if (active == 0) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // order children by the direction of the first ray in the packet
+      if (rays_dinv[first][node.axis] < 0) {
+        node_stack[node_cur++] = {node.start + 0, active};
+        node_stack[node_cur++] = {node.start + 1, active};
+      } else {
+        node_stack[node_cur++] = {node.start + 1, active};
+        node_stack[node_cur++] = {node.start + 0, active};
+      }
+    } else if (!bvh.triangles.empty()) {
+      auto batch = bvh.batches[nodeid];
+      for (auto idx = node.start; idx < node.start + node.num;
+           idx += 4, batch++) {
+        auto lanes = min(node.start + node.num - idx, 4);
+        for (auto i = 0; i < (int)N; i++) {
+          if (!(active & (1u << i))) continue;
+          auto lanes_u = vec4f{}, lanes_v = vec4f{}, lanes_dist = vec4f{};
+          auto lanes_hit = intersect_triangle4(
+              rays[i], bvh.triangles[batch], lanes_u, lanes_v, lanes_dist);
+          for (auto lane = 0; lane < lanes; lane++) {
+            if (!(lanes_hit & (1u << lane)) || lanes_dist[lane] > rays[i].tmax)
+              continue;
+            auto& intersection    = intersections[i];
+            intersection.hit      = true;
+            intersection.element  = bvh.primitives[idx + lane];
+            intersection.uv       = {lanes_u[lane], lanes_v[lane]};
+            intersection.distance = lanes_dist[lane];
+            rays[i].tmax          = intersection.distance;
+            hits |= 1u << i;
+          }
+        }
+      }
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        for (auto i = 0; i < (int)N; i++) {
+          if (!(active & (1u << i))) continue;
+          auto& intersection = intersections[i];
+          if (intersect_element(bvh, shape, idx, rays[i], intersection.uv,
+                  intersection.distance)) {
+            intersection.hit     = true;
+            intersection.element = bvh.primitives[idx];
+            rays[i].tmax         = intersection.distance;
+            hits |= 1u << i;
+          }
+        }
+      }
     }
+  }
+
+  return hits;
+}
+
+// Element bounding box.
+template <typename Shape>
+inline bbox3f element_bbox(const Shape& shape, int element) {
+  if (shape.num_points() != 0) {
+    auto& point = shape.points(element);
+    return point_bounds(shape.positions(point), shape.radius(point));
+  } else if (shape.num_lines() != 0) {
+    auto& line = shape.lines(element);
+    return line_bounds(shape.positions(line.x), shape.positions(line.y),
+        shape.radius(line.x), shape.radius(line.y));
   } else if (shape.num_triangles() != 0) {
-    bboxes = vector<bbox3f>(shape.num_triangles());
-    for (auto idx = 0; idx < shape.num_triangles(); idx++) {
-      auto& triangle = shape.triangles(idx);
-      bboxes[idx]    = triangle_bounds(shape.positions(triangle.x),
-          shape.positions(triangle.y), shape.positions(triangle.z));
+    auto& triangle = shape.triangles(element);
+    return triangle_bounds(shape.positions(triangle.x),
+        shape.positions(triangle.y), shape.positions(triangle.z));
+  } else if (shape.num_quads() != 0) {
+    auto& quad = shape.quads(element);
+    return quad_bounds(shape.positions(quad.x), shape.positions(quad.y),
+        shape.positions(quad.z), shape.positions(quad.w));
+  } else {
+    return invalidb3f;
+  }
+}
+
+// Number of elements of a shape.
+template <typename Shape>
+inline int num_elements(const Shape& shape) {
+  if (shape.num_points() != 0) return (int)shape.num_points();
+  if (shape.num_lines() != 0) return (int)shape.num_lines();
+  if (shape.num_triangles() != 0) return (int)shape.num_triangles();
+  if (shape.num_quads() != 0) return (int)shape.num_quads();
+  return 0;
+}
+
+// Element bounding boxes of a shape.
+template <typename Shape>
+vector<bbox3f> shape_bboxes(const Shape& shape, bool noparallel = false) {
+  auto bboxes = vector<bbox3f>(num_elements(shape));
+  if (noparallel) {
+    for (auto idx = 0; idx < (int)bboxes.size(); idx++) {
+      bboxes[idx] = element_bbox(shape, idx);
+    }
+  } else {
+    parallel_for_batch((int)bboxes.size(), 4096,
+        [&](int idx) { bboxes[idx] = element_bbox(shape, idx); });
+  }
+  return bboxes;
+}
+
+// Refit bvh nodes bottom-up, getting primitive bounds from `primitive_bbox`.
+// Children always follow their parents, so the top levels are refit in
+// reverse order after the subtrees below them are refit in parallel.
+template <typename Func>
+inline void refit_bvh(
+    bvh_data& bvh, Func&& primitive_bbox, bool noparallel = false) {
+  // refit a single node from its children or primitives
+  auto refit_node = [&](int nodeid) {
+    auto& node = bvh.nodes[nodeid];
+    node.bbox  = invalidb3f;
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++) {
+        node.bbox = merge(node.bbox, bvh.nodes[node.start + idx].bbox);
+      }
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        node.bbox = merge(
+            node.bbox, primitive_bbox(bvh.primitives[node.start + idx]));
+      }
     }
+  };
+
+  // serial refit
+  if (noparallel || bvh.nodes.size() < 4096) {
+    for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
+      refit_node(nodeid);
+    }
+    return;
+  }
+
+  // split the top levels in subtrees
+  auto top   = vector<int>{};
+  auto roots = vector<int>{0};
+  while (roots.size() < 256) {
+    auto next = vector<int>{};
+    for (auto nodeid : roots) {
+      auto& node = bvh.nodes[nodeid];
+      if (node.internal) {
+        top.push_back(nodeid);
+        next.push_back(node.start + 0);
+        next.push_back(node.start + 1);
+      } else {
+        next.push_back(nodeid);
+      }
+    }
+    if (next.size() == roots.size()) break;
+    roots = std::move(next);
+  }
+
+  // refit subtrees in parallel, visiting nodes in reverse depth-first order
+  parallel_for((int)roots.size(), [&](int root) {
+    auto nodes = vector<int>{};
+    auto stack = vector<int>{roots[root]};
+    while (!stack.empty()) {
+      auto nodeid = stack.back();
+      stack.pop_back();
+      nodes.push_back(nodeid);
+      auto& node = bvh.nodes[nodeid];
+      if (!node.internal) continue;
+      stack.push_back(node.start + 0);
+      stack.push_back(node.start + 1);
+    }
+    for (auto idx = (int)nodes.size() - 1; idx >= 0; idx--) {
+      refit_node(nodes[idx]);
+    }
+  });
+
+  // refit top levels
+  std::sort(top.begin(), top.end());
+  for (auto idx = (int)top.size() - 1; idx >= 0; idx--) refit_node(top[idx]);
+}
+
+// Surface area of a bounding box, zero if the box is empty.
+inline float bbox_area(const bbox3f& bbox) {
+  auto size = bbox.max - bbox.min;
+  if (size.x < 0 || size.y < 0 || size.z < 0) return 0;
+  return 2 * (size.x * size.y + size.x * size.z + size.y * size.z);
+}
+
+// SAH cost of a bvh relative to its root, counting one for each node visit
+// and each element test.
+inline float bvh_cost(const bvh_data& bvh) {
+  if (bvh.nodes.empty()) return 0;
+  auto cost = 0.0f;
+  for (auto& node : bvh.nodes) {
+    cost += bbox_area(node.bbox) * (node.internal ? 1 : node.num);
+  }
+  return cost / max(bbox_area(bvh.nodes[0].bbox), flt_eps);
+}
+
+// SAH cost of a bvh as if refit on the element bounds `bboxes`, without
+// changing its nodes. Spatial splits build nodes on clipped references, so
+// refits grow their boxes even if no element moved. Refits are compared to
+// this cost instead of the one at build time.
+inline float bvh_refit_cost(
+    const bvh_data& bvh, const vector<bbox3f>& bboxes) {
+  if (bvh.nodes.empty()) return 0;
+  auto nodes_bbox = vector<bbox3f>(bvh.nodes.size(), invalidb3f);
+  auto cost       = 0.0f;
+  for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& node = bvh.nodes[nodeid];
+    auto& bbox = nodes_bbox[nodeid];
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++) {
+        bbox = merge(bbox, nodes_bbox[node.start + idx]);
+      }
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        bbox = merge(bbox, bboxes[bvh.primitives[node.start + idx]]);
+      }
+    }
+    cost += bbox_area(bbox) * (node.internal ? 1 : node.num);
+  }
+  return cost / max(bbox_area(nodes_bbox[0]), flt_eps);
+}
+
+// Spread the lower 10 bits of `x` so that they occupy every third bit.
+inline uint32_t expand_morton_bits(uint32_t x) {
+  x = (x * 0x00010001u) & 0xFF0000FFu;
+  x = (x * 0x00000101u) & 0x0F00F00Fu;
+  x = (x * 0x00000011u) & 0xC30C30C3u;
+  x = (x * 0x00000005u) & 0x49249249u;
+  return x;
+}
+
+// 30-bit Morton code of a point in the unit cube. Bits are interleaved as
+// x, y, z from the most significant one.
+inline uint32_t morton_code(const vec3f& p) {
+  auto q = clamp(p * 1024.0f, 0.0f, 1023.0f);
+  return (expand_morton_bits((uint32_t)q.x) << 2) |
+         (expand_morton_bits((uint32_t)q.y) << 1) |
+         expand_morton_bits((uint32_t)q.z);
+}
+
+// Sort `values` by `keys` with a stable, parallel LSD radix sort on 8-bit
+// digits. Each pass counts digits per chunk in parallel, then scatters in
+// parallel using per-chunk offsets. With `noparallel`, the sort runs serially
+// on a single chunk.
+inline void radix_sort(
+    vector<uint32_t>& keys, vector<int>& values, bool noparallel = false) {
+  const auto nbuckets   = 256;
+  auto       num        = (int)keys.size();
+  auto       nthreads   = max((int)std::thread::hardware_concurrency(), 1);
+  auto       nchunks    = noparallel ? 1 : clamp(num / 65536, 1, 4 * nthreads);
+  auto       chunk_size = (num + nchunks - 1) / nchunks;
+  auto       keys_tmp   = vector<uint32_t>(keys.size());
+  auto       values_tmp = vector<int>(values.size());
+  auto       counts     = vector<int>(nchunks * nbuckets);
+  auto       for_chunks = [&](auto&& func) {
+    if (noparallel) {
+      for (auto chunk = 0; chunk < nchunks; chunk++) func(chunk);
+    } else {
+      parallel_for(nchunks, func);
+    }
+  };
+  for (auto shift = 0; shift < 32; shift += 8) {
+    // count digits
+    std::fill(counts.begin(), counts.end(), 0);
+    for_chunks([&](int chunk) {
+      auto end = min((chunk + 1) * chunk_size, num);
+      for (auto idx = chunk * chunk_size; idx < end; idx++) {
+        counts[chunk * nbuckets + ((keys[idx] >> shift) & 0xFF)] += 1;
+      }
+    });
+
+    // convert counts to offsets, by bucket first then by chunk
+    auto offset = 0;
+    for (auto bucket = 0; bucket < nbuckets; bucket++) {
+      for (auto chunk = 0; chunk < nchunks; chunk++) {
+        auto& count = counts[chunk * nbuckets + bucket];
+        offset += std::exchange(count, offset);
+      }
+    }
+
+    // scatter
+    for_chunks([&](int chunk) {
+      auto end = min((chunk + 1) * chunk_size, num);
+      for (auto idx = chunk * chunk_size; idx < end; idx++) {
+        auto digit      = (keys[idx] >> shift) & 0xFF;
+        auto pos        = counts[chunk * nbuckets + digit]++;
+        keys_tmp[pos]   = keys[idx];
+        values_tmp[pos] = values[idx];
+      }
+    });
+    std::swap(keys, keys_tmp);
+    std::swap(values, values_tmp);
+  }
+}
+
+// Build a linear BVH [Karras 2012] on element bounds. Elements are sorted
+// along a Morton curve of their centers, and nodes are split where the
+// highest differing bit of their codes changes. Subtrees are emitted in
+// parallel, allocating children in pairs after their parents so that the
+// layout matches `build_bvh`. Much faster than SAH builds, at lower quality.
+// With `noparallel`, the bvh is built serially.
+inline void build_linear_bvh(
+    bvh_data& bvh, const vector<bbox3f>& bboxes, bool noparallel = false) {
+  const auto max_prims = 4;
+  const auto num       = (int)bboxes.size();
+
+  // prepare to build nodes
+  bvh.nodes.clear();
+  bvh.primitives.clear();
+  if (num == 0) return;
+
+  // compute centers bounds
+  auto cbbox = invalidb3f;
+  for (auto& bbox : bboxes) cbbox = merge(cbbox, center(bbox));
+  auto csize = max(cbbox.max - cbbox.min, vec3f{flt_eps, flt_eps, flt_eps});
+
+  // compute and sort codes
+  auto codes = vector<uint32_t>(num);
+  bvh.primitives.resize(num);
+  auto make_code = [&](int idx) {
+    codes[idx] = morton_code((center(bboxes[idx]) - cbbox.min) / csize);
+    bvh.primitives[idx] = idx;
+  };
+  if (noparallel) {
+    for (auto idx = 0; idx < num; idx++) make_code(idx);
+  } else {
+    parallel_for_batch(num, 65536, make_code);
+  }
+  radix_sort(codes, bvh.primitives, noparallel);
+
+  // find split position and axis for the sorted range [start, end)
+  auto split_range = [&](int start, int end) -> pair<int, int> {
+    auto first = codes[start], last = codes[end - 1];
+    if (first == last) return {(start + end) / 2, 0};
+    auto bit = 31;
+    while (!((first ^ last) & (1u << bit))) bit--;
+    // binary search the first element with the bit set
+    auto lo = start, hi = end - 1;
+    while (lo < hi) {
+      auto mid = (lo + hi) / 2;
+      if (codes[mid] & (1u << bit)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return {lo, 2 - bit % 3};
+  };
+
+  // emit nodes, a tree with num leaves has at most 2 * num - 1 nodes
+  bvh.nodes.resize(max(2 * num - 1, 1));
+  auto next_node = std::atomic<int>{1};
+  auto emit_node = [&](int nodeid, int start, int end, vector<vec3i>& stack) {
+    auto& node = bvh.nodes[nodeid];
+    if (end - start > max_prims) {
+      auto [mid, axis] = split_range(start, end);
+      node.internal    = true;
+      node.axis        = (uint8_t)axis;
+      node.num         = 2;
+      node.start       = next_node.fetch_add(2);
+      stack.push_back({node.start + 0, start, mid});
+      stack.push_back({node.start + 1, mid, end});
+    } else {
+      node.internal = false;
+      node.num      = (int16_t)(end - start);
+      node.start    = start;
+    }
+  };
+
+  // split top levels serially, then emit subtrees in parallel
+  auto tasks = vector<vec3i>{{0, 0, num}};
+  while (!noparallel && !tasks.empty() && (int)tasks.size() < 256) {
+    auto next = vector<vec3i>{};
+    for (auto& [nodeid, start, end] : tasks) {
+      emit_node(nodeid, start, end, next);
+    }
+    tasks = std::move(next);
+  }
+  auto emit_subtree = [&](int task) {
+    auto stack = vector<vec3i>{tasks[task]};
+    while (!stack.empty()) {
+      auto [nodeid, start, end] = stack.back();
+      stack.pop_back();
+      emit_node(nodeid, start, end, stack);
+    }
+  };
+  if (noparallel) {
+    for (auto task = 0; task < (int)tasks.size(); task++) emit_subtree(task);
+  } else {
+    parallel_for((int)tasks.size(), emit_subtree);
+  }
+  bvh.nodes.resize(next_node);
+
+  // compute bounds
+  refit_bvh(bvh, [&bboxes](int idx) { return bboxes[idx]; }, noparallel);
+}
+
+// Reference to a shape element, clipped to a bounding box. Spatial splits
+// duplicate references, so that an element can be found in more than one
+// leaf, each time with a tighter box.
+struct bvh_reference {
+  bbox3f bbox    = invalidb3f;
+  int    element = 0;
+};
+
+// Get the vertices of an element and the radius around them.
+template <typename Shape>
+inline int element_vertices(
+    const Shape& shape, int element, array<vec3f, 4>& vertices, float& radius) {
+  if (shape.num_points() != 0) {
+    auto& point = shape.points(element);
+    vertices[0] = shape.positions(point);
+    radius      = shape.radius(point);
+    return 1;
+  } else if (shape.num_lines() != 0) {
+    auto& line  = shape.lines(element);
+    vertices[0] = shape.positions(line.x);
+    vertices[1] = shape.positions(line.y);
+    radius      = max(shape.radius(line.x), shape.radius(line.y));
+    return 2;
+  } else if (shape.num_triangles() != 0) {
+    auto& triangle = shape.triangles(element);
+    vertices[0]    = shape.positions(triangle.x);
+    vertices[1]    = shape.positions(triangle.y);
+    vertices[2]    = shape.positions(triangle.z);
+    radius         = 0;
+    return 3;
   } else if (shape.num_quads() != 0) {
-    bboxes = vector<bbox3f>(shape.num_quads());
-    for (auto idx = 0; idx < shape.num_quads(); idx++) {
-      auto& quad  = shape.quads(idx);
-      bboxes[idx] = quad_bounds(shape.positions(quad.x),
-          shape.positions(quad.y), shape.positions(quad.z),
-          shape.positions(quad.w));
+    auto& quad  = shape.quads(element);
+    vertices[0] = shape.positions(quad.x);
+    vertices[1] = shape.positions(quad.y);
+    vertices[2] = shape.positions(quad.z);
+    vertices[3] = shape.positions(quad.w);
+    radius      = 0;
+    return quad.z == quad.w ? 3 : 4;
+  } else {
+    return 0;
+  }
+}
+
+// Intersection of two bounding boxes.
+inline bbox3f intersect_bboxes(const bbox3f& a, const bbox3f& b) {
+  return {max(a.min, b.min), min(a.max, b.max)};
+}
+
+// Split a reference with the plane at `split` along `axis`, by clipping the
+// element polygon, or segment, against the plane. The returned boxes are
+// contained in the reference box.
+template <typename Shape>
+inline pair<bbox3f, bbox3f> split_reference(
+    const Shape& shape, const bvh_reference& reference, int axis, float split) {
+  auto vertices = array<vec3f, 4>{};
+  auto radius   = 0.0f;
+  auto num      = element_vertices(shape, reference.element, vertices, radius);
+
+  // clip edges, moving the planes by the radius to keep the boxes conservative
+  auto clip = [&](float plane, bool left) {
+    auto bbox = invalidb3f;
+    for (auto i = 0; i < num; i++) {
+      auto& v0 = vertices[i];
+      auto& v1 = vertices[(i + 1) % num];
+      if (left ? v0[axis] <= plane : v0[axis] >= plane) bbox = merge(bbox, v0);
+      if ((v0[axis] < plane && v1[axis] > plane) ||
+          (v0[axis] > plane && v1[axis] < plane)) {
+        auto t = (plane - v0[axis]) / (v1[axis] - v0[axis]);
+        bbox   = merge(bbox, v0 + (v1 - v0) * clamp(t, 0.0f, 1.0f));
+      }
     }
+    if (bbox.min.x > bbox.max.x) return bbox;
+    return bbox3f{bbox.min - radius, bbox.max + radius};
+  };
+  auto left  = clip(split + radius, true);
+  auto right = clip(split - radius, false);
+  left.max[axis]  = min(left.max[axis], split);
+  right.min[axis] = max(right.min[axis], split);
+  return {intersect_bboxes(left, reference.bbox),
+      intersect_bboxes(right, reference.bbox)};
+}
+
+// Build a BVH with spatial splits [Stich et al. 2009]. Object and spatial
+// splits are both evaluated with binned SAH, and spatial splits are only
+// tried when the children of the best object split overlap. The number of
+// references may grow by at most a `budget` fraction of the elements.
+template <typename Shape>
+void build_spatial_bvh(bvh_data& bvh, const Shape& shape,
+    const vector<bbox3f>& bboxes, float budget) {
+  // parameters
+  const auto max_prims   = 4;
+  const auto nbins       = 16;
+  const auto min_overlap = 1e-5f;
+
+  // prepare to build nodes
+  bvh.nodes.clear();
+  bvh.nodes.reserve(bboxes.size() * 2);
+  bvh.primitives.clear();
+  bvh.primitives.reserve(bboxes.size());
+
+  // prepare references
+  auto references = vector<bvh_reference>{};
+  references.reserve(bboxes.size());
+  for (auto idx = 0; idx < (int)bboxes.size(); idx++) {
+    if (bboxes[idx].min.x > bboxes[idx].max.x) continue;
+    references.push_back({bboxes[idx], idx});
   }
+  auto num_references = (int)references.size();
+  auto max_references = (int)(num_references * (1 + max(budget, 0.0f)));
+
+  // bins used during splits
+  struct bin_data {
+    bbox3f bbox  = invalidb3f;
+    int    count = 0;  // object: references, spatial: entering references
+    int    exit  = 0;  // spatial: exiting references
+  };
+
+  // push first node onto the stack
+  auto stack = vector<pair<int, vector<bvh_reference>>>{};
+  stack.push_back({0, std::move(references)});
+  bvh.nodes.emplace_back();
+  auto root_area = 0.0f;
+
+  // create nodes until the stack is empty
+  while (!stack.empty()) {
+    // grab node to work on
+    auto [nodeid, refs] = std::move(stack.back());
+    stack.pop_back();
+
+    // compute bounds
+    auto bbox  = invalidb3f;
+    auto cbbox = invalidb3f;
+    for (auto& ref : refs) {
+      bbox  = merge(bbox, ref.bbox);
+      cbbox = merge(cbbox, center(ref.bbox));
+    }
+    bvh.nodes[nodeid].bbox = bbox;
+    if (nodeid == 0) root_area = max(bbox_area(bbox), flt_eps);
+
+    // make a leaf node
+    if ((int)refs.size() <= max_prims) {
+      auto& node    = bvh.nodes[nodeid];
+      node.internal = false;
+      node.num      = (int16_t)refs.size();
+      node.start    = (int)bvh.primitives.size();
+      for (auto& ref : refs) bvh.primitives.push_back(ref.element);
+      continue;
+    }
+
+    // object split with binned sah on centers
+    auto area         = max(bbox_area(bbox), flt_eps);
+    auto object_cost  = flt_max;
+    auto object_axis  = 0;
+    auto object_split = 0.0f;
+    auto object_left  = invalidb3f;
+    auto object_right = invalidb3f;
+    auto csize        = cbbox.max - cbbox.min;
+    for (auto axis = 0; axis < 3; axis++) {
+      if (csize[axis] <= 0) continue;
+      auto bins = array<bin_data, nbins>{};
+      for (auto& ref : refs) {
+        auto b = clamp((int)(nbins *
+                                 (center(ref.bbox)[axis] - cbbox.min[axis]) /
+                                 csize[axis]),
+            0, nbins - 1);
+        bins[b].bbox = merge(bins[b].bbox, ref.bbox);
+        bins[b].count += 1;
+      }
+      auto right_bboxes = array<bbox3f, nbins>{};
+      auto right_counts = array<int, nbins>{};
+      auto right_bbox   = invalidb3f;
+      auto right_count  = 0;
+      for (auto b = nbins - 1; b > 0; b--) {
+        right_bbox = merge(right_bbox, bins[b].bbox);
+        right_count += bins[b].count;
+        right_bboxes[b] = right_bbox;
+        right_counts[b] = right_count;
+      }
+      auto left_bbox  = invalidb3f;
+      auto left_count = 0;
+      for (auto b = 1; b < nbins; b++) {
+        left_bbox = merge(left_bbox, bins[b - 1].bbox);
+        left_count += bins[b - 1].count;
+        if (left_count == 0 || right_counts[b] == 0) continue;
+        auto cost = 1 + (left_count * bbox_area(left_bbox) +
+                            right_counts[b] * bbox_area(right_bboxes[b])) /
+                            area;
+        if (cost < object_cost) {
+          object_cost  = cost;
+          object_axis  = axis;
+          object_split = cbbox.min[axis] + b * csize[axis] / nbins;
+          object_left  = left_bbox;
+          object_right = right_bboxes[b];
+        }
+      }
+    }
+
+    // spatial split with binned sah on the node bounds
+    auto spatial_cost  = flt_max;
+    auto spatial_axis  = 0;
+    auto spatial_split = 0.0f;
+    auto overlap       = bbox_area(intersect_bboxes(object_left, object_right));
+    if (num_references < max_references && overlap / root_area > min_overlap) {
+      auto size = bbox.max - bbox.min;
+      for (auto axis = 0; axis < 3; axis++) {
+        if (size[axis] <= 0) continue;
+        auto bin_size = size[axis] / nbins;
+        auto bins     = array<bin_data, nbins>{};
+        auto get_bin  = [&](float value) {
+          return clamp(
+              (int)((value - bbox.min[axis]) / bin_size), 0, nbins - 1);
+        };
+        for (auto& ref : refs) {
+          auto first = get_bin(ref.bbox.min[axis]);
+          auto last  = get_bin(ref.bbox.max[axis]);
+          auto cur   = ref;
+          for (auto b = first; b < last; b++) {
+            auto [left, right] = split_reference(
+                shape, cur, axis, bbox.min[axis] + (b + 1) * bin_size);
+            bins[b].bbox = merge(bins[b].bbox, left);
+            cur.bbox     = right;
+          }
+          bins[last].bbox = merge(bins[last].bbox, cur.bbox);
+          bins[first].count += 1;
+          bins[last].exit += 1;
+        }
+        auto right_bboxes = array<bbox3f, nbins>{};
+        auto right_counts = array<int, nbins>{};
+        auto right_bbox   = invalidb3f;
+        auto right_count  = 0;
+        for (auto b = nbins - 1; b > 0; b--) {
+          right_bbox = merge(right_bbox, bins[b].bbox);
+          right_count += bins[b].exit;
+          right_bboxes[b] = right_bbox;
+          right_counts[b] = right_count;
+        }
+        auto left_bbox  = invalidb3f;
+        auto left_count = 0;
+        for (auto b = 1; b < nbins; b++) {
+          left_bbox = merge(left_bbox, bins[b - 1].bbox);
+          left_count += bins[b - 1].count;
+          if (left_count == 0 || right_counts[b] == 0) continue;
+          auto cost = 1 + (left_count * bbox_area(left_bbox) +
+                              right_counts[b] * bbox_area(right_bboxes[b])) /
+                              area;
+          if (cost < spatial_cost) {
+            spatial_cost  = cost;
+            spatial_axis  = axis;
+            spatial_split = bbox.min[axis] + b * bin_size;
+          }
+        }
+      }
+    }
+
+    // partition references
+    auto left_refs  = vector<bvh_reference>{};
+    auto right_refs = vector<bvh_reference>{};
+    auto axis       = object_axis;
+    if (spatial_cost < object_cost) {
+      axis = spatial_axis;
+      for (auto& ref : refs) {
+        if (ref.bbox.max[axis] <= spatial_split) {
+          left_refs.push_back(ref);
+        } else if (ref.bbox.min[axis] >= spatial_split) {
+          right_refs.push_back(ref);
+        } else {
+          auto [left, right] = split_reference(
+              shape, ref, axis, spatial_split);
+          if (left.min.x <= left.max.x)
+            left_refs.push_back({left, ref.element});
+          if (right.min.x <= right.max.x)
+            right_refs.push_back({right, ref.element});
+        }
+      }
+      auto duplicates = (int)(left_refs.size() + right_refs.size()) -
+                        (int)refs.size();
+      if (left_refs.empty() || right_refs.empty() ||
+          num_references + duplicates > max_references) {
+        left_refs.clear();
+        right_refs.clear();
+        axis = object_axis;
+      } else {
+        num_references += duplicates;
+      }
+    }
+    if (left_refs.empty() && right_refs.empty() && object_cost < flt_max) {
+      for (auto& ref : refs) {
+        if (center(ref.bbox)[axis] < object_split) {
+          left_refs.push_back(ref);
+        } else {
+          right_refs.push_back(ref);
+        }
+      }
+    }
+    if (left_refs.empty() || right_refs.empty()) {
+      // if we were not able to split, just break the references in half
+      left_refs.assign(refs.begin(), refs.begin() + refs.size() / 2);
+      right_refs.assign(refs.begin() + refs.size() / 2, refs.end());
+    }
+
+    // make an internal node
+    auto& node    = bvh.nodes[nodeid];
+    node.internal = true;
+    node.axis     = (uint8_t)axis;
+    node.num      = 2;
+    node.start    = (int)bvh.nodes.size();
+    bvh.nodes.emplace_back();
+    bvh.nodes.emplace_back();
+    stack.push_back({node.start + 0, std::move(left_refs)});
+    stack.push_back({node.start + 1, std::move(right_refs)});
+  }
+
+  // cleanup
+  bvh.nodes.shrink_to_fit();
+  bvh.primitives.shrink_to_fit();
+}
+
+template <typename Shape>
+shape_bvh make_shape_bvh(const Shape& shape, bool highquality,
+    [[maybe_unused]] bool embree, bool packed = false,
+    float spatial_budget = 0) {
+  // bvh
+  auto bvh = shape_bvh{};
+
+  // embree
+#ifdef YOCTO_EMBREE
+  if (embree) {
+    make_embree_bvh(bvh, shape, highquality);
+    bvh.elements = num_elements(shape);
+    return bvh;
+  }
+#endif
+
+  // build primitives
+  auto bboxes = shape_bboxes(shape, true);
 
   // build nodes
-  build_bvh(bvh, bboxes, highquality);
+  if (spatial_budget > 0) {
+    build_spatial_bvh(bvh, shape, bboxes, spatial_budget);
+  } else {
+    build_bvh(bvh, bboxes, highquality);
+  }
+
+  // keep build stats
+  bvh.elements = (int)bboxes.size();
+  bvh.cost     = bvh_refit_cost(bvh, bboxes);
+
+  // pack triangles in leaf order
+  if (packed) pack_shape_bvh(bvh, shape);
 
   // done
   return bvh;
 }
 
+// Refit a shape bvh after its vertices moved. Elements must not change.
+template <typename Shape>
+void refit_shape_bvh(
+    shape_bvh& bvh, const Shape& shape, bool noparallel = false) {
+#ifdef YOCTO_EMBREE
+  if (bvh.embree_bvh) return update_embree_bvh(bvh, shape);
+#endif
+  refit_bvh(
+      bvh, [&shape](int idx) { return element_bbox(shape, idx); },
+      noparallel);
+  if (!bvh.triangles.empty()) pack_shape_bvh(bvh, shape);
+}
+
+// Maximum growth of the SAH cost accepted for refits, relative to the cost at
+// the last full build.
+const auto bvh_max_refit_cost = 1.3f;
+
+// Maximum growth of the SAH cost for which linear BVHs replace full rebuilds.
+const auto bvh_max_linear_cost = 2.0f;
+
+// Update a shape bvh after the shape changed. If only vertices moved, the
+// bvh is refit and its cost compared to the cost at the last full build. If
+// the cost grew moderately, the bvh is rebuilt as a linear BVH. If it grew
+// more, the bvh is rebuilt with the full builder, which restores its quality
+// and resets the reference cost. If the elements changed, the bvh is always
+// rebuilt with the full builder.
+template <typename Shape>
+void update_shape_bvh(shape_bvh& bvh, const Shape& shape, bool highquality,
+    bool embree, float spatial_budget = 0, bool noparallel = false) {
+#ifdef YOCTO_EMBREE
+  if (bvh.embree_bvh) return update_embree_bvh(bvh, shape);
+#endif
+  auto packed = !bvh.triangles.empty();
+  auto bboxes = shape_bboxes(shape, noparallel);
+  if (bvh.elements != (int)bboxes.size()) {
+    bvh = make_shape_bvh(shape, highquality, embree, packed, spatial_budget);
+    return;
+  }
+
+  // refit, then rebuild depending on how much the quality degraded
+  refit_bvh(
+      bvh, [&bboxes](int idx) { return bboxes[idx]; }, noparallel);
+  auto cost = bvh_cost(bvh);
+  if (cost > bvh_max_linear_cost * bvh.cost) {
+    if (spatial_budget > 0) {
+      build_spatial_bvh(bvh, shape, bboxes, spatial_budget);
+    } else {
+      build_bvh(bvh, bboxes, highquality);
+    }
+    bvh.cost = bvh_refit_cost(bvh, bboxes);
+  } else if (cost > bvh_max_refit_cost * bvh.cost) {
+    build_linear_bvh(bvh, bboxes, noparallel);
+  }
+
+  // pack triangles in leaf order
+  if (packed) pack_shape_bvh(bvh, shape);
+}
+
 }  // namespace yash
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <yocto/yocto_color.h>
+#include <yocto/yocto_scene.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef _WIN32
+#include <stdio.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "hash_tree/hash.h"
+
+namespace yash {
+using namespace yocto;
+using std::atomic;
+using std::list;
+using std::shared_ptr;
+using std::string;
+
+// Side of the square tiles that streamed textures are stored in.
+const auto texture_cache_tile = 32;
+
+// Max side of the resident low resolution copy of streamed textures.
+const auto texture_cache_fallback = 64;
+
+// Number of tile handles kept by each thread.
+const auto texture_cache_handles = 64;
+
+// Texture stored in tiles in the cache file, with texels of `texel_size` bytes
+// and a resident low resolution copy used while tiles are loading.
+struct cached_texture {
+  int           width           = 0;
+  int           height          = 0;
+  int           tiles           = 0;
+  int           texel_size      = 0;
+  size_t        offset          = 0;
+  int           fallback_width  = 0;
+  int           fallback_height = 0;
+  vector<vec4f> fallback        = {};
+};
+
+using texture_tile = vector<byte>;
+
+// Cache of texture tiles read on demand from a disk-backed store. Resident
+// tiles are kept in a global LRU list capped at `capacity` bytes. Threads keep
+// handles to their recently used tiles, so most lookups skip the global lock.
+// With `fallback` set, missing tiles are loaded in the background while
+// lookups read the low resolution copy, so renders depend on timing.
+struct Texture_Cache {
+  FILE*                  file     = nullptr;
+  std::mutex             io       = {};
+  size_t                 size     = 0;
+  size_t                 capacity = 0;
+  bool                   fallback = false;
+  uint64_t               id       = 0;
+  vector<cached_texture> textures = {};
+
+  // cached textures of the scene textures streamed while loading, and the
+  // hashes of their pixels, which are freed
+  vector<int>  streamed        = {};
+  vector<Hash> streamed_hashes = {};
+
+  // resident tiles, most recently used first
+  struct resident_tile {
+    shared_ptr<const texture_tile> tile = {};
+    list<uint64_t>::iterator       lru  = {};
+  };
+  std::mutex                                  mutex    = {};
+  list<uint64_t>                              lru      = {};
+  std::unordered_map<uint64_t, resident_tile> tiles    = {};
+  size_t                                      resident = 0;
+
+  // background loads
+  std::thread                  loader   = {};
+  std::condition_variable      wake     = {};
+  std::deque<uint64_t>         requests = {};
+  std::unordered_set<uint64_t> pending  = {};
+  bool                         stop     = false;
+
+  // statistics
+  atomic<uint64_t> lookups    = 0;
+  atomic<uint64_t> hits       = 0;
+  atomic<uint64_t> reads      = 0;
+  atomic<uint64_t> bytes_read = 0;
+  atomic<uint64_t> evictions  = 0;
+  atomic<uint64_t> fallbacks  = 0;
+
+  Texture_Cache() {}
+  Texture_Cache(const Texture_Cache&) = delete;
+  Texture_Cache& operator=(const Texture_Cache&) = delete;
+  ~Texture_Cache();
+};
+
+// Reference to a streamed texture, stored as its texels blob.
+struct streamed_texture {
+  Texture_Cache* cache   = nullptr;
+  int            texture = -1;
+};
+
+// Key of the tile `tile` of the texture `texture`.
+inline uint64_t texture_tile_key(int texture, int tile) {
+  return ((uint64_t)texture << 32) | (uint32_t)tile;
+}
+
+// Reads `size` bytes at `offset` in the store. Reads do not share a file
+// position, so threads read concurrently, except on Windows.
+inline bool read_texture_store(
+    Texture_Cache& cache, size_t offset, byte* data, size_t size) {
+#ifdef _WIN32
+  auto lock = std::lock_guard{cache.io};
+  return _fseeki64(cache.file, (int64_t)offset, SEEK_SET) == 0 &&
+         fread(data, size, 1, cache.file) == 1;
+#else
+  return pread(fileno(cache.file), data, size, (off_t)offset) ==
+         (ssize_t)size;
+#endif
+}
+
+// Reads a tile from the store and makes it resident, evicting the least
+// recently used tiles over capacity.
+inline shared_ptr<const texture_tile> load_texture_tile(
+    Texture_Cache& cache, uint64_t key) {
+  auto& texture   = cache.textures[key >> 32];
+  auto  tile_size = (size_t)texture_cache_tile * texture_cache_tile *
+                   texture.texel_size;
+  auto tile   = std::make_shared<texture_tile>(tile_size);
+  auto offset = texture.offset + (key & 0xffffffff) * tile_size;
+  if (!read_texture_store(cache, offset, tile->data(), tile_size))
+    throw std::runtime_error("cannot read texture cache");
+  cache.reads += 1;
+  cache.bytes_read += tile_size;
+
+  auto lock = std::lock_guard{cache.mutex};
+  if (auto it = cache.tiles.find(key); it != cache.tiles.end())
+    return it->second.tile;
+  cache.lru.push_front(key);
+  cache.tiles[key] = {tile, cache.lru.begin()};
+  cache.resident += tile_size;
+  while (cache.resident > cache.capacity && cache.lru.size() > 1) {
+    auto evicted = cache.lru.back();
+    cache.lru.pop_back();
+    cache.resident -= cache.tiles[evicted].tile->size();
+    cache.tiles.erase(evicted);
+    cache.evictions += 1;
+  }
+  return tile;
+}
+
+// Background loader, used with fallbacks.
+inline void run_texture_loader(Texture_Cache& cache) {
+  while (true) {
+    auto key = uint64_t{0};
+    {
+      auto lock = std::unique_lock{cache.mutex};
+      cache.wake.wait(
+          lock, [&] { return cache.stop || !cache.requests.empty(); });
+      if (cache.stop) return;
+      key = cache.requests.front();
+      cache.requests.pop_front();
+    }
+    load_texture_tile(cache, key);
+    auto lock = std::lock_guard{cache.mutex};
+    cache.pending.erase(key);
+  }
+}
+
+inline Texture_Cache::~Texture_Cache() {
+  if (loader.joinable()) {
+    {
+      auto lock = std::lock_guard{mutex};
+      stop      = true;
+    }
+    wake.notify_all();
+    loader.join();
+  }
+  if (file) fclose(file);
+}
+
+// Opens the store of a texture cache that keeps at most `capacity` bytes of
+// tiles resident.
+inline void init_texture_cache(
+    Texture_Cache& cache, size_t capacity, bool fallback) {
+  static auto ids = atomic<uint64_t>{0};
+  cache.file      = std::tmpfile();
+  if (!cache.file) throw std::runtime_error("cannot create texture cache");
+  cache.capacity = capacity;
+  cache.fallback = fallback;
+  cache.id       = ++ids;
+  if (fallback) cache.loader = std::thread{run_texture_loader, std::ref(cache)};
+}
+
+// Hash of the pixels of a texture, which identifies streamed textures in the
+// scene hash tree.
+inline Hash hash_texture_pixels(const texture_data& texture) {
+  return texture.pixelsf.empty() ? make_hash(texture.pixelsb)
+                                 : make_hash(texture.pixelsf);
+}
+
+// Writes the tiles of a texture to the store and returns its index. Textures
+// can be added from multiple threads while no tiles are looked up.
+inline int add_texture(Texture_Cache& cache, const texture_data& texture) {
+  auto cached       = cached_texture{};
+  cached.width      = texture.width;
+  cached.height     = texture.height;
+  cached.tiles      = (texture.width + texture_cache_tile - 1) /
+                 texture_cache_tile;
+  cached.texel_size = texture.pixelsf.empty() ? (int)sizeof(vec4b)
+                                              : (int)sizeof(vec4f);
+  auto rows = (texture.height + texture_cache_tile - 1) / texture_cache_tile;
+
+  // low resolution copy, averaging blocks of texels
+  auto scale = max(1, (max(texture.width, texture.height) +
+                          texture_cache_fallback - 1) /
+                          texture_cache_fallback);
+  cached.fallback_width  = (texture.width + scale - 1) / scale;
+  cached.fallback_height = (texture.height + scale - 1) / scale;
+  cached.fallback.assign(
+      (size_t)cached.fallback_width * cached.fallback_height, {0, 0, 0, 0});
+  for (auto j = 0; j < texture.height; j++) {
+    for (auto i = 0; i < texture.width; i++) {
+      auto texel = (size_t)j * texture.width + i;
+      auto color = texture.pixelsf.empty() ? byte_to_float(texture.pixelsb[texel])
+                                           : texture.pixelsf[texel];
+      cached.fallback[(j / scale) * cached.fallback_width + i / scale] +=
+          color;
+    }
+  }
+  for (auto j = 0; j < cached.fallback_height; j++) {
+    for (auto i = 0; i < cached.fallback_width; i++) {
+      auto count = (min((i + 1) * scale, texture.width) - i * scale) *
+                   (min((j + 1) * scale, texture.height) - j * scale);
+      cached.fallback[j * cached.fallback_width + i] /= (float)count;
+    }
+  }
+
+  // tiles, padded with edge texels
+  auto lock     = std::lock_guard{cache.io};
+  cached.offset = cache.size;
+  auto tile     = texture_tile(
+      (size_t)texture_cache_tile * texture_cache_tile * cached.texel_size);
+  for (auto tj = 0; tj < rows; tj++) {
+    for (auto ti = 0; ti < cached.tiles; ti++) {
+      for (auto idx = 0; idx < texture_cache_tile * texture_cache_tile; idx++) {
+        auto i = min(ti * texture_cache_tile + idx % texture_cache_tile,
+            texture.width - 1);
+        auto j = min(tj * texture_cache_tile + idx / texture_cache_tile,
+            texture.height - 1);
+        auto texel = (size_t)j * texture.width + i;
+        auto data  = texture.pixelsf.empty() ? (byte*)&texture.pixelsb[texel]
+                                             : (byte*)&texture.pixelsf[texel];
+        memcpy(tile.data() + idx * cached.texel_size, data, cached.texel_size);
+      }
+      if (fwrite(tile.data(), tile.size(), 1, cache.file) != 1)
+        throw std::runtime_error("cannot write texture cache");
+      cache.size += tile.size();
+    }
+  }
+  fflush(cache.file);
+  cache.textures.push_back(std::move(cached));
+  return (int)cache.textures.size() - 1;
+}
+
+// Writes a texture, loaded as the texture `index` of a scene, to the store
+// and frees its pixels, keeping its size. Used to stream textures while
+// loading scenes, so that they are not all decoded in memory at once.
+inline void stream_texture(
+    Texture_Cache& cache, int index, texture_data& texture) {
+  if (texture.width == 0 || texture.height == 0) return;
+  auto cached = add_texture(cache, texture);
+  auto hash   = hash_texture_pixels(texture);
+  {
+    auto lock = std::lock_guard{cache.io};
+    if (index >= (int)cache.streamed.size()) {
+      cache.streamed.resize(index + 1, -1);
+      cache.streamed_hashes.resize(index + 1);
+    }
+    cache.streamed[index]        = cached;
+    cache.streamed_hashes[index] = hash;
+  }
+  texture.pixelsf = vector<vec4f>{};
+  texture.pixelsb = vector<vec4b>{};
+}
+
+// Cached texture of the scene texture `index`, if streamed, or -1. Sets
+// `hash` to the hash of its pixels.
+inline int find_streamed_texture(
+    const Texture_Cache& cache, int index, Hash& hash) {
+  if (index >= (int)cache.streamed.size()) return -1;
+  hash = cache.streamed_hashes[index];
+  return cache.streamed[index];
+}
+
+// Looks up the texel `i, j` of a streamed texture, with byte values mapped to
+// [0, 1] as for raw byte pixels.
+inline vec4f lookup_texture(Texture_Cache& cache, int texture, int i, int j) {
+  struct tile_handle {
+    uint64_t                       cache = 0;
+    uint64_t                       key   = 0;
+    shared_ptr<const texture_tile> tile  = {};
+  };
+  static thread_local auto handles =
+      array<tile_handle, texture_cache_handles>{};
+
+  auto& cached = cache.textures[texture];
+  auto  tile   = (j / texture_cache_tile) * cached.tiles +
+              i / texture_cache_tile;
+  auto  key    = texture_tile_key(texture, tile);
+  auto& handle = handles[(key ^ (key >> 29)) % texture_cache_handles];
+
+  // find the tile in the thread handles, the cache, or the store
+  if (handle.cache != cache.id || handle.key != key || !handle.tile) {
+    cache.lookups += 1;
+    auto resident = shared_ptr<const texture_tile>{};
+    {
+      auto lock = std::lock_guard{cache.mutex};
+      if (auto it = cache.tiles.find(key); it != cache.tiles.end()) {
+        cache.lru.splice(cache.lru.begin(), cache.lru, it->second.lru);
+        resident = it->second.tile;
+      } else if (cache.fallback) {
+        if (cache.pending.insert(key).second) {
+          cache.requests.push_back(key);
+          cache.wake.notify_one();
+        }
+      }
+    }
+    if (resident) {
+      cache.hits += 1;
+    } else if (cache.fallback) {
+      cache.fallbacks += 1;
+      auto scale = max(1, (max(cached.width, cached.height) +
+                              texture_cache_fallback - 1) /
+                              texture_cache_fallback);
+      return cached.fallback[(j / scale) * cached.fallback_width + i / scale];
+    } else {
+      resident = load_texture_tile(cache, key);
+    }
+    handle = {cache.id, key, resident};
+  }
+
+  auto texel = (j % texture_cache_tile) * texture_cache_tile +
+               i % texture_cache_tile;
+  auto data  = handle.tile->data() + texel * cached.texel_size;
+  if (cached.texel_size == sizeof(vec4f)) {
+    return *(const vec4f*)data;
+  } else {
+    return byte_to_float(*(const vec4b*)data);
+  }
+}
+
+// Lookup from the texels blob of a streamed texture.
+inline vec4f lookup_texture(const streamed_texture& streamed, int i, int j) {
+  return lookup_texture(*streamed.cache, streamed.texture, i, j);
+}
+
+// Cache statistics, formatted as in `scene_stats`.
+inline vector<string> cache_stats(const Texture_Cache& cache) {
+  auto format = [](uint64_t num) {
+    auto str = std::to_string(num);
+    while (str.size() < 20) str = " " + str;
+    return str;
+  };
+  auto lookups = cache.lookups.load(), hits = cache.hits.load();
+  auto stats   = vector<string>{};
+  stats.push_back("textures:     " + format(cache.textures.size()));
+  stats.push_back("store:        " + format(cache.size));
+  stats.push_back("lookups:      " + format(lookups));
+  stats.push_back("hits:         " + format(hits));
+  stats.push_back("hit rate:     " +
+                  format(lookups ? (hits * 100 + lookups / 2) / lookups : 0) +
+                  "%");
+  stats.push_back("fallbacks:    " + format(cache.fallbacks));
+  stats.push_back("reads:        " + format(cache.reads));
+  stats.push_back("bytes read:   " + format(cache.bytes_read));
+  stats.push_back("evictions:    " + format(cache.evictions));
+  stats.push_back("resident:     " + format(cache.resident));
+  return stats;
+}
+
+}  // namespace yash
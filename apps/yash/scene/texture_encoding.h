@@ -0,0 +1,347 @@
+#pragma once
+
+#include <yocto/yocto_color.h>
+#include <yocto/yocto_scene.h>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <view.h>
+
+namespace yash {
+using namespace yocto;
+
+// Encodings of texture texels. Raw textures keep their `vec4f` or `vec4b`
+// pixels, while the others are packed in a byte blob.
+enum struct texture_encoding : uint8_t {
+  raw,       // float or byte pixels
+  r8,        // opaque gray, 1 byte
+  ra8,       // gray and alpha, 2 bytes
+  rgba16f,   // half floats, 8 bytes
+  rgbe,      // opaque shared exponent, 4 bytes
+  bc1,       // opaque 4x4 blocks of two 565 endpoints, 8 bytes per block
+  streamed,  // tiles in a texture cache, see `texture_cache.h`
+};
+
+// Whether an encoding stores high dynamic range values.
+inline bool is_hdr_encoding(texture_encoding encoding) {
+  return encoding == texture_encoding::rgba16f ||
+         encoding == texture_encoding::rgbe;
+}
+
+// Half float conversion, rounding to nearest even.
+inline uint16_t float_to_half(float value) {
+  auto bits = uint32_t{0};
+  memcpy(&bits, &value, sizeof(bits));
+  auto sign     = (uint16_t)((bits >> 16) & 0x8000);
+  auto exponent = (int)((bits >> 23) & 0xff);
+  auto mantissa = bits & 0x7fffff;
+  if (exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  exponent = exponent - 127 + 15;
+  if (exponent >= 31) return sign | 0x7c00;
+  if (exponent <= 0) {
+    if (exponent < -10) return sign;
+    mantissa |= 0x800000;
+    auto shift   = (uint32_t)(14 - exponent);
+    auto half    = mantissa >> shift;
+    auto rest    = mantissa & ((1u << shift) - 1);
+    auto halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) half++;
+    return sign | (uint16_t)half;
+  }
+  auto half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+  auto rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+  return sign | (uint16_t)half;
+}
+inline float half_to_float(uint16_t value) {
+  auto sign     = (uint32_t)(value & 0x8000) << 16;
+  auto exponent = (uint32_t)((value >> 10) & 0x1f);
+  auto mantissa = (uint32_t)(value & 0x3ff);
+  auto bits     = sign;
+  if (exponent == 0x1f) {
+    bits |= 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits |= ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa != 0) {
+    exponent = 113;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      exponent -= 1;
+    }
+    bits |= (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  auto result = 0.0f;
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+// Shared exponent conversion, decoding as the Radiance loader does, so that
+// texels read from .hdr files are encoded exactly.
+inline vec4b float_to_rgbe(const vec4f& color) {
+  auto value = max(color.x, max(color.y, color.z));
+  if (value <= 1e-32f) return {0, 0, 0, 0};
+  auto exponent = 0;
+  std::frexp(value, &exponent);
+  auto scale = std::ldexp(1.0f, 8 - exponent);
+  return {(byte)clamp(color.x * scale, 0.0f, 255.0f),
+      (byte)clamp(color.y * scale, 0.0f, 255.0f),
+      (byte)clamp(color.z * scale, 0.0f, 255.0f), (byte)(exponent + 128)};
+}
+inline vec4f rgbe_to_float(const vec4b& rgbe) {
+  if (rgbe.w == 0) return {0, 0, 0, 1};
+  auto scale = std::ldexp(1.0f, (int)rgbe.w - (128 + 8));
+  return {rgbe.x * scale, rgbe.y * scale, rgbe.z * scale, 1};
+}
+
+// Block compression with two 565 endpoints and 2-bit indices per texel, as in
+// BC1. Endpoints are the extremes of the block colors along their principal
+// axis.
+inline uint16_t rgb_to_565(const vec3i& color) {
+  return (uint16_t)((((color.x * 31 + 127) / 255) << 11) |
+                    (((color.y * 63 + 127) / 255) << 5) |
+                    ((color.z * 31 + 127) / 255));
+}
+inline vec3i rgb565_to_rgb(uint16_t color) {
+  auto r = (color >> 11) & 0x1f, g = (color >> 5) & 0x3f, b = color & 0x1f;
+  return {(r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2)};
+}
+inline void encode_bc1_block(byte* block, const vec4b* texels) {
+  auto rgb = [texels](int idx) {
+    return vec3i{texels[idx].x, texels[idx].y, texels[idx].z};
+  };
+  auto rgbf = [texels](int idx) {
+    return vec3f{(float)texels[idx].x, (float)texels[idx].y,
+        (float)texels[idx].z};
+  };
+
+  // principal axis
+  auto mean = vec3f{0, 0, 0};
+  for (auto idx = 0; idx < 16; idx++) mean += rgbf(idx);
+  mean /= 16;
+  auto covariance = mat3f{{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+  for (auto idx = 0; idx < 16; idx++) {
+    auto d = rgbf(idx) - mean;
+    covariance.x += d * d.x;
+    covariance.y += d * d.y;
+    covariance.z += d * d.z;
+  }
+  // start from the channel with the largest variance, since the diagonal
+  // is orthogonal to the axis of colors with the same channel sum
+  auto axis = covariance.x.x >= covariance.y.y &&
+                      covariance.x.x >= covariance.z.z
+                  ? vec3f{1, 0, 0}
+                  : (covariance.y.y >= covariance.z.z ? vec3f{0, 1, 0}
+                                                      : vec3f{0, 0, 1});
+  for (auto iteration = 0; iteration < 4; iteration++) {
+    auto next = covariance * axis;
+    if (max(abs(next)) == 0) {
+      axis = {0, 0, 0};
+      break;
+    }
+    axis = next / max(abs(next));
+  }
+
+  // endpoints, as the extremes along the axis, or as the farthest pair of
+  // colors if the axis vanishes
+  auto cmin = rgb(0), cmax = rgb(0);
+  if (max(abs(axis)) != 0) {
+    auto tmin = flt_max, tmax = -flt_max;
+    for (auto idx = 0; idx < 16; idx++) {
+      auto t = dot(rgbf(idx) - mean, axis);
+      if (t < tmin) tmin = t, cmin = rgb(idx);
+      if (t > tmax) tmax = t, cmax = rgb(idx);
+    }
+  } else {
+    auto farthest = -1;
+    for (auto i = 0; i < 16; i++) {
+      for (auto j = i + 1; j < 16; j++) {
+        auto d        = rgb(i) - rgb(j);
+        auto distance = d.x * d.x + d.y * d.y + d.z * d.z;
+        if (distance > farthest) {
+          farthest = distance, cmin = rgb(i), cmax = rgb(j);
+        }
+      }
+    }
+  }
+  auto c0 = rgb_to_565(cmax), c1 = rgb_to_565(cmin);
+  if (c0 < c1) std::swap(c0, c1);
+
+  // indices
+  auto indices = uint32_t{0};
+  if (c0 != c1) {
+    auto p0      = rgb565_to_rgb(c0), p1 = rgb565_to_rgb(c1);
+    auto palette = array<vec3i, 4>{
+        p0, p1, (2 * p0 + p1) / 3, (p0 + 2 * p1) / 3};
+    for (auto idx = 0; idx < 16; idx++) {
+      auto best = 0, best_distance = std::numeric_limits<int>::max();
+      for (auto code = 0; code < 4; code++) {
+        auto d        = rgb(idx) - palette[code];
+        auto distance = d.x * d.x + d.y * d.y + d.z * d.z;
+        if (distance < best_distance) best = code, best_distance = distance;
+      }
+      indices |= (uint32_t)best << (2 * idx);
+    }
+  }
+  block[0] = (byte)(c0 & 0xff);
+  block[1] = (byte)(c0 >> 8);
+  block[2] = (byte)(c1 & 0xff);
+  block[3] = (byte)(c1 >> 8);
+  memcpy(block + 4, &indices, sizeof(indices));
+}
+inline vec4b decode_bc1_texel(const byte* block, int idx) {
+  auto c0      = (uint16_t)(block[0] | (block[1] << 8));
+  auto c1      = (uint16_t)(block[2] | (block[3] << 8));
+  auto indices = uint32_t{0};
+  memcpy(&indices, block + 4, sizeof(indices));
+  auto p0     = rgb565_to_rgb(c0), p1 = rgb565_to_rgb(c1);
+  auto color  = vec3i{0, 0, 0};
+  auto opaque = true;
+  switch ((indices >> (2 * idx)) & 3) {
+    case 0: color = p0; break;
+    case 1: color = p1; break;
+    case 2: color = c0 > c1 ? (2 * p0 + p1) / 3 : (p0 + p1) / 2; break;
+    case 3:
+      color  = c0 > c1 ? (p0 + 2 * p1) / 3 : vec3i{0, 0, 0};
+      opaque = c0 > c1;
+      break;
+  }
+  return {
+      (byte)color.x, (byte)color.y, (byte)color.z, (byte)(opaque ? 255 : 0)};
+}
+
+// Encodes the texels of a texture with `encoding`, that must apply to its
+// pixels: float pixels for `rgbe` and `rgba16f`, and byte pixels otherwise.
+// Values that the encoding cannot store are rounded.
+inline void encode_texels(vector<byte>& texels, const texture_data& texture,
+    texture_encoding encoding) {
+  auto size = (size_t)texture.width * (size_t)texture.height;
+  texels.clear();
+  switch (encoding) {
+    case texture_encoding::rgbe: {
+      texels.resize(size * sizeof(vec4b));
+      auto encoded = (vec4b*)texels.data();
+      for (auto idx = (size_t)0; idx < size; idx++)
+        encoded[idx] = float_to_rgbe(texture.pixelsf[idx]);
+    } break;
+    case texture_encoding::rgba16f: {
+      texels.resize(size * 4 * sizeof(uint16_t));
+      auto encoded = (uint16_t*)texels.data();
+      for (auto idx = (size_t)0; idx < size * 4; idx++)
+        encoded[idx] = float_to_half((&texture.pixelsf[0].x)[idx]);
+    } break;
+    case texture_encoding::r8: {
+      texels.resize(size);
+      for (auto idx = (size_t)0; idx < size; idx++)
+        texels[idx] = texture.pixelsb[idx].x;
+    } break;
+    case texture_encoding::ra8: {
+      texels.resize(size * 2);
+      for (auto idx = (size_t)0; idx < size; idx++) {
+        texels[idx * 2 + 0] = texture.pixelsb[idx].x;
+        texels[idx * 2 + 1] = texture.pixelsb[idx].w;
+      }
+    } break;
+    case texture_encoding::bc1: {
+      auto blocks_x = (texture.width + 3) / 4;
+      auto blocks_y = (texture.height + 3) / 4;
+      texels.resize((size_t)blocks_x * (size_t)blocks_y * 8);
+      for (auto bj = 0; bj < blocks_y; bj++) {
+        for (auto bi = 0; bi < blocks_x; bi++) {
+          auto block = array<vec4b, 16>{};
+          for (auto idx = 0; idx < 16; idx++) {
+            auto i     = min(bi * 4 + idx % 4, texture.width - 1);
+            auto j     = min(bj * 4 + idx / 4, texture.height - 1);
+            block[idx] = texture.pixelsb[(size_t)j * texture.width + i];
+          }
+          encode_bc1_block(
+              texels.data() + ((size_t)bj * blocks_x + bi) * 8, block.data());
+        }
+      }
+    } break;
+    default: break;
+  }
+}
+
+// Encodes the texels of a texture in the smallest encoding that keeps them
+// exact. If `lossy` is set, opaque color textures are block compressed.
+// Returns `raw` if no encoding applies, leaving `texels` empty.
+inline texture_encoding encode_texture(
+    vector<byte>& texels, const texture_data& texture, bool lossy) {
+  auto size = (size_t)texture.width * (size_t)texture.height;
+  texels.clear();
+  if (size == 0) return texture_encoding::raw;
+
+  auto encoding = texture_encoding::raw;
+  if (!texture.pixelsf.empty()) {
+    auto& pixels = texture.pixelsf;
+    auto  exact  = [&](auto&& roundtrip) {
+      for (auto& pixel : pixels) {
+        auto decoded = roundtrip(pixel);
+        if (memcmp(&decoded, &pixel, sizeof(pixel)) != 0) return false;
+      }
+      return true;
+    };
+    if (exact([](const vec4f& pixel) {
+          return rgbe_to_float(float_to_rgbe(pixel));
+        })) {
+      encoding = texture_encoding::rgbe;
+    } else if (exact([](const vec4f& pixel) {
+                 return vec4f{half_to_float(float_to_half(pixel.x)),
+                     half_to_float(float_to_half(pixel.y)),
+                     half_to_float(float_to_half(pixel.z)),
+                     half_to_float(float_to_half(pixel.w))};
+               })) {
+      encoding = texture_encoding::rgba16f;
+    }
+  } else if (!texture.pixelsb.empty()) {
+    auto gray = true, opaque = true;
+    for (auto& pixel : texture.pixelsb) {
+      gray   = gray && pixel.x == pixel.y && pixel.x == pixel.z;
+      opaque = opaque && pixel.w == 255;
+    }
+    if (gray && opaque) {
+      encoding = texture_encoding::r8;
+    } else if (gray) {
+      encoding = texture_encoding::ra8;
+    } else if (lossy && opaque) {
+      encoding = texture_encoding::bc1;
+    }
+  }
+
+  encode_texels(texels, texture, encoding);
+  return encoding;
+}
+
+// Decodes the texel `i, j` of an encoded texture, with byte values mapped to
+// [0, 1] as for raw byte pixels.
+inline vec4f decode_texel(texture_encoding encoding, const view<byte>& texels,
+    int width, int i, int j) {
+  auto idx = (size_t)j * width + i;
+  switch (encoding) {
+    case texture_encoding::r8: {
+      auto value = byte_to_float(texels[idx]);
+      return {value, value, value, 1};
+    }
+    case texture_encoding::ra8: {
+      auto value = byte_to_float(texels[idx * 2 + 0]);
+      return {value, value, value, byte_to_float(texels[idx * 2 + 1])};
+    }
+    case texture_encoding::rgba16f: {
+      auto encoded = (const uint16_t*)texels.data + idx * 4;
+      return {half_to_float(encoded[0]), half_to_float(encoded[1]),
+          half_to_float(encoded[2]), half_to_float(encoded[3])};
+    }
+    case texture_encoding::rgbe: {
+      return rgbe_to_float(((const vec4b*)texels.data)[idx]);
+    }
+    case texture_encoding::bc1: {
+      auto block = ((size_t)(j / 4) * ((width + 3) / 4) + i / 4) * 8;
+      return byte_to_float(
+          decode_bc1_texel(texels.data + block, (j % 4) * 4 + i % 4));
+    }
+    default: return {0, 0, 0, 0};
+  }
+}
+
+}  // namespace yash
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <yocto/yocto_sampling.h>
+#include <yocto/yocto_trace.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace yash {
+using namespace yocto;
+
+// Dimensions used by camera rays, and reserved for each path vertex. Vertices
+// start at fixed dimensions, so that the same decision at the same vertex
+// draws from the same dimension in all samples. A dimension gives a number
+// with `rand1f` or a pair with `rand2f`.
+const auto sequence_camera_dimensions = 2;
+const auto sequence_vertex_dimensions = 10;
+
+// Decisions taken at a path vertex, as offsets of their first dimension from
+// the first dimension of the vertex. Each decision has dimensions of its own,
+// so that skipped decisions, like the opacity test of opaque surfaces, do not
+// shift the dimensions of the following ones.
+enum struct sequence_decision {
+  transmittance = 0,  // volume distance, 2 dimensions
+  opacity       = 2,  // 1 dimension
+  lobe          = 3,  // material or light sampling, 1 dimension
+  direction     = 4,  // material, phase function or delta direction, 2 dims
+  light         = 6,  // light, element and point, 3 dimensions
+  roulette      = 9,  // russian roulette, 1 dimension
+};
+
+// Side of the blue noise mask used to dither sequences.
+const auto bluenoise_size = 64;
+
+// Hash of 32 bit integers, from lowbias32.
+inline uint32_t hash_sequence(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling with the hash of Laine and Karras, applied to reversed bits
+// as in Burley, "Practical Hash-based Owen Scrambling", 2020.
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
+}
+
+// First two dimensions of the Sobol sequence.
+inline uint32_t sobol0(uint32_t index) { return reverse_bits(index); }
+inline uint32_t sobol1(uint32_t index) {
+  auto result = 0u;
+  for (auto v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+    if (index & 1) result ^= v;
+  }
+  return result;
+}
+
+// Converts 32 bits to a float in [0, 1).
+inline float sequence_to_float(uint32_t x) {
+  return (float)(x >> 8) * (1.0f / 16777216.0f);
+}
+
+// Point `index` of a 2D Sobol sequence, shuffled and Owen-scrambled by `seed`.
+// Shuffling decorrelates the dimensions that use the same two Sobol
+// dimensions with different seeds.
+inline vec2f sobol_point(uint32_t index, uint32_t seed) {
+  index = owen_scramble(index, seed);
+  return {sequence_to_float(owen_scramble(sobol0(index), hash_sequence(seed))),
+      sequence_to_float(
+          owen_scramble(sobol1(index), hash_sequence(seed ^ 0x5bd1e995u)))};
+}
+
+// Tileable blue noise mask, as ranks in [0, 1), made with the void and
+// cluster method of Ulichney, "The void-and-cluster method for dither array
+// generation", 1993. The mask is made once, on first use.
+inline vector<float> make_bluenoise_mask(int size) {
+  auto count  = size * size;
+  auto sigma2 = 2 * 1.5f * 1.5f;
+  auto kernel = vector<float>(count);
+  for (auto j = 0; j < size; j++) {
+    for (auto i = 0; i < size; i++) {
+      auto dx = (float)min(i, size - i), dy = (float)min(j, size - j);
+      kernel[j * size + i] = std::exp(-(dx * dx + dy * dy) / sigma2);
+    }
+  }
+
+  // energy of the pattern at each pixel, with its updates
+  auto pattern = vector<uint8_t>(count, 0);
+  auto energy  = vector<float>(count, 0);
+  auto update  = [&](int pixel, float sign) {
+    auto pi = pixel % size, pj = pixel / size;
+    for (auto j = 0; j < size; j++) {
+      for (auto i = 0; i < size; i++) {
+        auto di = (i - pi + size) % size, dj = (j - pj + size) % size;
+        energy[j * size + i] += sign * kernel[dj * size + di];
+      }
+    }
+  };
+  auto find = [&](uint8_t value, bool largest) {
+    auto best = -1;
+    for (auto pixel = 0; pixel < count; pixel++) {
+      if (pattern[pixel] != value) continue;
+      if (best < 0 || (largest ? energy[pixel] > energy[best]
+                               : energy[pixel] < energy[best]))
+        best = pixel;
+    }
+    return best;
+  };
+
+  // initial pattern, with its points moved from the tightest clusters to the
+  // largest voids until stable
+  auto rng    = make_rng(1301081);
+  auto points = count / 10;
+  for (auto placed = 0; placed < points;) {
+    auto pixel = rand1i(rng, count);
+    if (pattern[pixel]) continue;
+    pattern[pixel] = 1;
+    update(pixel, 1);
+    placed++;
+  }
+  for (auto iteration = 0; iteration < count; iteration++) {
+    auto cluster   = find(1, true);
+    pattern[cluster] = 0;
+    update(cluster, -1);
+    auto hole = find(0, false);
+    pattern[hole] = 1;
+    update(hole, 1);
+    if (hole == cluster) break;
+  }
+
+  // rank the initial points by removing the tightest clusters, then the other
+  // pixels by filling the largest voids
+  auto ranks   = vector<int>(count, 0);
+  auto initial = pattern;
+  auto ienergy = energy;
+  for (auto rank = points - 1; rank >= 0; rank--) {
+    auto cluster     = find(1, true);
+    pattern[cluster] = 0;
+    update(cluster, -1);
+    ranks[cluster] = rank;
+  }
+  pattern = initial;
+  energy  = ienergy;
+  for (auto rank = points; rank < count; rank++) {
+    auto hole     = find(0, false);
+    pattern[hole] = 1;
+    update(hole, 1);
+    ranks[hole] = rank;
+  }
+
+  auto mask = vector<float>(count);
+  for (auto pixel = 0; pixel < count; pixel++) {
+    mask[pixel] = (ranks[pixel] + 0.5f) / count;
+  }
+  return mask;
+}
+inline const vector<float>& bluenoise_mask() {
+  static const auto mask = make_bluenoise_mask(bluenoise_size);
+  return mask;
+}
+
+// Random numbers of a sample, drawn from the sequence `sequence`. Independent
+// numbers come from `rng`. Sobol points are Owen-scrambled for each pixel.
+// Blue noise dithered points share the same scrambling in all pixels and are
+// shifted by a blue noise mask, offset for each dimension, so that the error
+// of neighboring pixels is decorrelated.
+struct sample_rng {
+  trace_sequence_type sequence  = trace_sequence_type::independent;
+  rng_state           rng       = {};
+  uint32_t            index     = 0;
+  uint32_t            seed      = 0;
+  int                 i         = 0;
+  int                 j         = 0;
+  int                 vertex    = 0;
+  int                 dimension = 0;
+};
+
+// Moves to the dimensions of the path vertex `vertex`.
+inline void start_vertex(sample_rng& rng, int vertex) {
+  if (rng.sequence == trace_sequence_type::independent) return;
+  rng.vertex    = sequence_camera_dimensions +
+                  vertex * sequence_vertex_dimensions;
+  rng.dimension = rng.vertex;
+}
+
+// Moves to the dimensions of the decision `decision` at the current vertex.
+inline void start_decision(sample_rng& rng, sequence_decision decision) {
+  if (rng.sequence == trace_sequence_type::independent) return;
+  rng.dimension = rng.vertex + (int)decision;
+}
+
+// Draws the next dimension.
+inline vec2f next_dimension(sample_rng& rng) {
+  auto dimension = (uint32_t)rng.dimension++;
+  auto point = sobol_point(rng.index, hash_sequence(rng.seed ^ dimension));
+  if (rng.sequence != trace_sequence_type::bluenoise) return point;
+  auto& mask   = bluenoise_mask();
+  auto  lookup = [&](uint32_t offset) {
+    auto i = (rng.i + offset % bluenoise_size) % bluenoise_size;
+    auto j = (rng.j + (offset >> 16) % bluenoise_size) % bluenoise_size;
+    return mask[j * bluenoise_size + i];
+  };
+  point += vec2f{lookup(hash_sequence(dimension * 2 + 0)),
+      lookup(hash_sequence(dimension * 2 + 1))};
+  return {point.x >= 1 ? point.x - 1 : point.x,
+      point.y >= 1 ? point.y - 1 : point.y};
+}
+
+inline float rand1f(sample_rng& rng) {
+  if (rng.sequence == trace_sequence_type::independent) return rand1f(rng.rng);
+  return next_dimension(rng).x;
+}
+inline vec2f rand2f(sample_rng& rng) {
+  if (rng.sequence == trace_sequence_type::independent) return rand2f(rng.rng);
+  return next_dimension(rng);
+}
+
+}  // namespace yash
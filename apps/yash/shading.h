@@ -0,0 +1,262 @@
+#pragma once
+#include <yocto/yocto_scene.h>
+#include <yocto/yocto_shading.h>
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// -----------------------------------------------------------------------------
+// BATCHED SHADING
+// -----------------------------------------------------------------------------
+// Shading kernels that evaluate the BRDF and its pdf for 8 shading points at
+// once, for the rough matte, glossy, reflective and gltfpbr materials. Points
+// are stored as structures of arrays. Each material has a single loop over the
+// lanes, written with scalar math and selects in place of branches, that
+// compilers vectorize. The BRDF and its pdf share their terms, so they are
+// computed together. Results match `eval_bsdfcos` and `sample_bsdfcos_pdf` up
+// to float rounding, as checked by `check_shading`.
+namespace yash {
+
+using namespace yocto;
+using std::array;
+
+// Number of lanes in shading batches.
+inline constexpr auto shading_lanes = 8;
+
+// Lane values, and lane vectors stored by axis.
+using float_lanes = array<float, shading_lanes>;
+using vec3f_lanes = array<float_lanes, 3>;
+
+// Batch of shading points, with the material and the shading directions.
+struct shading_batch {
+  array<material_type, shading_lanes> type      = {};
+  vec3f_lanes                         color     = {};
+  float_lanes                         ior       = {};
+  float_lanes                         roughness = {};
+  float_lanes                         metallic  = {};
+  vec3f_lanes                         normal    = {};
+  vec3f_lanes                         outgoing  = {};
+  vec3f_lanes                         incoming  = {};
+};
+
+// Lane access.
+inline vec3f get_lane(const vec3f_lanes& a, int lane) {
+  return {a[0][lane], a[1][lane], a[2][lane]};
+}
+inline void set_lane(vec3f_lanes& a, int lane, const vec3f& b) {
+  a[0][lane] = b.x;
+  a[1][lane] = b.y;
+  a[2][lane] = b.z;
+}
+inline void set_lane(shading_batch& batch, int lane,
+    const material_point& material, const vec3f& normal, const vec3f& outgoing,
+    const vec3f& incoming) {
+  batch.type[lane]      = material.type;
+  batch.ior[lane]       = material.ior;
+  batch.roughness[lane] = material.roughness;
+  batch.metallic[lane]  = material.metallic;
+  set_lane(batch.color, lane, material.color);
+  set_lane(batch.normal, lane, normal);
+  set_lane(batch.outgoing, lane, outgoing);
+  set_lane(batch.incoming, lane, incoming);
+}
+
+// Whether a material has a batched kernel.
+inline bool is_batched(const material_point& material) {
+  return material.roughness != 0 && (material.type == material_type::matte ||
+                                        material.type == material_type::glossy ||
+                                        material.type ==
+                                            material_type::reflective ||
+                                        material.type == material_type::gltfpbr);
+}
+
+// Scalar terms used in the lane loops. They take cosines instead of vectors,
+// compute all their terms and select the result instead of returning early,
+// so that they inline in loops without branches.
+inline float lane_fresnel_dielectric(float eta, float cosw) {
+  auto sin2  = 1 - cosw * cosw;
+  auto eta2  = eta * eta;
+  auto cos2t = 1 - sin2 / eta2;
+  auto t0    = std::sqrt(max(cos2t, 0.0f));
+  auto t1    = eta * t0;
+  auto t2    = eta * cosw;
+  auto rs    = (cosw - t1) / (cosw + t1);
+  auto rp    = (t0 - t2) / (t0 + t2);
+  auto F     = (rs * rs + rp * rp) / 2;
+  return cos2t < 0 ? 1.0f : F;
+}
+inline float lane_fresnel_conductor(float reflectivity, float cosw_) {
+  auto r        = std::sqrt(clamp(reflectivity, 0.0f, 0.99f));
+  auto eta      = (1 + r) / (1 - r);
+  auto cosw     = clamp(cosw_, -1.0f, 1.0f);
+  auto cos2     = cosw * cosw;
+  auto sin2     = clamp(1 - cos2, 0.0f, 1.0f);
+  auto t0       = eta * eta - sin2;
+  auto a2plusb2 = std::sqrt(t0 * t0);
+  auto t1       = a2plusb2 + cos2;
+  auto a        = std::sqrt((a2plusb2 + t0) / 2);
+  auto t2       = 2 * a * cosw;
+  auto rs       = (t1 - t2) / (t1 + t2);
+  auto t3       = cos2 * a2plusb2 + sin2 * sin2;
+  auto t4       = t2 * sin2;
+  auto rp       = rs * (t3 - t4) / (t3 + t4);
+  auto F        = (rp + rs) / 2;
+  return cosw_ <= 0 ? 0.0f : F;
+}
+inline float lane_fresnel_schlick(float specular, bool black, float cosine) {
+  auto x = clamp(1 - std::abs(cosine), 0.0f, 1.0f);
+  auto F = specular + (1 - specular) * (x * x * x * x * x);
+  return black ? 0.0f : F;
+}
+inline float lane_microfacet_distribution(float roughness2, float cosine) {
+  auto cosine2 = cosine * cosine;
+  auto denom   = cosine2 * roughness2 + 1 - cosine2;
+  auto D       = roughness2 / (pif * denom * denom);
+  return cosine <= 0 ? 0.0f : D;
+}
+inline float lane_microfacet_shadowing1(
+    float roughness2, float cosine, float cosineh) {
+  auto cosine2 = cosine * cosine;
+  auto G       = 2 * std::abs(cosine) /
+           (std::abs(cosine) +
+               std::sqrt(cosine2 - roughness2 * cosine2 + roughness2));
+  return cosine * cosineh <= 0 ? 0.0f : G;
+}
+
+// Adds the BRDF scaled by the cosine of the incoming direction, and the pdf
+// of BRDF sampling, for the lanes of a batch with material `type`. Values are
+// computed for all lanes and zeroed for lanes with other materials and where
+// the scalar functions return early.
+template <material_type type>
+inline void eval_bsdfcos_lanes(
+    const shading_batch& batch, vec3f_lanes& bsdfcos, float_lanes& pdf) {
+  auto& [types, color, ior, roughness, metallic, normal, outgoing, incoming] =
+      batch;
+  // results are kept local, so that they do not alias the batch
+  auto lane_bsdfcos = vec3f_lanes{};
+  auto lane_pdf     = float_lanes{};
+  for (auto lane = 0; lane < shading_lanes; lane++) {
+    auto nx = normal[0][lane], ny = normal[1][lane], nz = normal[2][lane];
+    auto ox = outgoing[0][lane], oy = outgoing[1][lane], oz = outgoing[2][lane];
+    auto ix = incoming[0][lane], iy = incoming[1][lane], iz = incoming[2][lane];
+    auto cr = color[0][lane], cg = color[1][lane], cb = color[2][lane];
+
+    // cosines with the normal facing the outgoing direction
+    auto no      = nx * ox + ny * oy + nz * oz;
+    auto ni      = nx * ix + ny * iy + nz * iz;
+    auto zero    = (types[lane] != type) | (ni * no <= 0) |
+                (roughness[lane] == 0);
+    auto flip    = no <= 0;
+    auto upo     = flip ? -no : no;
+    auto upi     = flip ? -ni : ni;
+    auto cosine  = upi / pif;
+    auto hemi    = upi <= 0 ? 0.0f : cosine;
+    auto bsdfcos = vec3f{0, 0, 0};
+    auto pdf     = 0.0f;
+
+    if constexpr (type == material_type::matte) {
+      auto diffuse = std::abs(ni) / pif;
+      bsdfcos      = {cr * diffuse, cg * diffuse, cb * diffuse};
+      pdf          = hemi;
+    } else {
+      // halfway vector and microfacet terms
+      auto hx = ix + ox, hy = iy + oy, hz = iz + oz;
+      auto hl = std::sqrt(hx * hx + hy * hy + hz * hz);
+      auto hs = hl != 0 ? hl : 1.0f;
+      hx /= hs, hy /= hs, hz /= hs;
+      auto nh         = nx * hx + ny * hy + nz * hz;
+      auto uph        = flip ? -nh : nh;
+      auto hi         = hx * ix + hy * iy + hz * iz;
+      auto ho         = hx * ox + hy * oy + hz * oz;
+      auto roughness2 = roughness[lane] * roughness[lane];
+      auto D          = lane_microfacet_distribution(roughness2, uph);
+      auto G          = lane_microfacet_shadowing1(roughness2, upo, ho) *
+               lane_microfacet_shadowing1(roughness2, upi, hi);
+      auto specular       = D * G / (4 * upo * upi) * std::abs(upi);
+      auto microfacet_pdf = D * max(uph, 0.0f) / (4 * std::abs(ho));
+
+      if constexpr (type == material_type::glossy) {
+        auto F1      = lane_fresnel_dielectric(ior[lane], std::abs(upo));
+        auto F       = lane_fresnel_dielectric(ior[lane], std::abs(hi));
+        auto diffuse = (1 - F1) / pif * std::abs(upi);
+        bsdfcos      = {cr * diffuse + F * specular,
+            cg * diffuse + F * specular, cb * diffuse + F * specular};
+        pdf          = F1 * microfacet_pdf + (1 - F1) * hemi;
+      } else if constexpr (type == material_type::reflective) {
+        bsdfcos = {lane_fresnel_conductor(cr, hi) * specular,
+            lane_fresnel_conductor(cg, hi) * specular,
+            lane_fresnel_conductor(cb, hi) * specular};
+        pdf     = microfacet_pdf;
+      } else if constexpr (type == material_type::gltfpbr) {
+        auto m       = metallic[lane];
+        auto eta     = ((ior[lane] - 1) * (ior[lane] - 1)) /
+                   ((ior[lane] + 1) * (ior[lane] + 1));
+        auto rr      = eta * (1 - m) + cr * m;
+        auto rg      = eta * (1 - m) + cg * m;
+        auto rb      = eta * (1 - m) + cb * m;
+        auto black   = (rr == 0) & (rg == 0) & (rb == 0);
+        auto F1r     = lane_fresnel_schlick(rr, black, upo);
+        auto F1g     = lane_fresnel_schlick(rg, black, upo);
+        auto F1b     = lane_fresnel_schlick(rb, black, upo);
+        auto diffuse = (1 - m) / pif * std::abs(upi);
+        bsdfcos = {cr * diffuse * (1 - F1r) +
+                       lane_fresnel_schlick(rr, black, hi) * specular,
+            cg * diffuse * (1 - F1g) +
+                lane_fresnel_schlick(rg, black, hi) * specular,
+            cb * diffuse * (1 - F1b) +
+                lane_fresnel_schlick(rb, black, hi) * specular};
+        auto F = (F1r + F1g + F1b) / 3;
+        pdf    = F * microfacet_pdf + (1 - F) * hemi;
+      }
+    }
+
+    // results are stored before being zeroed, so that their terms are not
+    // moved under the condition
+    lane_bsdfcos[0][lane] = bsdfcos.x;
+    lane_bsdfcos[1][lane] = bsdfcos.y;
+    lane_bsdfcos[2][lane] = bsdfcos.z;
+    lane_pdf[lane]        = pdf;
+    if (zero) {
+      lane_bsdfcos[0][lane] = 0;
+      lane_bsdfcos[1][lane] = 0;
+      lane_bsdfcos[2][lane] = 0;
+      lane_pdf[lane]        = 0;
+    }
+  }
+  for (auto axis = 0; axis < 3; axis++) {
+    for (auto lane = 0; lane < shading_lanes; lane++) {
+      bsdfcos[axis][lane] += lane_bsdfcos[axis][lane];
+    }
+  }
+  for (auto lane = 0; lane < shading_lanes; lane++) {
+    pdf[lane] += lane_pdf[lane];
+  }
+}
+
+// Evaluates the BRDF scaled by the cosine of the incoming direction, and the
+// pdf of BRDF sampling, for a batch. Lanes without a batched material, as in
+// `is_batched`, are zero. Each kernel runs only if one of its lanes is
+// present, so batches of sorted paths run a single kernel.
+inline void eval_bsdfcos_lanes(
+    const shading_batch& batch, vec3f_lanes& bsdfcos, float_lanes& pdf) {
+  auto matte = false, glossy = false, reflective = false, gltfpbr = false;
+  for (auto type : batch.type) {
+    matte |= type == material_type::matte;
+    glossy |= type == material_type::glossy;
+    reflective |= type == material_type::reflective;
+    gltfpbr |= type == material_type::gltfpbr;
+  }
+  bsdfcos = {};
+  pdf     = {};
+  if (matte)
+    eval_bsdfcos_lanes<material_type::matte>(batch, bsdfcos, pdf);
+  if (glossy)
+    eval_bsdfcos_lanes<material_type::glossy>(batch, bsdfcos, pdf);
+  if (reflective)
+    eval_bsdfcos_lanes<material_type::reflective>(batch, bsdfcos, pdf);
+  if (gltfpbr)
+    eval_bsdfcos_lanes<material_type::gltfpbr>(batch, bsdfcos, pdf);
+}
+
+}  // namespace yash
@@ -902,6 +902,11 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
   // hit
   auto hit = false;
 
+  // surfaces may have no radius
+  auto radius = [&shape](int vertex) {
+    return shape.radius.empty() ? 0.0f : shape.radius[vertex];
+  };
+
   // walking stack
   while (node_cur != 0) {
     // grab node
@@ -944,8 +949,8 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
         auto  primitive = bvh.primitives[node.start + idx];
         auto& t         = shape.triangles[primitive];
         if (overlap_triangle(pos, max_distance, shape.positions[t.x],
-                shape.positions[t.y], shape.positions[t.z], shape.radius[t.x],
-                shape.radius[t.y], shape.radius[t.z], uv, distance)) {
+                shape.positions[t.y], shape.positions[t.z], radius(t.x),
+                radius(t.y), radius(t.z), uv, distance)) {
           hit          = true;
           element      = primitive;
           max_distance = distance;
@@ -957,8 +962,8 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
         auto& q         = shape.quads[primitive];
         if (overlap_quad(pos, max_distance, shape.positions[q.x],
                 shape.positions[q.y], shape.positions[q.z],
-                shape.positions[q.w], shape.radius[q.x], shape.radius[q.y],
-                shape.radius[q.z], shape.radius[q.w], uv, distance)) {
+                shape.positions[q.w], radius(q.x), radius(q.y), radius(q.z),
+                radius(q.w), uv, distance)) {
           hit          = true;
           element      = primitive;
           max_distance = distance;
@@ -974,9 +979,11 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
 }
 
 // Intersect ray with a bvh.
+// If given, `inv_frames` are the inverse instance frames.
 static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, int& instance, int& element,
-    vec2f& uv, float& distance, bool find_any, bool non_rigid_frames) {
+    vec2f& uv, float& distance, bool find_any, bool non_rigid_frames,
+    const frame3f* inv_frames = nullptr) {
   // check if empty
   if (bvh.nodes.empty()) return false;
 
@@ -1009,7 +1016,9 @@ static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
         auto& shape     = scene.shapes[instance_.shape];
         auto& sbvh      = bvh.shapes[instance_.shape];
         auto  inv_pos   = transform_point(
-            inverse(instance_.frame, non_rigid_frames), pos);
+            inv_frames ? inv_frames[primitive]
+                       : inverse(instance_.frame, non_rigid_frames),
+            pos);
         if (overlap_bvh(sbvh, shape, inv_pos, max_distance, element, uv,
                 distance, find_any)) {
           hit          = true;
@@ -1112,6 +1121,13 @@ bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
   return intersection;
 }
 
+bvh_intersection overlap_bvh(const bvh_data& bvh, const shape_data& shape,
+    const vec3f& pos, float max_distance, bool find_any) {
+  auto intersection = bvh_intersection{};
+  intersection.hit  = overlap_bvh(bvh, shape, pos, max_distance,
+      intersection.element, intersection.uv, intersection.distance, find_any);
+  return intersection;
+}
 bvh_intersection overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, bool find_any,
     bool non_rigid_frames) {
@@ -1122,4 +1138,87 @@ bvh_intersection overlap_bvh(const bvh_data& bvh, const scene_data& scene,
   return intersection;
 }
 
+// Sort queries along a Morton curve, so that consecutive queries visit the
+// same nodes. Returns the query indices in sorted order.
+static vector<int> sort_overlap_queries(const vector<vec3f>& positions) {
+  auto bbox = invalidb3f;
+  for (auto& position : positions) bbox = merge(bbox, position);
+  auto extent = max(bbox.max - bbox.min, vec3f{1e-20f, 1e-20f, 1e-20f});
+  auto expand = [](uint64_t x) {
+    x = (x | (x << 32)) & 0x001f00000000ffffull;
+    x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+    x = (x | (x << 8)) & 0x100f00f00f00f00full;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+    x = (x | (x << 2)) & 0x1249249249249249ull;
+    return x;
+  };
+  auto codes = vector<pair<uint64_t, int>>(positions.size());
+  for (auto idx = 0; idx < (int)positions.size(); idx++) {
+    auto p = (positions[idx] - bbox.min) / extent * 2097151.0f;
+    codes[idx] = {(expand((uint64_t)p.x) << 2) | (expand((uint64_t)p.y) << 1) |
+                      expand((uint64_t)p.z),
+        idx};
+  }
+  std::sort(codes.begin(), codes.end());
+  auto order = vector<int>(positions.size());
+  for (auto idx = 0; idx < (int)codes.size(); idx++) {
+    order[idx] = codes[idx].second;
+  }
+  return order;
+}
+
+// Run batched overlap queries in spatial order, in parallel over contiguous
+// ranges of sorted queries.
+template <typename Overlap>
+static bvh_overlaps overlap_bvh_batch(const vector<vec3f>& positions,
+    bool noparallel, Overlap&& overlap) {
+  auto overlaps = bvh_overlaps{};
+  overlaps.instances.assign(positions.size(), -1);
+  overlaps.elements.assign(positions.size(), -1);
+  overlaps.uvs.assign(positions.size(), {0, 0});
+  overlaps.distances.assign(positions.size(), 0);
+  auto order = sort_overlap_queries(positions);
+  auto query = [&](int sorted) {
+    auto idx = order[sorted];
+    if (!overlap(positions[idx], overlaps.instances[idx],
+            overlaps.elements[idx], overlaps.uvs[idx],
+            overlaps.distances[idx])) {
+      overlaps.instances[idx] = -1;
+      overlaps.elements[idx]  = -1;
+    }
+  };
+  if (noparallel) {
+    for (auto sorted = 0; sorted < (int)order.size(); sorted++) query(sorted);
+  } else {
+    parallel_for_batch((int)order.size(), 1024, query);
+  }
+  return overlaps;
+}
+
+bvh_overlaps overlap_bvh(const bvh_data& bvh, const shape_data& shape,
+    const vector<vec3f>& positions, float max_distance, bool find_any,
+    bool noparallel) {
+  return overlap_bvh_batch(positions, noparallel,
+      [&](const vec3f& pos, int& /*instance*/, int& element, vec2f& uv,
+          float& distance) {
+        return overlap_bvh(
+            bvh, shape, pos, max_distance, element, uv, distance, find_any);
+      });
+}
+bvh_overlaps overlap_bvh(const bvh_data& bvh, const scene_data& scene,
+    const vector<vec3f>& positions, float max_distance, bool find_any,
+    bool non_rigid_frames, bool noparallel) {
+  // inverse frames are computed once for all queries
+  auto inv_frames = vector<frame3f>(scene.instances.size());
+  for (auto idx = 0; idx < (int)scene.instances.size(); idx++) {
+    inv_frames[idx] = inverse(scene.instances[idx].frame, non_rigid_frames);
+  }
+  return overlap_bvh_batch(positions, noparallel,
+      [&](const vec3f& pos, int& instance, int& element, vec2f& uv,
+          float& distance) {
+        return overlap_bvh(bvh, scene, pos, max_distance, instance, element,
+            uv, distance, find_any, non_rigid_frames, inv_frames.data());
+      });
+}
+
 }  // namespace yocto
@@ -138,6 +138,26 @@ bvh_intersection overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, bool find_any = false,
     bool non_rigid_frames = true);
 
+// Results of batched overlap queries, stored as arrays indexed by query.
+// Queries that do not overlap have element -1. Shape queries do not set the
+// instance ids.
+struct bvh_overlaps {
+  vector<int>   instances = {};
+  vector<int>   elements  = {};
+  vector<vec2f> uvs       = {};
+  vector<float> distances = {};
+};
+
+// Find the shape elements that overlap a batch of points within a given max
+// distance, as in `overlap_bvh`. Queries are sorted spatially and run in
+// parallel, and results are returned in query order.
+bvh_overlaps overlap_bvh(const bvh_data& bvh, const shape_data& shape,
+    const vector<vec3f>& positions, float max_distance, bool find_any = false,
+    bool noparallel = false);
+bvh_overlaps overlap_bvh(const bvh_data& bvh, const scene_data& scene,
+    const vector<vec3f>& positions, float max_distance, bool find_any = false,
+    bool non_rigid_frames = true, bool noparallel = false);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
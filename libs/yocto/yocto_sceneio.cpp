@@ -2545,14 +2545,14 @@ bool make_scene_preset(
 namespace yocto {
 
 // Load/save a scene in the builtin JSON format.
-static bool load_json_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel);
+static bool load_json_scene(const string& filename, scene_data& scene,
+    string& error, const texture_loader& loader, bool noparallel);
 static bool save_json_scene(const string& filename, const scene_data& scene,
     string& error, bool noparallel);
 
 // Load/save a scene from/to OBJ.
-static bool load_obj_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel);
+static bool load_obj_scene(const string& filename, scene_data& scene,
+    string& error, const texture_loader& loader, bool noparallel);
 static bool save_obj_scene(const string& filename, const scene_data& scene,
     string& error, bool noparallel);
 
@@ -2569,31 +2569,41 @@ static bool save_stl_scene(const string& filename, const scene_data& scene,
     string& error, bool noparallel);
 
 // Load/save a scene from/to glTF.
-static bool load_gltf_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel);
+static bool load_gltf_scene(const string& filename, scene_data& scene,
+    string& error, const texture_loader& loader, bool noparallel);
 static bool save_gltf_scene(const string& filename, const scene_data& scene,
     string& error, bool noparallel);
 
 // Load/save a scene from/to pbrt-> This is not robust at all and only
 // works on scene that have been previously adapted since the two renderers
 // are too different to match.
-static bool load_pbrt_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel);
+static bool load_pbrt_scene(const string& filename, scene_data& scene,
+    string& error, const texture_loader& loader, bool noparallel);
 static bool save_pbrt_scene(const string& filename, const scene_data& scene,
     string& error, bool noparallel);
 
 // Load a scene
 bool load_scene(
     const string& filename, scene_data& scene, string& error, bool noparallel) {
+  auto loader = [](const string& filename, texture_data& texture,
+                    string& error) {
+    return load_texture(filename, texture, error);
+  };
+  return load_scene(filename, scene, error, loader, noparallel);
+}
+
+// Load a scene with a texture loader
+bool load_scene(const string& filename, scene_data& scene, string& error,
+    const texture_loader& loader, bool noparallel) {
   auto ext = path_extension(filename);
   if (ext == ".json" || ext == ".JSON") {
-    return load_json_scene(filename, scene, error, noparallel);
+    return load_json_scene(filename, scene, error, loader, noparallel);
   } else if (ext == ".obj" || ext == ".OBJ") {
-    return load_obj_scene(filename, scene, error, noparallel);
+    return load_obj_scene(filename, scene, error, loader, noparallel);
   } else if (ext == ".gltf" || ext == ".GLTF") {
-    return load_gltf_scene(filename, scene, error, noparallel);
+    return load_gltf_scene(filename, scene, error, loader, noparallel);
   } else if (ext == ".pbrt" || ext == ".PBRT") {
-    return load_pbrt_scene(filename, scene, error, noparallel);
+    return load_pbrt_scene(filename, scene, error, loader, noparallel);
   } else if (ext == ".ply" || ext == ".PLY") {
     return load_ply_scene(filename, scene, error, noparallel);
   } else if (ext == ".stl" || ext == ".STL") {
@@ -2852,7 +2862,8 @@ NLOHMANN_JSON_SERIALIZE_ENUM(
 
 // Load a scene in the builtin JSON format.
 static bool load_json_scene_version40(const string& filename,
-    const json_value& json, scene_data& scene, string& error, bool noparallel) {
+    const json_value& json, scene_data& scene, string& error,
+    const texture_loader& loader, bool noparallel) {
   auto parse_error = [filename, &error](const string& patha,
                          const string& pathb = "", const string& pathc = "") {
     auto path = patha;
@@ -3116,7 +3127,7 @@ static bool load_json_scene_version40(const string& filename,
     for (auto& texture : scene.textures) {
       auto path = find_path(get_texture_name(scene, texture), "textures",
           {".hdr", ".exr", ".png", ".jpg"});
-      if (!load_texture(path_join(dirname, path), texture, error))
+      if (!loader(path_join(dirname, path), texture, error))
         return dependent_error();
     }
     // load instances
@@ -3147,7 +3158,7 @@ static bool load_json_scene_version40(const string& filename,
             scene.textures, error, [&](auto& texture, string& error) {
               auto path = find_path(get_texture_name(scene, texture),
                   "textures", {".hdr", ".exr", ".png", ".jpg"});
-              return load_texture(path_join(dirname, path), texture, error);
+              return loader(path_join(dirname, path), texture, error);
             }))
       return dependent_error();
     // load instances
@@ -3203,10 +3214,12 @@ static bool load_json_scene_version40(const string& filename,
 
 // Load a scene in the builtin JSON format.
 static bool load_json_scene_version41(const string& filename, json_value& json,
-    scene_data& scene, string& error, bool noparallel) {
+    scene_data& scene, string& error, const texture_loader& loader,
+    bool noparallel) {
   // check version
   if (!json.contains("asset") || !json.at("asset").contains("version"))
-    return load_json_scene_version40(filename, json, scene, error, noparallel);
+    return load_json_scene_version40(
+        filename, json, scene, error, loader, noparallel);
 
   // parse json value
   auto get_opt = [](const json_value& json, const string& key, auto& value) {
@@ -3407,7 +3420,7 @@ static bool load_json_scene_version41(const string& filename, json_value& json,
     }
     // load textures
     for (auto idx : range(scene.textures.size())) {
-      if (!load_texture(texture_filenames[idx], scene.textures[idx], error))
+      if (!loader(texture_filenames[idx], scene.textures[idx], error))
         return dependent_error();
     }
   } else {
@@ -3428,8 +3441,7 @@ static bool load_json_scene_version41(const string& filename, json_value& json,
     // load textures
     if (!parallel_for(
             scene.textures.size(), error, [&](size_t idx, string& error) {
-              return load_texture(
-                  texture_filenames[idx], scene.textures[idx], error);
+              return loader(texture_filenames[idx], scene.textures[idx], error);
             }))
       return dependent_error();
   }
@@ -3444,18 +3456,20 @@ static bool load_json_scene_version41(const string& filename, json_value& json,
 }
 
 // Load a scene in the builtin JSON format.
-static bool load_json_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel) {
+static bool load_json_scene(const string& filename, scene_data& scene,
+    string& error, const texture_loader& loader, bool noparallel) {
   // open file
   auto json = json_value{};
   if (!load_json(filename, json, error)) return false;
 
   // check version
   if (!json.contains("asset") || !json.at("asset").contains("version"))
-    return load_json_scene_version40(filename, json, scene, error, noparallel);
+    return load_json_scene_version40(
+        filename, json, scene, error, loader, noparallel);
   if (json.contains("asset") && json.at("asset").contains("version") &&
       json.at("asset").at("version") == "4.1")
-    return load_json_scene_version41(filename, json, scene, error, noparallel);
+    return load_json_scene_version41(
+        filename, json, scene, error, loader, noparallel);
 
   // parse json value
   auto get_opt = [](const json_value& json, const string& key, auto& value) {
@@ -3622,7 +3636,7 @@ static bool load_json_scene(
     }
     // load textures
     for (auto idx : range(scene.textures.size())) {
-      if (!load_texture(path_join(dirname, texture_filenames[idx]),
+      if (!loader(path_join(dirname, texture_filenames[idx]),
               scene.textures[idx], error))
         return dependent_error();
     }
@@ -3644,7 +3658,7 @@ static bool load_json_scene(
     // load textures
     if (!parallel_for(
             scene.textures.size(), error, [&](size_t idx, string& error) {
-              return load_texture(path_join(dirname, texture_filenames[idx]),
+              return loader(path_join(dirname, texture_filenames[idx]),
                   scene.textures[idx], error);
             }))
       return dependent_error();
@@ -3914,8 +3928,8 @@ static bool save_json_scene(const string& filename, const scene_data& scene,
 namespace yocto {
 
 // Loads an OBJ
-static bool load_obj_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel) {
+static bool load_obj_scene(const string& filename, scene_data& scene,
+    string& error, const texture_loader& loader, bool noparallel) {
   // load obj
   auto obj = obj_model{};
   if (!load_obj(filename, obj, error, false, true)) return false;
@@ -4026,7 +4040,7 @@ static bool load_obj_scene(
     // load textures
     for (auto& texture : scene.textures) {
       auto& path = texture_paths[&texture - &scene.textures.front()];
-      if (!load_texture(path_join(dirname, path), texture, error))
+      if (!loader(path_join(dirname, path), texture, error))
         return dependent_error();
     }
   } else {
@@ -4034,7 +4048,7 @@ static bool load_obj_scene(
     if (!parallel_foreach(
             scene.textures, error, [&](auto& texture, string& error) {
               auto& path = texture_paths[&texture - &scene.textures.front()];
-              return load_texture(path_join(dirname, path), texture, error);
+              return loader(path_join(dirname, path), texture, error);
             }))
       return dependent_error();
   }
@@ -4226,8 +4240,8 @@ static bool save_stl_scene(const string& filename, const scene_data& scene,
 namespace yocto {
 
 // Load a scene
-static bool load_gltf_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel) {
+static bool load_gltf_scene(const string& filename, scene_data& scene,
+    string& error, const texture_loader& loader, bool noparallel) {
   // load gltf
   auto gltf = json_value{};
   if (!load_json(filename, gltf, error)) return false;
@@ -4671,7 +4685,7 @@ static bool load_gltf_scene(
     // load texture
     for (auto& texture : scene.textures) {
       auto& path = texture_paths[&texture - &scene.textures.front()];
-      if (!load_texture(path_join(dirname, path), texture, error))
+      if (!loader(path_join(dirname, path), texture, error))
         return dependent_error();
     }
   } else {
@@ -4679,7 +4693,7 @@ static bool load_gltf_scene(
     if (!parallel_foreach(
             scene.textures, error, [&](auto& texture, string& error) {
               auto& path = texture_paths[&texture - &scene.textures.front()];
-              return load_texture(path_join(dirname, path), texture, error);
+              return loader(path_join(dirname, path), texture, error);
             }))
       return dependent_error();
   }
@@ -5043,8 +5057,8 @@ static bool save_gltf_scene(const string& filename, const scene_data& scene,
 namespace yocto {
 
 // load pbrt scenes
-static bool load_pbrt_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel) {
+static bool load_pbrt_scene(const string& filename, scene_data& scene,
+    string& error, const texture_loader& loader, bool noparallel) {
   // load pbrt
   auto pbrt = pbrt_model{};
   if (!load_pbrt(filename, pbrt, error)) return false;
@@ -5157,7 +5171,7 @@ static bool load_pbrt_scene(
     // load texture
     for (auto& texture : scene.textures) {
       auto& path = texture_paths[&texture - &scene.textures.front()];
-      if (!load_texture(path_join(dirname, path), texture, error))
+      if (!loader(path_join(dirname, path), texture, error))
         return dependent_error();
     }
   } else {
@@ -5172,7 +5186,7 @@ static bool load_pbrt_scene(
     if (!parallel_foreach(
             scene.textures, error, [&](auto& texture, string& error) {
               auto& path = texture_paths[&texture - &scene.textures.front()];
-              return load_texture(path_join(dirname, path), texture, error);
+              return loader(path_join(dirname, path), texture, error);
             }))
       return dependent_error();
   }
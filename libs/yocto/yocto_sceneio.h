@@ -38,6 +38,7 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
+#include <functional>
 #include <string>
 
 #include "yocto_scene.h"
@@ -206,6 +207,16 @@ io_status add_environment(scene_data& scene, const string& filename);
 // Load/save a scene in the supported formats.
 bool load_scene(const string& filename, scene_data& scene, string& error,
     bool noparallel = false);
+
+// Loader of scene textures, called for each texture file in place of
+// `load_texture`, possibly from multiple threads.
+using texture_loader = std::function<bool(
+    const string& filename, texture_data& texture, string& error)>;
+
+// Load a scene, reading its textures with `loader`, as used to stream
+// textures instead of keeping them all in memory.
+bool load_scene(const string& filename, scene_data& scene, string& error,
+    const texture_loader& loader, bool noparallel = false);
 bool save_scene(const string& filename, const scene_data& scene, string& error,
     bool noparallel = false);
 
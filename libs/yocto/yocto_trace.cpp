@@ -1472,6 +1472,13 @@ static void check_image(
         linear ? "expected linear image" : "expected srgb image"};
 }
 
+// Scale of the accumulated values of a pixel. Pixels have their own sample
+// count with adaptive sampling.
+static float get_scale(const trace_state& state, int idx) {
+  if (state.pixel_samples.empty()) return 1.0f / (float)state.samples;
+  return 1.0f / (float)max(state.pixel_samples[idx], 1);
+}
+
 // Get resulting render
 image_data get_render(const trace_state& state) {
   auto image = make_image(state.width, state.height, true);
@@ -1480,9 +1487,8 @@ image_data get_render(const trace_state& state) {
 }
 void get_render(image_data& image, const trace_state& state) {
   check_image(image, state.width, state.height, true);
-  auto scale = 1.0f / (float)state.samples;
   for (auto idx = 0; idx < state.width * state.height; idx++) {
-    image.pixels[idx] = state.image[idx] * scale;
+    image.pixels[idx] = state.image[idx] * get_scale(state, idx);
   }
 }
 
@@ -1504,10 +1510,9 @@ void get_denoised(image_data& image, const trace_state& state) {
   // get albedo and normal
   auto albedo = vector<vec3f>(image.pixels.size()),
        normal = vector<vec3f>(image.pixels.size());
-  auto scale  = 1.0f / (float)state.samples;
   for (auto idx = 0; idx < state.width * state.height; idx++) {
-    albedo[idx] = state.albedo[idx] * scale;
-    normal[idx] = state.normal[idx] * scale;
+    albedo[idx] = state.albedo[idx] * get_scale(state, idx);
+    normal[idx] = state.normal[idx] * get_scale(state, idx);
   }
 
   // Create a denoising filter
@@ -1539,8 +1544,8 @@ image_data get_albedo(const trace_state& state) {
 }
 void get_albedo(image_data& albedo, const trace_state& state) {
   check_image(albedo, state.width, state.height, true);
-  auto scale = 1.0f / (float)state.samples;
   for (auto idx = 0; idx < state.width * state.height; idx++) {
+    auto scale         = get_scale(state, idx);
     albedo.pixels[idx] = {state.albedo[idx].x * scale,
         state.albedo[idx].y * scale, state.albedo[idx].z * scale, 1.0f};
   }
@@ -1552,13 +1557,32 @@ image_data get_normal(const trace_state& state) {
 }
 void get_normal(image_data& normal, const trace_state& state) {
   check_image(normal, state.width, state.height, true);
-  auto scale = 1.0f / (float)state.samples;
   for (auto idx = 0; idx < state.width * state.height; idx++) {
+    auto scale         = get_scale(state, idx);
     normal.pixels[idx] = {state.normal[idx].x * scale,
         state.normal[idx].y * scale, state.normal[idx].z * scale, 1.0f};
   }
 }
 
+// Get a heatmap of the samples taken by each pixel. Counts are normalized by
+// the largest one and mapped with the viridis colormap.
+image_data get_samples(const trace_state& state) {
+  auto samples = make_image(state.width, state.height, false);
+  get_samples(samples, state);
+  return samples;
+}
+void get_samples(image_data& samples, const trace_state& state) {
+  check_image(samples, state.width, state.height, false);
+  auto max_samples = state.samples;
+  for (auto count : state.pixel_samples) max_samples = max(max_samples, count);
+  for (auto idx = 0; idx < state.width * state.height; idx++) {
+    auto count = state.pixel_samples.empty() ? state.samples
+                                             : state.pixel_samples[idx];
+    auto color = colormap((float)count / (float)max(max_samples, 1));
+    samples.pixels[idx] = {color.x, color.y, color.z, 1};
+  }
+}
+
 // Denoise image
 image_data denoise_render(const image_data& render, const image_data& albedo,
     const image_data& normal) {
@@ -59,6 +59,7 @@ namespace yocto {
 using std::atomic;
 using std::future;
 using std::pair;
+using std::shared_ptr;
 using std::string;
 using std::vector;
 
@@ -89,6 +90,19 @@ enum struct trace_falsecolor_type {
   // clang-format on
 };
 
+// Order in which image tiles are scheduled
+enum struct trace_tile_order {
+  morton,       // tiles along a Morton curve
+  centerfirst,  // tiles closer to the image center first
+};
+
+// Sequence of the random numbers of samples
+enum struct trace_sequence_type {
+  independent,  // independent random numbers
+  sobol,        // Owen-scrambled Sobol points
+  bluenoise,    // Sobol points dithered with blue noise
+};
+
 // Default trace seed
 const auto trace_default_seed = 961748941ull;
 
@@ -99,14 +113,30 @@ struct trace_params {
   trace_sampler_type    sampler        = trace_sampler_type::path;
   trace_falsecolor_type falsecolor     = trace_falsecolor_type::color;
   int                   samples        = 512;
+  int                   firstsample    = 0;
   int                   bounces        = 8;
   float                 clamp          = 10;
   bool                  nocaustics     = false;
   bool                  envhidden      = false;
   bool                  tentfilter     = false;
   uint64_t              seed           = trace_default_seed;
+  trace_sequence_type   sequence       = trace_sequence_type::independent;
   bool                  embreebvh      = false;
   bool                  highqualitybvh = false;
+  bool                  packedbvh      = false;
+  bool                  spatialbvh     = false;
+  float                 spatialbudget  = 0.5f;
+  bool                  raypackets     = false;
+  bool                  wavefront      = false;
+  bool                  sortpaths      = false;
+  bool                  batchshading   = false;
+  bool                  tiled          = false;
+  int                   tilesize       = 16;
+  trace_tile_order      tileorder      = trace_tile_order::morton;
+  float                 targeterror    = 0;
+  bool                  lightbvh       = false;
+  bool                  mipmaps        = false;
+  bool                  trilinear      = false;
   bool                  noparallel     = false;
   int                   pratio         = 8;
   float                 exposure       = 0;
@@ -125,16 +155,49 @@ image_data trace_image(const scene_data& scene, const trace_params& params);
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Distribution of an environment map, as a cdf over rows and a cdf over the
+// texels of each row. Distributions are shared between lights made from the
+// same texture.
+struct trace_environment_distribution {
+  vector<float> rows_cdf   = {};
+  vector<float> texels_cdf = {};
+};
+
 // Scene lights used during rendering. These are created automatically.
 struct trace_light {
   int           instance     = invalidid;
   int           environment  = invalidid;
   vector<float> elements_cdf = {};
+
+  // alias table over the elements of instance lights
+  vector<float> alias_probs = {};
+  vector<int>   alias_ids   = {};
+
+  // distribution of environment maps
+  shared_ptr<const trace_environment_distribution> distribution = {};
+};
+
+// Node of the light bvh. Nodes bound the position, orientation and power of
+// their lights. Internal nodes store their first child, and the second child
+// follows it. Leaves store one light.
+struct trace_light_node {
+  bbox3f bbox   = invalidb3f;
+  vec3f  axis   = {0, 0, 1};  // axis of the cone of emitter normals
+  float  theta  = 0;          // angle of the cone of emitter normals
+  float  power  = 0;
+  int    child  = -1;
+  int    light  = -1;
+  int    parent = -1;
 };
 
 // Scene lights
 struct trace_lights {
   vector<trace_light> lights = {};
+
+  // light bvh over instance lights, built if `lightbvh` is set
+  vector<trace_light_node> nodes        = {};
+  vector<int>              leaves       = {};  // leaf of each light
+  vector<int>              environments = {};  // environment lights
 };
 
 // Check is a sampler requires lights
@@ -150,6 +213,11 @@ struct trace_state {
   vector<vec3f>     normal  = {};
   vector<int>       hits    = {};
   vector<rng_state> rngs    = {};
+
+  // adaptive sampling, used if `targeterror` is set
+  vector<int>     pixel_samples = {};
+  vector<vec4f>   halfimage     = {};
+  vector<uint8_t> converged     = {};
 };
 
 // Initialize state.
@@ -183,6 +251,10 @@ void       get_albedo(image_data& albedo, const trace_state& state);
 image_data get_normal(const trace_state& state);
 void       get_normal(image_data& normal, const trace_state& state);
 
+// Get a heatmap of the samples taken by each pixel
+image_data get_samples(const trace_state& state);
+void       get_samples(image_data& samples, const trace_state& state);
+
 // Denoise image
 image_data denoise_render(const image_data& render, const image_data& albedo,
     const image_data& normal);
@@ -206,6 +278,14 @@ inline const auto trace_falsecolor_names = vector<string>{"position", "normal",
     "emission", "roughness", "opacity", "metallic", "delta", "instance",
     "shape", "material", "element", "highlight"};
 
+// tile order names
+inline const auto trace_tileorder_names = vector<string>{
+    "morton", "centerfirst"};
+
+// trace sequence names
+inline const auto trace_sequence_names = vector<string>{
+    "independent", "sobol", "bluenoise"};
+
 // trace sampler labels
 inline const auto trace_sampler_labels =
     vector<pair<trace_sampler_type, string>>{{trace_sampler_type::path, "path"},